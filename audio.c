@@ -47,49 +47,692 @@ static inline int host_is_big_endian() {
   return 0;
 }
 
-static float get_clamp(pcm_t *pcm){
+float get_clamp(pcm_t *pcm){
   if(pcm->nativebits>=0 && pcm->nativebits<24)
     return 1.f - 1.f/(1<<(pcm->nativebits-1));
   else
     return 1.f - 1.f/2147483648.f;
 }
 
-float check_warn_clipping(pcm_t *pcm, int no_normalize){
-  int i,j;
-  int cpf = pcm->ch;
-  int s = pcm->size/sizeof(float);
-  float clamp;
-  float min,max;
-  int flag[cpf];
-  size_t count=0;
-  float *d = (float *)pcm->data;
+/* TPDF dither is stateless: the value for interleaved output sample i
+   is the sum of the two signed 16 bit halves of a hash of the seeded
+   sample counter, so it vectorizes, is safe from any thread, and is
+   reproducible for a given seed.  The sequence repeats every 2^32
+   samples. */
+static inline uint32_t dither_key(void){
+  return sb_dither_seed*0x9e3779b9U;
+}
 
-  memset(flag,0,sizeof(flag));
+static inline uint32_t dither_hash(uint32_t x){
+  x ^= x>>16;
+  x *= 0x7feb352dU;
+  x ^= x>>15;
+  x *= 0x846ca68bU;
+  x ^= x>>16;
+  return x;
+}
 
-  if(sb_verbose)
-    fprintf(stderr,"\rLoading %s: checking for clipping...",pcm->name);
+/* +/- 1 LSB at 16 bits */
+static inline float tpdf_dither(uint32_t key, off_t i){
+  uint32_t h = dither_hash(key+(uint32_t)i);
+  return (((int32_t)h>>16) + (int16_t)h) * (1.f/65536.f);
+}
 
-  clamp = max = get_clamp(pcm);
-  min=-1.f;
+static inline void quant_32(unsigned char *d, float f){
+  float val = rint(f*2147483648.f);
+  int iv;
+  /* 2147483647.f is 2^31 as a float; saturate rather than wrap */
+  if(val>=2147483648.f)
+    iv = 2147483647;
+  else if(val<-2147483648.f)
+    iv = -2147483647-1;
+  else
+    iv = (int)val;
+  d[0]=iv&0xff;
+  d[1]=(iv>>8)&0xff;
+  d[2]=(iv>>16)&0xff;
+  d[3]=(iv>>24)&0xff;
+}
+
+static inline void quant_24(unsigned char *d, float f){
+  float val = rint(f*8388608.f);
+  int iv;
+  if(val<-8388608.f) val = -8388608.f;
+  if(val> 8388607.f) val = 8388607.f;
+  iv=(int)val;
+  d[0]=iv&0xff;
+  d[1]=(iv>>8)&0xff;
+  d[2]=(iv>>16)&0xff;
+}
+
+static inline void put_16(unsigned char *d, float val){
+  if(val>=32767.f){
+    d[0]=0xff;
+    d[1]=0x7f;
+  }else if(val<=-32768.f){
+    d[0]=0x00;
+    d[1]=0x80;
+  }else{
+    int iv = (int)val;
+    d[0]=iv&0xff;
+    d[1]=(iv>>8)&0xff;
+  }
+}
+
+/* dither is 0 for plain truncation */
+static inline void quant_16(unsigned char *d, float f, float dither){
+  put_16(d,rint(f*32768.f + dither));
+}
+
+/* Noise shaping feeds each channel's past requantization error (dither
+   included) back through an FIR, giving a noise transfer function of
+   1 - H(z).  The error is taken before clamping so that clipping can't
+   destabilize the loop.  The weighted filters are the usual ones for
+   44.1/48kHz. */
+#define SHAPE_LEN 16 /* history per channel; a power of two > max order */
+
+typedef struct {
+  const char *name;
+  int order;
+  float h[9];
+} dither_shape;
+
+static const dither_shape shapes[]={
+  {"flat",0,{0}},
+  {"hp1",1,{1.f}},
+  {"hp2",2,{2.f,-1.f}},
+  {"lipshitz",5,{2.033f,-2.165f,1.959f,-1.590f,.6149f}},
+  {"wannamaker3",3,{1.623f,-.982f,.109f}},
+  {"wannamaker9",9,{2.412f,-3.370f,3.937f,-4.174f,3.353f,-2.205f,1.281f,-.569f,.0847f}},
+  {NULL,0,{0}}
+};
+
+int dither_shape_lookup(const char *name){
+  int i;
+  for(i=0;shapes[i].name;i++)
+    if(!strcmp(name,shapes[i].name))return i;
+  return -1;
+}
 
-  for(i=0;i<s;i+=pcm->ch)
-    for(j=0;j<pcm->ch;j++){
+const char *dither_shape_name(int shape){
+  return shapes[shape].name;
+}
+
+/* hist is this channel's error history, most recent at pos-1 */
+static inline void quant_16_shaped(unsigned char *d, float f, float dither,
+                                   const dither_shape *s, float *hist, int pos){
+  float v = f*32768.f;
+  float val;
+  int k;
+  for(k=0;k<s->order;k++)
+    v -= s->h[k]*hist[(pos-1-k)&(SHAPE_LEN-1)];
+  val = rint(v + dither);
+  hist[pos&(SHAPE_LEN-1)] = val-v;
+  put_16(d,val);
+}
+
+/* block quantizers; d may alias f, as the packed output never
+   overtakes the float input it replaces */
+typedef void (*quantizer)(unsigned char *d, const float *f, off_t n);
+
+static void quantize_32_c(unsigned char *d, const float *f, off_t n){
+  off_t j;
+  for(j=0;j<n;j++)
+    quant_32(d+j*4,f[j]);
+}
+
+static void quantize_24_c(unsigned char *d, const float *f, off_t n){
+  off_t j;
+  for(j=0;j<n;j++)
+    quant_24(d+j*3,f[j]);
+}
+
+static void quantize_16_c(unsigned char *d, const float *f, off_t n){
+  off_t j;
+  for(j=0;j<n;j++)
+    quant_16(d+j*2,f[j],0.f);
+}
+
+/* dithered; sample j of the block is dither sample i+j */
+typedef void (*ditherer)(unsigned char *d, const float *f, off_t n, uint32_t key, off_t i);
+
+static void dither_16_c(unsigned char *d, const float *f, off_t n, uint32_t key, off_t i){
+  off_t j;
+  for(j=0;j<n;j++)
+    quant_16(d+j*2,f[j],tpdf_dither(key,i+j));
+}
+
+/* the feedback runs sample to sample within each channel, so this goes
+   frame by frame; n is a whole number of frames.  hist (ch*SHAPE_LEN)
+   and *pos carry the filter state from one block to the next. */
+static void shape_16(unsigned char *d, const float *f, off_t n, int ch,
+                     const dither_shape *s, uint32_t key, off_t i,
+                     float *hist, int *pos){
+  off_t j;
+  int c;
+  for(j=0;j<n;j+=ch,(*pos)++)
+    for(c=0;c<ch;c++)
+      quant_16_shaped(d+(j+c)*2,f[j+c],tpdf_dither(key,i+j+c),s,hist+c*SHAPE_LEN,*pos);
+}
+
+/* The vector kernels round with the default round-to-nearest-even
+   mode, exactly as rint() does, and clamp before converting; the
+   bounds are integers, so clamping and rounding commute. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void quantize_32_sse2(unsigned char *d, const float *f, off_t n){
+  const __m128 scale = _mm_set1_ps(2147483648.f);
+  off_t j=0;
+  for(;j+4<=n;j+=4){
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(f+j),scale);
+    /* overflow converts to 0x80000000; flip the positive side */
+    __m128i i = _mm_xor_si128(_mm_cvtps_epi32(v),_mm_castps_si128(_mm_cmpge_ps(v,scale)));
+    _mm_storeu_si128((__m128i *)(d+j*4),i);
+  }
+  quantize_32_c(d+j*4,f+j,n-j);
+}
+
+__attribute__((target("sse2")))
+static void quantize_24_sse2(unsigned char *d, const float *f, off_t n){
+  const __m128 scale = _mm_set1_ps(8388608.f);
+  const __m128 lo = _mm_set1_ps(-8388608.f);
+  const __m128 hi = _mm_set1_ps(8388607.f);
+  const __m128i m0 = _mm_set_epi32(0,0xffffff,0,0xffffff);
+  const __m128i m1 = _mm_set_epi32(0xffff,0xff000000,0xffff,0xff000000);
+  off_t j=0;
+  for(;j+4<=n;j+=4){
+    __m128 v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(f+j),scale),lo),hi);
+    __m128i i = _mm_cvtps_epi32(v);
+    int w;
+    /* pack each pair into the low six bytes of its 64 bit lane,
+       then the two lanes into the low twelve bytes */
+    i = _mm_or_si128(_mm_and_si128(i,m0),_mm_and_si128(_mm_srli_epi64(i,8),m1));
+    i = _mm_or_si128(_mm_move_epi64(i),_mm_slli_si128(_mm_srli_si128(i,8),6));
+    _mm_storel_epi64((__m128i *)(d+j*3),i);
+    w = _mm_cvtsi128_si32(_mm_srli_si128(i,8));
+    memcpy(d+j*3+8,&w,4);
+  }
+  quantize_24_c(d+j*3,f+j,n-j);
+}
+
+__attribute__((target("sse2")))
+static void quantize_16_sse2(unsigned char *d, const float *f, off_t n){
+  const __m128 scale = _mm_set1_ps(32768.f);
+  const __m128 lo = _mm_set1_ps(-32768.f);
+  const __m128 hi = _mm_set1_ps(32767.f);
+  off_t j=0;
+  for(;j+8<=n;j+=8){
+    __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(f+j),scale),lo),hi);
+    __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(f+j+4),scale),lo),hi);
+    _mm_storeu_si128((__m128i *)(d+j*2),
+                     _mm_packs_epi32(_mm_cvtps_epi32(a),_mm_cvtps_epi32(b)));
+  }
+  quantize_16_c(d+j*2,f+j,n-j);
+}
+
+/* no 32 bit low multiply before SSE4.1 */
+__attribute__((target("sse2")))
+static inline __m128i mullo_sse2(__m128i a, __m128i b){
+  __m128i even = _mm_mul_epu32(a,b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a,32),_mm_srli_epi64(b,32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even,0x08),_mm_shuffle_epi32(odd,0x08));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 tpdf_dither_sse2(__m128i x){
+  x = _mm_xor_si128(x,_mm_srli_epi32(x,16));
+  x = mullo_sse2(x,_mm_set1_epi32(0x7feb352d));
+  x = _mm_xor_si128(x,_mm_srli_epi32(x,15));
+  x = mullo_sse2(x,_mm_set1_epi32(0x846ca68b));
+  x = _mm_xor_si128(x,_mm_srli_epi32(x,16));
+  x = _mm_add_epi32(_mm_srai_epi32(x,16),_mm_srai_epi32(_mm_slli_epi32(x,16),16));
+  return _mm_mul_ps(_mm_cvtepi32_ps(x),_mm_set1_ps(1.f/65536.f));
+}
+
+__attribute__((target("sse2")))
+static void dither_16_sse2(unsigned char *d, const float *f, off_t n, uint32_t key, off_t i){
+  const __m128 scale = _mm_set1_ps(32768.f);
+  const __m128 lo = _mm_set1_ps(-32768.f);
+  const __m128 hi = _mm_set1_ps(32767.f);
+  const __m128i four = _mm_set1_epi32(4);
+  __m128i ctr = _mm_add_epi32(_mm_set1_epi32(key+(uint32_t)i),_mm_setr_epi32(0,1,2,3));
+  off_t j=0;
+  for(;j+8<=n;j+=8){
+    __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f+j),scale),tpdf_dither_sse2(ctr));
+    __m128 b;
+    ctr = _mm_add_epi32(ctr,four);
+    b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f+j+4),scale),tpdf_dither_sse2(ctr));
+    ctr = _mm_add_epi32(ctr,four);
+    a = _mm_min_ps(_mm_max_ps(a,lo),hi);
+    b = _mm_min_ps(_mm_max_ps(b,lo),hi);
+    _mm_storeu_si128((__m128i *)(d+j*2),
+                     _mm_packs_epi32(_mm_cvtps_epi32(a),_mm_cvtps_epi32(b)));
+  }
+  dither_16_c(d+j*2,f+j,n-j,key,i+j);
+}
+
+__attribute__((target("avx2")))
+static void quantize_32_avx2(unsigned char *d, const float *f, off_t n){
+  const __m256 scale = _mm256_set1_ps(2147483648.f);
+  off_t j=0;
+  for(;j+8<=n;j+=8){
+    __m256 v = _mm256_mul_ps(_mm256_loadu_ps(f+j),scale);
+    __m256i i = _mm256_xor_si256(_mm256_cvtps_epi32(v),
+                                 _mm256_castps_si256(_mm256_cmp_ps(v,scale,_CMP_GE_OQ)));
+    _mm256_storeu_si256((__m256i *)(d+j*4),i);
+  }
+  quantize_32_c(d+j*4,f+j,n-j);
+}
+
+__attribute__((target("avx2")))
+static void quantize_24_avx2(unsigned char *d, const float *f, off_t n){
+  const __m256 scale = _mm256_set1_ps(8388608.f);
+  const __m256 lo = _mm256_set1_ps(-8388608.f);
+  const __m256 hi = _mm256_set1_ps(8388607.f);
+  /* three low bytes of each sample to the bottom of each 128 bit
+     lane, then dwords 0-2 and 4-6 together */
+  const __m256i shuf = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+  const __m256i perm = _mm256_setr_epi32(0,1,2,4,5,6,3,7);
+  off_t j=0;
+  for(;j+8<=n;j+=8){
+    __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(f+j),scale),lo),hi);
+    __m256i i = _mm256_shuffle_epi8(_mm256_cvtps_epi32(v),shuf);
+    i = _mm256_permutevar8x32_epi32(i,perm);
+    _mm_storeu_si128((__m128i *)(d+j*3),_mm256_castsi256_si128(i));
+    _mm_storel_epi64((__m128i *)(d+j*3+16),_mm256_extracti128_si256(i,1));
+  }
+  quantize_24_c(d+j*3,f+j,n-j);
+}
+
+__attribute__((target("avx2")))
+static void quantize_16_avx2(unsigned char *d, const float *f, off_t n){
+  const __m256 scale = _mm256_set1_ps(32768.f);
+  const __m256 lo = _mm256_set1_ps(-32768.f);
+  const __m256 hi = _mm256_set1_ps(32767.f);
+  off_t j=0;
+  for(;j+16<=n;j+=16){
+    __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(f+j),scale),lo),hi);
+    __m256 b = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(f+j+8),scale),lo),hi);
+    /* packs works within 128 bit lanes; put the quads back in order */
+    __m256i i = _mm256_packs_epi32(_mm256_cvtps_epi32(a),_mm256_cvtps_epi32(b));
+    _mm256_storeu_si256((__m256i *)(d+j*2),_mm256_permute4x64_epi64(i,0xd8));
+  }
+  quantize_16_c(d+j*2,f+j,n-j);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 tpdf_dither_avx2(__m256i x){
+  x = _mm256_xor_si256(x,_mm256_srli_epi32(x,16));
+  x = _mm256_mullo_epi32(x,_mm256_set1_epi32(0x7feb352d));
+  x = _mm256_xor_si256(x,_mm256_srli_epi32(x,15));
+  x = _mm256_mullo_epi32(x,_mm256_set1_epi32(0x846ca68b));
+  x = _mm256_xor_si256(x,_mm256_srli_epi32(x,16));
+  x = _mm256_add_epi32(_mm256_srai_epi32(x,16),_mm256_srai_epi32(_mm256_slli_epi32(x,16),16));
+  return _mm256_mul_ps(_mm256_cvtepi32_ps(x),_mm256_set1_ps(1.f/65536.f));
+}
+
+__attribute__((target("avx2")))
+static void dither_16_avx2(unsigned char *d, const float *f, off_t n, uint32_t key, off_t i){
+  const __m256 scale = _mm256_set1_ps(32768.f);
+  const __m256 lo = _mm256_set1_ps(-32768.f);
+  const __m256 hi = _mm256_set1_ps(32767.f);
+  const __m256i eight = _mm256_set1_epi32(8);
+  __m256i ctr = _mm256_add_epi32(_mm256_set1_epi32(key+(uint32_t)i),
+                                 _mm256_setr_epi32(0,1,2,3,4,5,6,7));
+  off_t j=0;
+  for(;j+16<=n;j+=16){
+    __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(f+j),scale),tpdf_dither_avx2(ctr));
+    __m256 b;
+    __m256i v;
+    ctr = _mm256_add_epi32(ctr,eight);
+    b = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(f+j+8),scale),tpdf_dither_avx2(ctr));
+    ctr = _mm256_add_epi32(ctr,eight);
+    a = _mm256_min_ps(_mm256_max_ps(a,lo),hi);
+    b = _mm256_min_ps(_mm256_max_ps(b,lo),hi);
+    v = _mm256_packs_epi32(_mm256_cvtps_epi32(a),_mm256_cvtps_epi32(b));
+    _mm256_storeu_si256((__m256i *)(d+j*2),_mm256_permute4x64_epi64(v,0xd8));
+  }
+  dither_16_c(d+j*2,f+j,n-j,key,i+j);
+}
+
+static quantizer quantize_pick(int bits){
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return (bits==16 ? quantize_16_avx2 : bits==24 ? quantize_24_avx2 : quantize_32_avx2);
+  if(__builtin_cpu_supports("sse2"))
+    return (bits==16 ? quantize_16_sse2 : bits==24 ? quantize_24_sse2 : quantize_32_sse2);
+  return (bits==16 ? quantize_16_c : bits==24 ? quantize_24_c : quantize_32_c);
+}
+
+static ditherer dither_pick(void){
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return dither_16_avx2;
+  return (__builtin_cpu_supports("sse2") ? dither_16_sse2 : dither_16_c);
+}
+
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__AARCH64EL__)
+#include <arm_neon.h>
+
+/* NEON conversions saturate, so only 24 bit needs an explicit clamp */
+static void quantize_32_neon(unsigned char *d, const float *f, off_t n){
+  off_t j=0;
+  for(;j+4<=n;j+=4)
+    vst1q_s32((int32_t *)(d+j*4),vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(f+j),2147483648.f)));
+  quantize_32_c(d+j*4,f+j,n-j);
+}
+
+static void quantize_24_neon(unsigned char *d, const float *f, off_t n){
+  static const uint8_t idx[16]={0,1,2,4,5,6,8,9,10,12,13,14,255,255,255,255};
+  const uint8x16_t shuf = vld1q_u8(idx);
+  const float32x4_t lo = vdupq_n_f32(-8388608.f);
+  const float32x4_t hi = vdupq_n_f32(8388607.f);
+  off_t j=0;
+  for(;j+4<=n;j+=4){
+    float32x4_t v = vminq_f32(vmaxq_f32(vmulq_n_f32(vld1q_f32(f+j),8388608.f),lo),hi);
+    uint8x16_t b = vqtbl1q_u8(vreinterpretq_u8_s32(vcvtnq_s32_f32(v)),shuf);
+    vst1_u8(d+j*3,vget_low_u8(b));
+    vst1q_lane_u32((uint32_t *)(d+j*3+8),vreinterpretq_u32_u8(b),2);
+  }
+  quantize_24_c(d+j*3,f+j,n-j);
+}
+
+static void quantize_16_neon(unsigned char *d, const float *f, off_t n){
+  off_t j=0;
+  for(;j+8<=n;j+=8){
+    int32x4_t a = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(f+j),32768.f));
+    int32x4_t b = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(f+j+4),32768.f));
+    vst1q_s16((int16_t *)(d+j*2),vcombine_s16(vqmovn_s32(a),vqmovn_s32(b)));
+  }
+  quantize_16_c(d+j*2,f+j,n-j);
+}
+
+static inline float32x4_t tpdf_dither_neon(uint32x4_t x){
+  int32x4_t s;
+  x = veorq_u32(x,vshrq_n_u32(x,16));
+  x = vmulq_n_u32(x,0x7feb352d);
+  x = veorq_u32(x,vshrq_n_u32(x,15));
+  x = vmulq_n_u32(x,0x846ca68b);
+  x = veorq_u32(x,vshrq_n_u32(x,16));
+  s = vreinterpretq_s32_u32(x);
+  s = vaddq_s32(vshrq_n_s32(s,16),vshrq_n_s32(vshlq_n_s32(s,16),16));
+  return vcvtq_n_f32_s32(s,16);
+}
+
+static void dither_16_neon(unsigned char *d, const float *f, off_t n, uint32_t key, off_t i){
+  static const uint32_t lanes[4]={0,1,2,3};
+  uint32x4_t ctr = vaddq_u32(vdupq_n_u32(key+(uint32_t)i),vld1q_u32(lanes));
+  off_t j=0;
+  for(;j+8<=n;j+=8){
+    float32x4_t a = vaddq_f32(vmulq_n_f32(vld1q_f32(f+j),32768.f),tpdf_dither_neon(ctr));
+    float32x4_t b;
+    ctr = vaddq_u32(ctr,vdupq_n_u32(4));
+    b = vaddq_f32(vmulq_n_f32(vld1q_f32(f+j+4),32768.f),tpdf_dither_neon(ctr));
+    ctr = vaddq_u32(ctr,vdupq_n_u32(4));
+    vst1q_s16((int16_t *)(d+j*2),vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)),
+                                              vqmovn_s32(vcvtnq_s32_f32(b))));
+  }
+  dither_16_c(d+j*2,f+j,n-j,key,i+j);
+}
+
+static quantizer quantize_pick(int bits){
+  return (bits==16 ? quantize_16_neon : bits==24 ? quantize_24_neon : quantize_32_neon);
+}
+
+static ditherer dither_pick(void){
+  return dither_16_neon;
+}
+
+#else
+
+static quantizer quantize_pick(int bits){
+  return (bits==16 ? quantize_16_c : bits==24 ? quantize_24_c : quantize_32_c);
+}
+
+static ditherer dither_pick(void){
+  return dither_16_c;
+}
+
+#endif
+
+/* on-demand sample production *******************************************/
+
+#define LAZY_CHUNK 4096
+
+static int current_bps(pcm_t *pcm){
+  return pcm->currentbits<0 ? (int)sizeof(float) : (pcm->currentbits+7)/8;
+}
+
+/* produce float frames exactly as a resident buffer that had been
+   through the same downmix, normalization and channel reordering would
+   hold them */
+static void lazy_fill(pcm_t *pcm, off_t frame, int frames, unsigned char *out){
+  lazy_t *l = pcm->lazy;
+  int ch = pcm->ch;
+  int bps = current_bps(pcm);
+  float v[ch];
+  int i,j,k;
+
+  if(!l->fbuf){
+    l->fbuf = malloc(LAZY_CHUNK*l->ch*sizeof(*l->fbuf));
+    if(!l->fbuf){
+      fprintf(stderr,"Unable to allocate on-demand conversion buffer\n");
+      exit(5);
+    }
+  }
+
+  while(frames>0){
+    int n = frames>LAZY_CHUNK ? LAZY_CHUNK : frames;
+    long got = l->read(l->source,l->origin+frame,n,l->fbuf);
+    float *f = l->fbuf;
+    if(got<0)got=0;
+
+    for(i=0;i<got;i++){
+      if(l->mix){
+        for(j=0;j<ch;j++){
+          float acc=0.f;
+          for(k=0;k<l->ch;k++)
+            acc+=f[k]*l->mix[j*l->ch+k];
+          v[j]=acc*l->gain;
+        }
+      }else{
+        for(j=0;j<ch;j++)
+          v[j]=f[j]*l->gain;
+      }
+      f+=l->ch;
+
+      for(j=0;j<ch;j++)
+        memcpy(out+(l->perm ? l->perm[j] : j)*bps,v+j,sizeof(float));
+      out+=ch*bps;
+    }
+
+    /* past the end of the source (or a read error) plays silence */
+    if(got<n){
+      memset(out,0,(n-got)*ch*bps);
+      out+=(n-got)*ch*bps;
+    }
+    frame+=n;
+    frames-=n;
+  }
+}
+
+/* Returns a pointer to 'bytes' bytes of sample data starting at byte
+   offset pos.  Resident data is returned in place; on-demand data is
+   converted into one of two scratch spans (n selects which) that stay
+   valid until the next call with the same n. */
+unsigned char *pcm_span(pcm_t *pcm, off_t pos, int bytes, int n){
+  lazy_t *l = pcm->lazy;
+  int bpf;
+
+  if(!l) return pcm->data+pos;
+
+  bpf = pcm->ch*current_bps(pcm);
+  if(bytes>l->span_size[n]){
+    free(l->span[n]);
+    l->span[n]=malloc(bytes);
+    if(!l->span[n]){
+      fprintf(stderr,"Unable to allocate on-demand conversion buffer\n");
+      exit(5);
+    }
+    l->span_size[n]=bytes;
+  }
+  lazy_fill(pcm,pos/bpf,bytes/bpf,l->span[n]);
+  return l->span[n];
+}
+
+/* hint that [pos, pos+bytes) will be wanted soon */
+void pcm_prefetch(pcm_t *pcm, off_t pos, off_t bytes){
+  lazy_t *l = pcm->lazy;
+  if(l && l->prefetch){
+    int bpf = pcm->ch*current_bps(pcm);
+    if(pos<0)pos=0;
+    l->prefetch(l->source,l->origin+pos/bpf,bytes/bpf);
+  }
+}
+
+/* fraction of the sample that can be played without waiting */
+double pcm_loaded(pcm_t *pcm){
+  lazy_t *l = pcm->lazy;
+  if(l && l->loaded)
+    return l->loaded(l->source);
+  return 1.;
+}
+
+void free_lazy(lazy_t *l){
+  if(l){
+    if(l->close)l->close(l->source);
+    if(l->mix)free(l->mix);
+    if(l->perm)free(l->perm);
+    if(l->fbuf)free(l->fbuf);
+    if(l->span[0])free(l->span[0]);
+    if(l->span[1])free(l->span[1]);
+    free(l);
+  }
+}
+
+/* count runs of more than one overrange value per channel; 'flag'
+   carries the runs across calls, so the samples may come in chunks of
+   whole frames */
+void clip_scan(const float *d, off_t s, int ch, float clamp,
+               float *min, float *max, int *flag, size_t *count){
+  off_t i;
+  int j;
+  for(i=0;i<s;i+=ch)
+    for(j=0;j<ch;j++){
       if(d[i+j]<-1.f){
-        if(d[i+j]<min)min=d[i+j];
+        if(d[i+j]<*min)*min=d[i+j];
         flag[j]++;
       }else if(d[i+j]>clamp){
-        if(d[i+j]>max)max=d[i+j];
+        if(d[i+j]>*max)*max=d[i+j];
         flag[j]++;
       }else{
-        if(flag[j]>1)count+=flag[j];
+        if(flag[j]>1)*count+=flag[j];
         flag[j]=0;
       }
     }
-  for(j=0;j<cpf;j++)
-    if(flag[j]>1)count+=flag[j];
+}
+
+/* Read an on-demand float source through once, as it will be played.
+   Each chunk goes to clip_scan if 'flag' is given; the mixed peak is
+   tracked either way.  Values that aren't finite are refused just as
+   they are when a float file is loaded. */
+static void lazy_scan(pcm_t *pcm, float clamp, float *min, float *max,
+                      int *flag, size_t *count){
+  lazy_t *l = pcm->lazy;
+  off_t frames = pcm->size/sizeof(float)/pcm->ch;
+  off_t frame;
+  float *d = malloc(LAZY_CHUNK*pcm->ch*sizeof(*d));
+  int i;
+
+  if(!d){
+    fprintf(stderr,"Unable to allocate on-demand conversion buffer\n");
+    exit(5);
+  }
+  l->scan(l->source,1);
+  for(frame=0;frame<frames;frame+=LAZY_CHUNK){
+    int n = (frames-frame>LAZY_CHUNK ? LAZY_CHUNK : frames-frame)*pcm->ch;
+    if(l->mix || l->perm || l->gain!=1.f){
+      lazy_fill(pcm,frame,n/pcm->ch,(unsigned char *)d);
+    }else{
+      /* as the source has it; no need to go through the copy */
+      long got = l->read(l->source,l->origin+frame,n/pcm->ch,d);
+      if(got<0)got=0;
+      if(got*pcm->ch<n)memset(d+got*pcm->ch,0,(n-got*pcm->ch)*sizeof(*d));
+    }
+    if(flag)
+      clip_scan(d,n,pcm->ch,clamp,min,max,flag,count);
+    else
+      for(i=0;i<n;i++){
+        if(d[i]>*max)*max=d[i];
+        if(d[i]<*min)*min=d[i];
+      }
+  }
+  free(d);
+  if(l->scan(l->source,0)){
+    fprintf(stderr,"%s: Input file contains invalid floating point values.\n",pcm->name);
+    exit(6);
+  }
+}
+
+float check_warn_clipping(pcm_t *pcm, int no_normalize){
+  int j;
+  int cpf = pcm->ch;
+  float clamp;
+  float min,max;
+  int flag[cpf];
+  size_t count=0;
+  int loading=0;
+
+  memset(flag,0,sizeof(flag));
+  clamp = max = get_clamp(pcm);
+  min=-1.f;
+
+  /* a float file still loading (-p) has its overs tallied by the
+     loader as it goes; what's in so far sets the level.  Later overs
+     that would need more are clamped and reported (see main.c). */
+  if(pcm->lazy && !pcm->lazy->scan)
+    loading=pcm_clip_state(pcm,&min,&max,&count);
+
+  if(pcm->lazy && !pcm->lazy->scan && !loading){
+    /* other on-demand sources that would have to be decoded aren't
+       scanned; that would mean doing up front what they exist to
+       avoid.  Integer sources (mapped, kept at native width or still
+       loading) can't exceed full scale, so for them there's nothing
+       to find; float overs are clamped when quantized. */
+    if(sb_verbose){
+      if(pcm->nativebits>0)
+        fprintf(stderr,"\rLoading %s: done.                   \n",pcm->name);
+      else
+        fprintf(stderr,"\rLoading %s: done (on demand, clipping check skipped).\n",pcm->name);
+    }
+    if(pcm->nativebits<0 && !no_normalize){
+      /* normalization was asked for and this one can't have it */
+      fprintf(stderr,"WARNING: %s is decoded on demand, so it can't be checked\n"
+              "         for clipping or normalized; overrange values will be clamped.\n",
+              pcm->name);
+    }
+    return 1.;
+  }
 
-  if(count){
+  if(!loading){
     if(sb_verbose)
+      fprintf(stderr,"\rLoading %s: checking for clipping...",pcm->name);
+
+    if(pcm->lazy)
+      /* mapped float; one sequential pass through the file */
+      lazy_scan(pcm,clamp,&min,&max,flag,&count);
+    else
+      clip_scan((float *)pcm->data,pcm->size/sizeof(float),cpf,clamp,&min,&max,flag,&count);
+    for(j=0;j<cpf;j++)
+      if(flag[j]>1)count+=flag[j];
+  }
+
+  if(count){
+    if(sb_verbose && !loading)
       fprintf(stderr,"\n");
     if(pcm->nativebits>0){
       fprintf(stderr,"CLIPPING WARNING: %ld probably clipped samples in %s;\n",(long)count,pcm->name);
@@ -108,7 +751,7 @@ float check_warn_clipping(pcm_t *pcm, int no_normalize){
       }
     }
   }else{
-    if(sb_verbose)
+    if(sb_verbose && !loading)
       fprintf(stderr,"\rLoading %s: done.                   \n",pcm->name);
   }
 
@@ -117,9 +760,10 @@ float check_warn_clipping(pcm_t *pcm, int no_normalize){
 
 /* input must be float */
 float convert_to_mono(pcm_t *pcm){
-  int i,j,k;
+  off_t i,k;
+  int j;
   int cpf = pcm->ch;
-  int s = pcm->size/sizeof(float);
+  off_t s = pcm->size/sizeof(float);
   float *d = (float *)pcm->data;
   float max=0;
   float min=0;
@@ -134,19 +778,31 @@ float convert_to_mono(pcm_t *pcm){
   if(sb_verbose)
     fprintf(stderr,"Downmixing to mono... ");
 
-  k=0;
-  for(i=0;i<s;i+=cpf){
-    float acc=0.f;
+  if(pcm->lazy){
+    /* mix on the way out.  Finding the peak means reading the whole
+       source; mapped float files are read through once more, and for
+       the rest there's no peak and overs are clamped when quantized. */
+    lazy_t *l = pcm->lazy;
+    l->mix = malloc(cpf*sizeof(*l->mix));
     for(j=0;j<cpf;j++)
-      acc+=d[i+j];
-    if(acc>max)max=acc;
-    if(acc<min)min=acc;
-    d[k++]=acc;
+      l->mix[j]=1.f;
+    pcm->size/=cpf;
+    pcm->ch=1;
+    if(l->scan)
+      lazy_scan(pcm,clamp,&min,&max,NULL,NULL);
+  }else{
+    k=0;
+    for(i=0;i<s;i+=cpf){
+      float acc=0.f;
+      for(j=0;j<cpf;j++)
+        acc+=d[i+j];
+      if(acc>max)max=acc;
+      if(acc<min)min=acc;
+      d[k++]=acc;
+    }
+    pcm->size/=cpf;
+    pcm->ch=1;
   }
-
-
-  pcm->size/=cpf;
-  pcm->ch=1;
   if(pcm->matrix)free(pcm->matrix);
   pcm->matrix=strdup("M");
   if(min<-1.f) att=-1./min;
@@ -197,9 +853,10 @@ static const float right_mix[33]={
 
 /* input must be float */
 float convert_to_stereo(pcm_t *pcm){
-  int i,j,k;
+  off_t i,k;
+  int j;
   int cpf = pcm->ch;
-  int s = pcm->size/sizeof(float);
+  off_t s = pcm->size/sizeof(float);
   float *d = (float *)pcm->data;
   float max=0;
   float min=0;
@@ -227,25 +884,39 @@ float convert_to_stereo(pcm_t *pcm){
     rmix[j] = right_mix[pcm->mix[j]-'A'];
   }
 
-  k=0;
-  for(i=0;i<s;i+=cpf){
-    float L=0.f,R=0.f;
+  if(pcm->lazy){
+    /* mix on the way out; as for mono, the peak only where there's
+       a pass to be had */
+    lazy_t *l = pcm->lazy;
+    l->mix = malloc(2*cpf*sizeof(*l->mix));
+    memcpy(l->mix,lmix,cpf*sizeof(*lmix));
+    memcpy(l->mix+cpf,rmix,cpf*sizeof(*rmix));
+    pcm->size=pcm->size/cpf*2;
+    pcm->ch=2;
+    if(l->scan)
+      lazy_scan(pcm,clamp,&min,&max,NULL,NULL);
+  }else{
+    k=0;
+    for(i=0;i<s;i+=cpf){
+      float L=0.f,R=0.f;
 
-    for(j=0;j<cpf;j++){
-      L+=d[i+j]*lmix[j];
-      R+=d[i+j]*rmix[j];
-    }
+      for(j=0;j<cpf;j++){
+        L+=d[i+j]*lmix[j];
+        R+=d[i+j]*rmix[j];
+      }
 
-    if(L>max)max=L;
-    if(L<min)min=L;
-    if(R>max)max=R;
-    if(R<min)min=R;
-    d[k++]=L;
-    d[k++]=R;
+      if(L>max)max=L;
+      if(L<min)min=L;
+      if(R>max)max=R;
+      if(R<min)min=R;
+      d[k++]=L;
+      d[k++]=R;
+    }
+    pcm->size=pcm->size/cpf*2;
+    pcm->ch=2;
   }
-
-  pcm->size=pcm->size/cpf*2;
-  pcm->ch=2;
+  free(lmix);
+  free(rmix);
   if(pcm->matrix)free(pcm->matrix);
   pcm->matrix=strdup("L,R");
 
@@ -262,101 +933,52 @@ float convert_to_stereo(pcm_t *pcm){
   return att;
 }
 
-static inline float triangle_ditherval(float *save){
-  float r = rand()/(float)RAND_MAX-.5f;
-  float ret = *save-r;
-  *save = r;
-  return ret;
-}
-
-void convert_to_32(pcm_t *pcm){
-  unsigned char *d = pcm->data;
-  float *f = (float *)pcm->data;
-  off_t j;
-  if(sb_verbose)
-    fprintf(stderr,"\rConverting %s to 32 bit... ",pcm->name);
-  for(j=0;j<pcm->size/sizeof(float);j++){
-    float val = rint(f[j]*2147483648.f);
-    int iv;
-    if(val<-2147483648.f) val = -2147483648.f;
-    if(val> 2147483647.f) val = 2147483647.f;
-    iv=(int)val;
-    d[j*4]=iv&0xff;
-    d[j*4+1]=(iv>>8)&0xff;
-    d[j*4+2]=(iv>>16)&0xff;
-    d[j*4+3]=(iv>>24)&0xff;
-  }
-  if(sb_verbose)
-    fprintf(stderr,"done.\n");
-  pcm->currentbits=32;
-  pcm->size/=sizeof(float);
-  pcm->size*=4;
-}
-
-void convert_to_24(pcm_t *pcm){
-  unsigned char *d = pcm->data;
-  float *f = (float *)pcm->data;
-  off_t j;
-  if(sb_verbose)
-    fprintf(stderr,"\rConverting %s to 24 bit... ",pcm->name);
-  for(j=0;j<pcm->size/sizeof(float);j++){
-    float val = rint(f[j]*8388608.f);
-    int iv;
-    if(val<-8388608.f) val = -8388608.f;
-    if(val> 8388607.f) val = 8388607.f;
-    iv=(int)val;
-    d[j*3]=iv&0xff;
-    d[j*3+1]=(iv>>8)&0xff;
-    d[j*3+2]=(iv>>16)&0xff;
+void normalize(pcm_t *pcm, float att){
+  if(pcm->lazy){
+    pcm->lazy->gain*=att;
+  }else{
+    off_t s = pcm->size/sizeof(float);
+    float *d = (float *)pcm->data;
+    off_t j;
+    for(j=0;j<s;j++)
+      d[j]*=att;
   }
-  if(sb_verbose)
-    fprintf(stderr,"done.\n");
-  pcm->currentbits=24;
-  pcm->size/=sizeof(float);
-  pcm->size*=3;
 }
 
-void convert_to_16(pcm_t *pcm, int dither){
-  unsigned char *d = pcm->data;
-  float *f = (float *)pcm->data;
-  off_t j;
-  float t[pcm->ch];
-  int ch=0;
-  memset(t,0,sizeof(t));
-
-  if(sb_verbose)
-    fprintf(stderr,"\r%s %s to 16 bit... ",
-            dither?"Dithering":"Down-converting",pcm->name);
-
-  for(j=0;j<pcm->size/sizeof(float);j++){
-    float val;
-    if(dither){
-      val = rint(f[j]*32768.f + triangle_ditherval(t+ch));
-      ch++;
-      if(ch>pcm->ch)ch=0;
-    }else{
-      val = rint(f[j]*32768.f);
-    }
-
-    if(val>=32767.f){
-      d[j*2]=0xff;
-      d[j*2+1]=0x7f;
-    }else if(val<=-32768.f){
-      d[j*2]=0x00;
-      d[j*2+1]=0x80;
-    }else{
-      int iv = (int)val;
-      d[j*2]=iv&0xff;
-        d[j*2+1]=(iv>>8)&0xff;
+/* Output quantization ***************************************************/
+
+/* Playback mixes and crossfades in float; each fragment is quantized
+   (and if need be dithered) exactly once, as it goes to the device.
+   Dither and noise shaping run over the output stream, so their state
+   carries across flips and loops. */
+void quant_init(quant_t *q, int bits, int ch){
+  memset(q,0,sizeof(*q));
+  q->bits=bits;
+  q->ch=ch;
+  if(bits==16 && sb_dither_shape){
+    q->hist=calloc(ch*SHAPE_LEN,sizeof(*q->hist));
+    if(!q->hist){
+      fprintf(stderr,"Unable to allocate noise shaping state\n");
+      exit(5);
     }
   }
+}
 
-  if(sb_verbose)
-    fprintf(stderr,"done.\n");
+void quant_clear(quant_t *q){
+  if(q->hist)free(q->hist);
+  memset(q,0,sizeof(*q));
+}
 
-  pcm->currentbits=16;
-  pcm->size/=sizeof(float);
-  pcm->size*=2;
+void quant_fragment(quant_t *q, unsigned char *out, const float *in, int frames, int dither){
+  off_t n = (off_t)frames*q->ch;
+  if(q->bits==16 && dither){
+    if(q->hist)
+      shape_16(out,in,n,q->ch,shapes+sb_dither_shape,dither_key(),q->count,q->hist,&q->hist_pos);
+    else
+      dither_pick()(out,in,n,dither_key(),q->count);
+  }else
+    quantize_pick(q->bits)(out,in,n);
+  q->count+=n;
 }
 
 /* Channel map reconciliation helpers *********************************/
@@ -384,13 +1006,12 @@ static void tokenize_channels(char *matrix,int *out,int n){
 
 /* pre-permute sample ordering so that playback incurs ~equal
    CPU/memory/etc load during playback */
-/* A and B must have machine sample formats */
 void reconcile_channel_maps(pcm_t *A, pcm_t *B){
   /* arbitrary; match B to A */
   int ai[A->ch],bi[A->ch];
   int i,j,k;
   off_t o;
-  int bps = (B->currentbits+7)/8;
+  int bps = current_bps(B);
   int bpf = B->ch*bps;
   int p[bpf];
   unsigned char temp[bpf];
@@ -421,12 +1042,19 @@ void reconcile_channel_maps(pcm_t *A, pcm_t *B){
     }
   }
 
-  d=B->data;
-  for(o=0;o<B->size;o+=bpf){
-    for(i=0;i<bpf;i++)
-      temp[p[i]]=d[i];
-    memcpy(d,temp,bpf);
-    d+=bpf;
+  if(B->lazy){
+    /* permuted on the way out */
+    B->lazy->perm = malloc(B->ch*sizeof(*B->lazy->perm));
+    for(i=0;i<B->ch;i++)
+      B->lazy->perm[i]=p[i*bps]/bps;
+  }else{
+    d=B->data;
+    for(o=0;o<B->size;o+=bpf){
+      for(i=0;i<bpf;i++)
+        temp[p[i]]=d[i];
+      memcpy(d,temp,bpf);
+      d+=bpf;
+    }
   }
 
   free(B->matrix);
@@ -435,34 +1063,16 @@ void reconcile_channel_maps(pcm_t *A, pcm_t *B){
 
 /* fade and beep function generation **************************************/
 
-void put_val(unsigned char *d,int bps,float v){
-  int i = rint(v);
-  d[0]=i&0xff;
-  d[1]=(i>>8)&0xff;
-  if(bps==3)
-    d[2]=(i>>16)&0xff;
-}
-
-float get_val(unsigned char *d, int bps){
-  if(bps==2){
-    short i = d[0] | (d[1]<<8);
-    return (float)i;
-  }else{
-    int32_t i = ((d[0]<<8) | (d[1]<<16) | (d[2]<<24))>>8;
-    return (float)i;
-  }
-}
-
 int setup_windows(pcm_t **pcm, int test_files,
                          float **fw1, float **fw2, float **fw3,
                          float **b1, float **b2){
   int i;
   int fragsamples = pcm[0]->rate/10;  /* 100ms */
-  float mul = (pcm[0]->currentbits==24 ? 8388608.f : 32768.f) * .0625;
-  int bps=(pcm[0]->currentbits+7)/8;
+  float mul = .0625f;
+  int bps=current_bps(pcm[0]);
   int ch=pcm[0]->ch;
   int bpf=ch*bps;
-  int maxsamples = pcm[0]->size / bpf;
+  off_t maxsamples = pcm[0]->size / bpf;
   if (fragsamples * 3 > maxsamples)
     fragsamples = maxsamples / 3;
   /* precompute the fades/beeps */
@@ -554,13 +1164,23 @@ int setup_windows(pcm_t **pcm, int test_files,
   return fragsamples;
 }
 
+/* A faded out against B faded in, weight w for B */
+static inline void crossfade_frame(float *out, const float *A, const float *B, float w, int ch){
+  int j;
+  for(j=0;j<ch;j++)
+    out[j] = A[j]*(1.f-w) + B[j]*w;
+}
+
+/* fragments are rendered in float; positions are byte offsets into
+   the (float) sample data */
+
 /* fragment is filled such that a crossloop never begins after
    pcm->size-fragsize, and it always begins from the start of the
    window, even if that means starting a crossloop late because the
    endpos moved. */
-void fill_fragment1(unsigned char *out, pcm_t *pcm, off_t start, off_t *pos, off_t end, int *loop,
+void fill_fragment1(float *out, pcm_t *pcm, off_t start, off_t *pos, off_t end, int *loop,
                     int fragsamples, float *fadewindow){
-  int bps = (pcm->currentbits+7)/8;
+  int bps = current_bps(pcm);
   int cpf = pcm->ch;
   int bpf = bps*cpf;
   int fragsize = fragsamples*bpf;
@@ -580,28 +1200,24 @@ void fill_fragment1(unsigned char *out, pcm_t *pcm, off_t start, off_t *pos, off
      start+(fragsize-*loop*bpf). Stay the course. */
   if(*loop){
     int lp = *loop;
-    int i,j;
-    unsigned char *A = pcm->data+*pos;
-    unsigned char *B = pcm->data+start+(fragsamples-lp)*bpf;
+    int i;
+    off_t Bpos = start+(fragsamples-lp)*bpf;
+    float *A = (float *)pcm_span(pcm,*pos,lp*bpf,0);
+    float *B = (float *)pcm_span(pcm,Bpos,fragsize,1);
+    float *B0 = B;
     for(i=0;i<fragsamples;i++){
       if(lp){
-        float w = fadewindow[--lp];
-        for(j=0;j<cpf;j++){
-          float val = get_val(A,bps)*(1.f-w) + get_val(B,bps)*w;
-          put_val(out,bps,val);
-          A+=bps;
-          B+=bps;
-          out+=bps;
-        }
+        crossfade_frame(out,A,B,fadewindow[--lp],cpf);
+        A+=cpf;
       }else{
         /* crossloop finished, the rest is B */
         memcpy(out,B,bpf);
-        B+=bpf;
-        out+=bpf;
       }
+      B+=cpf;
+      out+=cpf;
     }
     *loop=0;
-    *pos=B-pcm->data;
+    *pos=Bpos+(B-B0)*bps;
   }else{
     /* no crossloop in progress... should one be? If the cursor is
        before start, do nothing.  If it's past end-fragsize, begin a
@@ -612,35 +1228,31 @@ void fill_fragment1(unsigned char *out, pcm_t *pcm, off_t start, off_t *pos, off
       fprintf(stderr,"Internal error; %ld>%ld, Monty fucked up.\n",(long)*pos,(long)pcm->size-fragsize);
       exit(100);
     }else if(*pos+fragsize>end-fragsize){
-      int i,j;
-      unsigned char *A = pcm->data+*pos;
-      unsigned char *B = pcm->data+start;
-      int lp = (end-*pos)/bpf;
+      int i;
+      float *A = (float *)pcm_span(pcm,*pos,fragsize,0);
+      float *B = (float *)pcm_span(pcm,start,fragsize,1);
+      float *A0 = A;
+      float *B0 = B;
+      off_t lp = (end-*pos)/bpf;
       if(lp<fragsamples)lp=fragsamples; /* If we're late, start immediately, but use full window */
 
       for(i=0;i<fragsamples;i++){
         if(--lp>=fragsamples){
           /* still before crossloop begins */
           memcpy(out,A,bpf);
-          A+=bpf;
-          out+=bpf;
         }else{
           /* crosslooping */
-          float w = fadewindow[lp];
-          for(j=0;j<cpf;j++){
-            float val = get_val(A,bps)*(1.f-w) + get_val(B,bps)*w;
-            put_val(out,bps,val);
-            A+=bps;
-            B+=bps;
-            out+=bps;
-          }
+          crossfade_frame(out,A,B,fadewindow[lp],cpf);
+          B+=cpf;
         }
+        A+=cpf;
+        out+=cpf;
       }
       *loop=(lp<0?0:lp);
-      *pos=(lp<=0?B-pcm->data:A-pcm->data);
+      *pos=(lp<=0?start+(B-B0)*bps:*pos+(A-A0)*bps);
     }else{
       /* no crossloop */
-      unsigned char *A = pcm->data+*pos;
+      unsigned char *A = pcm_span(pcm,*pos,fragsize,0);
       memcpy(out,A,fragsize);
       *loop=0;
       *pos+=fragsize;
@@ -650,9 +1262,9 @@ void fill_fragment1(unsigned char *out, pcm_t *pcm, off_t start, off_t *pos, off
 
 /* fragment is filled such that a crossloop is always 'exactly on
    schedule' even if that means beginning partway through the window. */
-void fill_fragment2(unsigned char *out, pcm_t *pcm, off_t start, off_t *pos, off_t end, int *loop,
+void fill_fragment2(float *out, pcm_t *pcm, off_t start, off_t *pos, off_t end, int *loop,
                     int fragsamples, float *fadewindow){
-  int bps = (pcm->currentbits+7)/8;
+  int bps = current_bps(pcm);
   int cpf = pcm->ch;
   int bpf = bps*cpf;
   int fragsize=fragsamples*bpf;
@@ -664,45 +1276,42 @@ void fill_fragment2(unsigned char *out, pcm_t *pcm, off_t start, off_t *pos, off
   if(start>pcm->size-fragsize*3)start=pcm->size-fragsize*3;
 
   /* loop is never in progress for a fill_fragment2; called only during a seek crosslap */
-  unsigned char *A = pcm->data+*pos;
   if(end-*pos>=fragsize*2){
     /* no crosslap */
+    unsigned char *A = pcm_span(pcm,*pos,fragsize,0);
     memcpy(out,A,fragsize);
     *loop=0;
-    *pos=A-pcm->data+fragsize;
+    *pos+=fragsize;
   }else{
     /* just before crossloop, in the middle of a crossloop, or just after crossloop */
-    int i,j;
-    int lp = (end-*pos)/bpf;
-    unsigned char *B = pcm->data+start;
-    if(lp<fragsamples)B+=(fragsamples-lp)*bpf;
+    int i;
+    off_t lp = (end-*pos)/bpf;
+    off_t Bpos = start;
+    float *A,*A0,*B,*B0;
+    if(lp<fragsamples)Bpos+=(fragsamples-lp)*bpf;
+    A = A0 = (float *)pcm_span(pcm,*pos,(lp>0 ? (lp<fragsamples?lp:fragsamples) : 0)*bpf,0);
+    B = B0 = (float *)pcm_span(pcm,Bpos,fragsize,1);
 
     for(i=0;i<fragsamples;i++){
       --lp;
       if(lp>=fragsamples){
         /* not yet crosslooping */
         memcpy(out,A,bpf);
-        A+=bpf;
-        out+=bpf;
+        A+=cpf;
       }else if (lp>=0){
         /* now crosslooping */
-        float w = fadewindow[lp];
-        for(j=0;j<cpf;j++){
-          float val = get_val(A,bps)*(1.-w) + get_val(B,bps)*w;
-          put_val(out,val,bps);
-          A+=bps;
-          B+=bps;
-          out+=bps;
-        }
+        crossfade_frame(out,A,B,fadewindow[lp],cpf);
+        A+=cpf;
+        B+=cpf;
       }else{
         /* after crosslap */
         memcpy(out,B,bpf);
-        B+=bpf;
-        out+=bpf;
-       }
+        B+=cpf;
+      }
+      out+=cpf;
     }
     *loop=(lp>0?(lp<fragsamples?lp:fragsamples):0);
-    *pos=(lp>0?A-pcm->data:B-pcm->data);
+    *pos=(lp>0?*pos+(A-A0)*bps:Bpos+(B-B0)*bps);
   }
 }
 
@@ -0,0 +1,159 @@
+/*
+ *
+ *  squishyball
+ *
+ *      Copyright (C) 2010-2013 Xiph.Org
+ *
+ *  squishyball is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  squishyball is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rtrecord; see the file COPYING.  If not, write to the
+ *  Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *
+ */
+
+/* make check: a sample longer than 2^31 samples must load, play its
+   last frames and have an over at the very end found by the clipping
+   scan.  The stimulus is a sparse mono float RF64 file, so it costs
+   almost no disk; it loads mapped, and the scan reads it through
+   sequentially, so it costs little memory either. */
+
+#define _GNU_SOURCE
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ao/ao.h>
+#include "main.h"
+
+int sb_verbose=1;
+int sb_mmap=0;
+int sb_native=0;
+long sb_stream_cache=0;
+off_t sb_cache_limit=0;
+int sb_decode_threads=1;
+int sb_progressive=0;
+int sb_verify=MD5_OFF;
+unsigned int sb_dither_seed=0;
+int sb_dither_shape=0;
+
+#define RATE 48000
+#define FRAMES (((off_t)1<<31)+4096)
+#define OVERS 2 /* a lone full scale sample isn't counted as clipping */
+#define HEADER 80
+
+static void put32(unsigned char *p, unsigned int v){
+  p[0]=v; p[1]=v>>8; p[2]=v>>16; p[3]=v>>24;
+}
+
+static void put64(unsigned char *p, off_t v){
+  put32(p,(unsigned int)v);
+  put32(p+4,(unsigned int)(v>>32));
+}
+
+/* RF64: ds64 carries the sizes the 32-bit fields can't */
+static int write_stimulus(char *path){
+  unsigned char h[HEADER];
+  unsigned char over[4*OVERS];
+  off_t bytes=FRAMES*4;
+  int i,fd;
+
+  memset(h,0,sizeof(h));
+  memcpy(h,"RF64",4);
+  put32(h+4,0xffffffffU);
+  memcpy(h+8,"WAVE",4);
+  memcpy(h+12,"ds64",4);
+  put32(h+16,28);
+  put64(h+20,HEADER-8+bytes); /* RIFF size */
+  put64(h+28,bytes);          /* data size */
+  put64(h+36,FRAMES);         /* sample count */
+  put32(h+44,0);              /* table length */
+  memcpy(h+48,"fmt ",4);
+  put32(h+52,16);
+  h[56]=3;                    /* IEEE float */
+  h[58]=1;                    /* mono */
+  put32(h+60,RATE);
+  put32(h+64,RATE*4);
+  h[68]=4;
+  h[70]=32;
+  memcpy(h+72,"data",4);
+  put32(h+76,0xffffffffU);
+
+  for(i=0;i<OVERS;i++)
+    put32(over+i*4,0x40000000U); /* 2.f */
+
+  fd=open(path,O_RDWR|O_CREAT|O_TRUNC,0600);
+  if(fd<0)return 1;
+  if(pwrite(fd,h,HEADER,0)!=HEADER ||
+     ftruncate(fd,HEADER+bytes) ||
+     pwrite(fd,over,sizeof(over),HEADER+bytes-sizeof(over))!=sizeof(over)){
+    close(fd);
+    return 1;
+  }
+  return close(fd);
+}
+
+int main(int argc, char **argv){
+  char *tmpdir = getenv("TMPDIR");
+  char path[1024];
+  pcm_t *pcm;
+  float *tail;
+  float att;
+  int fd,i,ret=1;
+
+  snprintf(path,sizeof(path),"%s/sbcheckXXXXXX",tmpdir?tmpdir:"/tmp");
+  fd=mkstemp(path);
+  if(fd<0 || close(fd) || write_stimulus(path)){
+    fprintf(stderr,"check_large: unable to create %s; skipped\n",path);
+    unlink(path);
+    return 77;
+  }
+
+  /* over 4GB of data, so it loads mapped; its last frames are read
+     through 64-bit offsets */
+  pcm=load_audio_file(path,0,-1);
+  unlink(path);
+  if(!pcm){
+    fprintf(stderr,"check_large: failed to load the stimulus\n");
+    return 1;
+  }
+  if(pcm->size!=FRAMES*(off_t)sizeof(float) || pcm->ch!=1){
+    fprintf(stderr,"check_large: loaded %ld bytes, %d channels; expected %ld bytes, 1 channel\n",
+            (long)pcm->size,pcm->ch,(long)(FRAMES*sizeof(float)));
+    goto done;
+  }
+  tail=(float *)pcm_span(pcm,(FRAMES-OVERS)*sizeof(float),OVERS*sizeof(float),0);
+  for(i=0;i<OVERS;i++)
+    if(tail[i]!=2.f){
+      fprintf(stderr,"check_large: frame %ld is %f; expected 2.0\n",
+              (long)(FRAMES-OVERS+i),tail[i]);
+      goto done;
+    }
+
+  /* and the scan of the mapped file must find it */
+  att=check_warn_clipping(pcm,0);
+
+  if(att>.5001f){
+    fprintf(stderr,"\ncheck_large: over at the end not reported (attenuation %f)\n",att);
+    goto done;
+  }
+  fprintf(stderr,"check_large: %ld samples, over at the end reported\n",(long)FRAMES);
+  ret=0;
+
+ done:
+  free_pcm(pcm);
+  return ret;
+}
@@ -0,0 +1,150 @@
+/*
+ *
+ *  squishyball
+ *
+ *      Copyright (C) 2010-2013 Xiph.Org
+ *
+ *  squishyball is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  squishyball is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with rtrecord; see the file COPYING.  If not, write to the
+ *  Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *
+ */
+
+/* make check: a WAV already in memory loads through
+   load_audio_memory with every sample intact, including one whose
+   data chunk carries a streaming writer's 0xffffffff placeholder
+   length, and reports the load rate. */
+
+#define _GNU_SOURCE
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ao/ao.h>
+#include "main.h"
+
+int sb_verbose=0;
+int sb_mmap=0;
+int sb_native=0;
+long sb_stream_cache=0;
+off_t sb_cache_limit=0;
+int sb_decode_threads=1;
+int sb_progressive=0;
+int sb_verify=MD5_OFF;
+unsigned int sb_dither_seed=0;
+int sb_dither_shape=0;
+
+#define RATE 48000
+#define CH 2
+#define FRAMES (RATE*60)
+#define HEADER 44
+
+static void put16(unsigned char *p, unsigned int v){
+  p[0]=v; p[1]=v>>8;
+}
+
+static void put32(unsigned char *p, unsigned int v){
+  p[0]=v; p[1]=v>>8; p[2]=v>>16; p[3]=v>>24;
+}
+
+static short sample(long i){
+  return (short)((i*7919)^(i>>3));
+}
+
+/* 16-bit stereo; 'len' is written as the data chunk length */
+static unsigned char *make_wav(long frames, unsigned int len, off_t *bytes){
+  unsigned char *w;
+  long i;
+
+  *bytes=HEADER+frames*CH*2;
+  w=malloc(*bytes);
+  if(!w)return NULL;
+  memcpy(w,"RIFF",4);
+  put32(w+4,len==0xffffffffU ? len : len+HEADER-8);
+  memcpy(w+8,"WAVEfmt ",8);
+  put32(w+16,16);
+  put16(w+20,1);
+  put16(w+22,CH);
+  put32(w+24,RATE);
+  put32(w+28,RATE*CH*2);
+  put16(w+32,CH*2);
+  put16(w+34,16);
+  memcpy(w+36,"data",4);
+  put32(w+40,len);
+  for(i=0;i<frames*CH;i++)
+    put16(w+HEADER+i*2,(unsigned short)sample(i));
+  return w;
+}
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+static int check(char *name, long frames, unsigned int len){
+  off_t bytes;
+  unsigned char *w=make_wav(frames,len,&bytes);
+  pcm_t *pcm;
+  float *d;
+  double t;
+  long i;
+  int ret=1;
+
+  if(!w){
+    fprintf(stderr,"check_memory: unable to allocate %s\n",name);
+    return 1;
+  }
+  t=now();
+  pcm=load_audio_memory(name,w,bytes);
+  t=now()-t;
+  if(!pcm){
+    fprintf(stderr,"check_memory: failed to load %s\n",name);
+    goto done;
+  }
+  if(pcm->ch!=CH || pcm->rate!=RATE || pcm->size!=frames*CH*(off_t)sizeof(float)){
+    fprintf(stderr,"check_memory: %s loaded %ld bytes, %d channels at %d; expected %ld bytes, %d channels at %d\n",
+            name,(long)pcm->size,pcm->ch,pcm->rate,(long)(frames*CH*sizeof(float)),CH,RATE);
+    goto done;
+  }
+  for(i=0;i<frames*CH;i+=4096){
+    int n=(frames*CH-i<4096 ? frames*CH-i : 4096);
+    int k;
+    d=(float *)pcm_span(pcm,i*sizeof(float),n*sizeof(float),0);
+    for(k=0;k<n;k++)
+      if(d[k]!=sample(i+k)*(1.f/32768.f)){
+        fprintf(stderr,"check_memory: %s sample %ld is %f; expected %f\n",
+                name,i+k,d[k],sample(i+k)*(1.f/32768.f));
+        goto done;
+      }
+  }
+  fprintf(stderr,"check_memory: %s, %ld frames in %.1f ms (%.0f MB/s)\n",
+          name,frames,t*1000.,t>0 ? bytes/t/1e6 : 0.);
+  ret=0;
+
+ done:
+  if(pcm)free_pcm(pcm);
+  free(w);
+  return ret;
+}
+
+int main(int argc, char **argv){
+  if(check("memory.wav",FRAMES,FRAMES*CH*2))return 1;
+  /* the data runs to the end of the buffer, not to the placeholder */
+  if(check("streamed.wav",FRAMES/8,0xffffffffU))return 1;
+  return 0;
+}
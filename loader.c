@@ -27,13 +27,28 @@
 #define _FILE_OFFSET_BITS 64
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <stdio.h>
 #include <math.h>
 #include <errno.h>
 #include <vorbis/vorbisfile.h>
 #include <opusfile.h>
 #include <FLAC/stream_decoder.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define AIO_URING
+#endif
+#endif
 #include "main.h"
 
 static inline int host_is_big_endian() {
@@ -62,10 +77,416 @@ static char *trim_path(char *in){
   return NULL;
 }
 
+/* Input sources **************************************************************/
+
+/* Loaders read through an input_source rather than stdio, so that
+   the same code loads from a file, a whole-file mapping, a buffer in
+   memory or a pipe.  Files are read with pread through a small buffer
+   of their own, and keep 'fd' for mmap and the asynchronous reads
+   below.  Everything else is held in memory, where view() hands out
+   pointers into the data instead of copying it.  A pipe (stdin given
+   as "-", or a FIFO) is read into memory as far as the loader has
+   asked for so far; every loader seeks back to the start after the
+   format is identified, and a few need the length up front.  reopen()
+   gives an independent position in the same data, for streaming and
+   parallel decoders; once reopened, in-memory data no longer moves. */
+
+#define INPUT_BUFFER 65536
+
+typedef struct {
+  int refs;
+  int fd;            /* -1 if none */
+  unsigned char *mem;
+  off_t size;        /* bytes in mem */
+  off_t alloc;
+  size_t mapped;     /* mem is a mapping of this length */
+  int owned;         /* mem is ours to free */
+  int pipe;          /* more may still arrive on fd */
+  int error;
+} input_data;
+
+typedef struct input_source input_source;
+struct input_source {
+  int fd;            /* regular file behind this input, or -1 */
+  long (*read)(input_source *in, void *buf, long bytes);
+  int (*seek)(input_source *in, off_t offset, int whence);
+  off_t (*tell)(input_source *in);
+  off_t (*length)(input_source *in);
+  unsigned char *(*view)(input_source *in, off_t offset, off_t bytes);
+  input_source *(*reopen)(input_source *in);
+  void (*close)(input_source *in);
+  int eof;
+
+  input_data *data;
+  off_t pos;
+  unsigned char *buf;  /* file read buffer */
+  off_t buf_at;
+  long buf_fill;
+};
+
+static void input_release(input_data *d){
+  if(__atomic_sub_fetch(&d->refs,1,__ATOMIC_ACQ_REL))return;
+  if(d->mapped)
+    munmap(d->mem,d->mapped);
+  else if(d->owned)
+    free(d->mem);
+  if(d->fd>=0)close(d->fd);
+  free(d);
+}
+
+static void input_close(input_source *in){
+  input_release(in->data);
+  free(in->buf);
+  free(in);
+}
+
+static int input_seek_to(input_source *in, off_t offset, int whence){
+  off_t pos;
+  switch(whence){
+  case SEEK_SET:
+    pos=offset;
+    break;
+  case SEEK_CUR:
+    pos=in->pos+offset;
+    break;
+  case SEEK_END:
+    if((pos=in->length(in))<0)return -1;
+    pos+=offset;
+    break;
+  default:
+    return -1;
+  }
+  if(pos<0)return -1;
+  in->pos=pos;
+  in->eof=0;
+  return 0;
+}
+
+static off_t input_tell(input_source *in){
+  return in->pos;
+}
+
+/* regular files */
+
+static long file_read(input_source *in, void *buf, long bytes){
+  unsigned char *out = (unsigned char *)buf;
+  long done=0;
+
+  while(done<bytes){
+    ssize_t n;
+    if(in->pos>=in->buf_at && in->pos<in->buf_at+in->buf_fill){
+      n = in->buf_at+in->buf_fill-in->pos;
+      if(n>bytes-done)n=bytes-done;
+      memcpy(out+done,in->buf+(in->pos-in->buf_at),n);
+    }else if(bytes-done>=INPUT_BUFFER || (!in->buf && !(in->buf=malloc(INPUT_BUFFER)))){
+      /* large reads skip the buffer */
+      n = pread(in->fd,out+done,bytes-done,in->pos);
+    }else{
+      in->buf_fill=0;
+      n = pread(in->fd,in->buf,INPUT_BUFFER,in->pos);
+      if(n>0){
+        in->buf_at=in->pos;
+        in->buf_fill=n;
+        continue;
+      }
+    }
+    if(n<0 && errno==EINTR)continue;
+    if(n<0)return done ? done : -1;
+    if(n==0){
+      in->eof=1;
+      break;
+    }
+    in->pos+=n;
+    done+=n;
+  }
+  return done;
+}
+
+static off_t file_length(input_source *in){
+  struct stat st;
+  if(fstat(in->fd,&st))return -1;
+  return st.st_size;
+}
+
+static input_source *file_reopen(input_source *in);
+
+static input_source *input_new(input_data *d){
+  input_source *in = calloc(1,sizeof(*in));
+  if(!in)return NULL;
+  in->data=d;
+  in->fd=-1;
+  in->seek=input_seek_to;
+  in->tell=input_tell;
+  in->close=input_close;
+  return in;
+}
+
+static input_source *file_new(input_data *d){
+  input_source *in = input_new(d);
+  if(!in)return NULL;
+  in->fd=d->fd;
+  in->read=file_read;
+  in->length=file_length;
+  in->reopen=file_reopen;
+  return in;
+}
+
+static input_source *file_reopen(input_source *in){
+  input_source *ret = file_new(in->data);
+  if(ret)__atomic_add_fetch(&in->data->refs,1,__ATOMIC_ACQ_REL);
+  return ret;
+}
+
+/* memory, mappings and pipes */
+
+/* bring in pipe data up to 'end', or all of it if end<0 */
+static void mem_fill(input_data *d, off_t end){
+  while(d->pipe && (end<0 || d->size<end)){
+    ssize_t n;
+    if(d->size==d->alloc){
+      off_t alloc = (d->alloc ? d->alloc*2 : 1<<20);
+      unsigned char *mem = realloc(d->mem,alloc);
+      if(!mem){
+        d->error=1;
+        break;
+      }
+      d->mem=mem;
+      d->alloc=alloc;
+    }
+    n = read(d->fd,d->mem+d->size,d->alloc-d->size);
+    if(n<0 && errno==EINTR)continue;
+    if(n<=0){
+      if(n<0)d->error=1;
+      d->pipe=0;
+      close(d->fd);
+      d->fd=-1;
+      break;
+    }
+    d->size+=n;
+  }
+}
+
+static long mem_read(input_source *in, void *buf, long bytes){
+  input_data *d = in->data;
+  long n;
+  mem_fill(d,in->pos+bytes);
+  n = (in->pos<d->size ? d->size-in->pos : 0);
+  if(n>bytes)n=bytes;
+  if(n==0 && d->error)return -1;
+  if(n<bytes)in->eof=1;
+  if(n>0)memcpy(buf,d->mem+in->pos,n);
+  in->pos+=n;
+  return n;
+}
+
+static off_t mem_length(input_source *in){
+  mem_fill(in->data,-1);
+  return in->data->size;
+}
+
+static unsigned char *mem_view(input_source *in, off_t offset, off_t bytes){
+  input_data *d = in->data;
+  /* the buffer is only stable once the pipe is drained */
+  mem_fill(d,-1);
+  if(offset<0 || bytes<0 || offset+bytes>d->size)return NULL;
+  return d->mem+offset;
+}
+
+static input_source *mem_reopen(input_source *in);
+
+static input_source *mem_new(input_data *d){
+  input_source *in = input_new(d);
+  if(!in)return NULL;
+  in->read=mem_read;
+  in->length=mem_length;
+  in->view=mem_view;
+  in->reopen=mem_reopen;
+  return in;
+}
+
+static input_source *mem_reopen(input_source *in){
+  input_source *ret;
+  mem_fill(in->data,-1);
+  ret = mem_new(in->data);
+  if(ret){
+    ret->fd=in->fd;
+    __atomic_add_fetch(&in->data->refs,1,__ATOMIC_ACQ_REL);
+  }
+  return ret;
+}
+
+/* "-" is stdin.  With -m, regular files are mapped whole. */
+static input_source *input_open(char *path){
+  input_data *d;
+  input_source *in;
+  struct stat st;
+  int fd = (strcmp(path,"-") ? open(path,O_RDONLY) : dup(STDIN_FILENO));
+
+  if(fd<0)return NULL;
+  if(fstat(fd,&st) || !(d=calloc(1,sizeof(*d)))){
+    close(fd);
+    return NULL;
+  }
+  d->refs=1;
+  d->fd=fd;
+
+  if(!S_ISREG(st.st_mode)){
+    d->pipe=1;
+    d->owned=1;
+    in=mem_new(d);
+  }else if(sb_mmap && st.st_size>0 &&
+           (d->mem=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0))!=MAP_FAILED){
+    d->mapped=st.st_size;
+    d->size=st.st_size;
+    in=mem_new(d);
+    if(in)in->fd=fd;
+  }else{
+    d->mem=NULL;
+    in=file_new(d);
+  }
+  if(!in)input_release(d);
+  return in;
+}
+
+/* the caller's buffer, which must outlive any pcm loaded from it */
+static input_source *input_memory(unsigned char *mem, off_t bytes){
+  input_data *d = calloc(1,sizeof(*d));
+  input_source *in;
+  if(!d)return NULL;
+  d->refs=1;
+  d->fd=-1;
+  d->mem=mem;
+  d->size=bytes;
+  in=mem_new(d);
+  if(!in)free(d);
+  return in;
+}
+
+/* The -s/-e load window, in seconds (to<0 for the end of the file),
+   of the load running on this thread; see load_input. */
+static __thread double window_from=0;
+static __thread double window_to=-1;
+
+/* The part of a file 'frames' long that falls in the load window, as
+   [*from, *to). */
+static void window_frames(int rate, off_t frames, off_t *from, off_t *to){
+  off_t a = (window_from>0 ? (off_t)floor(window_from*rate) : 0);
+  off_t b = (window_to>=0 ? (off_t)ceil(window_to*rate) : frames);
+  if(b>frames)b=frames;
+  if(a>b)a=b;
+  *from=a;
+  *to=b;
+}
+
+static int window_active(void){
+  return window_from>0 || window_to>=0;
+}
+
+/* Uncompressed data of pcm->size bytes starts at the current file
+   position; skip to the start of the window and trim to its length. */
+static int window_pcm(char *path, input_source *in, pcm_t *pcm, int bpf){
+  off_t from,to;
+  window_frames(pcm->rate,pcm->size/bpf,&from,&to);
+  if(from>0 && in->seek(in,from*bpf,SEEK_CUR)){
+    fprintf(stderr,"%s: Failed to seek\n",path);
+    return -1;
+  }
+  pcm->origin=from;
+  pcm->size=(to-from)*bpf;
+  return 0;
+}
+
+/* With -p, each file is loaded on a thread of its own and handed to
+   playback as soon as its first few seconds are in (see
+   load_audio_progressive below).  Loaders report how much of
+   pcm->data they've filled in order as they go. */
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  char *path;
+  pcm_t *pcm;      /* the loader's pcm, once samples start arriving */
+  float *data;
+  int rate;
+  int ch;
+  off_t frames;    /* declared length */
+  off_t ready;     /* frames decoded so far */
+  int done;
+  int handed;      /* playback is reading from data */
+  int failed;      /* the load failed after it was handed over */
+  int refs;
+  double from,to;  /* load window */
+  /* float overs, tallied by the loader as it goes (see progress_scan) */
+  int *flag;       /* NULL if not kept */
+  off_t scanned;
+  float clamp;
+  float scan_min,scan_max;
+  size_t scan_count;
+  float min,max;   /* published under the mutex, as of 'ready' */
+  size_t count;
+} progress_source;
+
+static __thread progress_source *progress_self;
+
+/* Float sources are checked for clipping as they decode, so playback
+   can start at the level the first seconds need and the rest can be
+   checked against it.  Only the loader thread scans; the totals are
+   published with 'ready'. */
+static void progress_scan(progress_source *p, pcm_t *pcm, off_t frames){
+  if(pcm->nativebits>=0 || frames<=p->scanned)return;
+  if(!p->flag){
+    if(p->scanned || !(p->flag=calloc(pcm->ch,sizeof(*p->flag)))){
+      p->scanned=frames; /* not kept */
+      return;
+    }
+    p->clamp=p->scan_max=get_clamp(pcm);
+    p->scan_min=-1.f;
+  }
+  clip_scan((float *)pcm->data+p->scanned*pcm->ch,(frames-p->scanned)*pcm->ch,pcm->ch,
+            p->clamp,&p->scan_min,&p->scan_max,p->flag,&p->scan_count);
+  p->scanned=frames;
+}
+
+/* under the mutex */
+static void progress_publish(progress_source *p){
+  int j;
+  if(!p->flag)return;
+  p->min=p->scan_min;
+  p->max=p->scan_max;
+  p->count=p->scan_count;
+  for(j=0;j<p->ch;j++)
+    if(p->flag[j]>1)p->count+=p->flag[j];
+}
+
+/* 'done' of 'total' float samples of pcm->data are now in place */
+static void load_progress(pcm_t *pcm, off_t done, off_t total){
+  progress_source *p = progress_self;
+  if(!p || sb_native || !pcm->data || !pcm->ch)return;
+  if(!p->data || p->data==(float *)pcm->data)
+    progress_scan(p,pcm,done/pcm->ch);
+  pthread_mutex_lock(&p->mutex);
+  if(!p->pcm){
+    p->pcm=pcm;
+    p->data=(float *)pcm->data;
+    p->rate=pcm->rate;
+    p->ch=pcm->ch;
+    p->frames=total/pcm->ch;
+  }
+  p->ready=done/pcm->ch;
+  progress_publish(p);
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+/* loader status lines stop once the panel is up */
+static int load_verbose(void){
+  return sb_verbose && !(progress_self && progress_self->handed);
+}
+
 typedef struct{
   int (*id_func)(char *path,unsigned char *buf);
-  pcm_t *(*load_func)(char *path, FILE *in);
+  pcm_t *(*load_func)(char *path, input_source *in);
   char *format;
+  int decoded; /* compressed; worth caching the result */
 } input_format;
 
 /* steal/simplify/expand file ID/load code from oggenc */
@@ -77,14 +498,26 @@ typedef struct{
 #define READ_U16_LE(buf) \
     (((buf)[1]<<8)|((buf)[0]&0xff))
 
+#define READ_U64_LE(buf) \
+    (((off_t)(unsigned int)READ_U32_LE((buf)+4)<<32)|(unsigned int)READ_U32_LE(buf))
+
 #define READ_U32_BE(buf) \
     (((buf)[0]<<24)|((buf)[1]<<16)|((buf)[2]<<8)|((buf)[3]&0xff))
 
 #define READ_U16_BE(buf) \
     (((buf)[0]<<8)|((buf)[1]&0xff))
 
+/* Sony Wave64 identifies chunks by GUID; the GUIDs of the WAV chunks
+   are their RIFF IDs followed by the same 12 bytes as 'wave' */
+static const unsigned char w64_riff[16]={'r','i','f','f',0x2e,0x91,0xcf,0x11,
+                                         0xa5,0xd6,0x28,0xdb,0x04,0xc1,0x00,0x00};
+static const unsigned char w64_wave[16]={'w','a','v','e',0xf3,0xac,0xd3,0x11,
+                                         0x8c,0xd1,0x00,0xc0,0x4f,0x8e,0xdb,0x8a};
+
 static int wav_id(char *path,unsigned char *buf){
-  if(memcmp(buf, "RIFF", 4))
+  if(!memcmp(buf, w64_riff, 16) && !memcmp(buf+24, w64_wave, 16))
+    return 1; /* Wave64 */
+  if(memcmp(buf, "RIFF", 4) && memcmp(buf, "RF64", 4) && memcmp(buf, "BW64", 4))
     return 0; /* Not wave */
   if(memcmp(buf+8, "WAVE",4))
     return 0; /* RIFF, but not wave */
@@ -121,42 +554,1182 @@ static int opus_id(char *path,unsigned char *buf){
     memcmp (buf+28, "OpusHead", 8) == 0;
 }
 
-static int sw_id(char *path,unsigned char *buf){
-  /* if all else fails, look for JM's favorite extension */
-  return memcmp(path+strlen(path)-3,".sw",3)==0;
+static int sw_id(char *path,unsigned char *buf){
+  /* if all else fails, look for JM's favorite extension */
+  return memcmp(path+strlen(path)-3,".sw",3)==0;
+}
+
+/* Integer PCM expansion ******************************************************/
+
+/* Uncompressed integer samples of any width and byte order are
+   expanded to float the same way: each sample is shuffled into the
+   top bytes of an int32 and scaled by 2^-31.  The SIMD kernels do
+   the shuffle with a byte table built once per format (pshufb on
+   x86, tbl on ARM); 8-bit WAV samples are offset binary and so also
+   flip the sign bit.  Byte order means nothing for 8-bit samples, so
+   there bend instead marks them as signed, as AIFF stores them.
+   Kernels are chosen at runtime by CPU. */
+
+typedef struct pcm_expand pcm_expand;
+struct pcm_expand {
+  int bits;            /* 8, 16, 24 or 32; -32 float, -64 double */
+  int bend;            /* big-endian samples (8-bit: signed) */
+  unsigned char shuf[16];
+  void (*fn)(const pcm_expand *x, float *out, const unsigned char *in, long n);
+};
+
+static void expand_c(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  long i;
+  switch(x->bits){
+  case 8:
+    if(x->bend){
+      for(i=0;i<n;i++,d++)
+        out[i] = (int32_t)(d[0]<<24) * (1.f/2147483648.f);
+    }else{
+      for(i=0;i<n;i++,d++)
+        out[i] = (int32_t)((d[0]-128)<<24) * (1.f/2147483648.f);
+    }
+    break;
+  case 16:
+    if(x->bend){
+      for(i=0;i<n;i++,d+=2)
+        out[i] = (int32_t)((d[0]<<24)|(d[1]<<16)) * (1.f/2147483648.f);
+    }else{
+      for(i=0;i<n;i++,d+=2)
+        out[i] = (int32_t)((d[0]<<16)|(d[1]<<24)) * (1.f/2147483648.f);
+    }
+    break;
+  case 24:
+    if(x->bend){
+      for(i=0;i<n;i++,d+=3)
+        out[i] = (int32_t)((d[0]<<24)|(d[1]<<16)|(d[2]<<8)) * (1.f/2147483648.f);
+    }else{
+      for(i=0;i<n;i++,d+=3)
+        out[i] = (int32_t)((d[0]<<8)|(d[1]<<16)|(d[2]<<24)) * (1.f/2147483648.f);
+    }
+    break;
+  case 32:
+    if(x->bend){
+      for(i=0;i<n;i++,d+=4)
+        out[i] = (int32_t)((d[0]<<24)|(d[1]<<16)|(d[2]<<8)|d[3]) * (1.f/2147483648.f);
+    }else{
+      for(i=0;i<n;i++,d+=4)
+        out[i] = (int32_t)(d[0]|(d[1]<<8)|(d[2]<<16)|(d[3]<<24)) * (1.f/2147483648.f);
+    }
+    break;
+  }
+}
+
+/* IEEE float samples need at most a byte swap.  Infinities and NaNs
+   (all-ones exponent) have no place in audio and become silence; the
+   test is on the bits, since -ffast-math builds may assume floats are
+   finite. */
+static uint32_t float_swap(uint32_t w){
+  return (w>>24) | ((w>>8)&0xff00) | ((w<<8)&0xff0000) | (w<<24);
+}
+
+static void expand_float_c(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  long i;
+  if(x->bend!=host_is_big_endian()){
+    for(i=0;i<n;i++,d+=4){
+      uint32_t w;
+      memcpy(&w,d,4);
+      w = float_swap(w);
+      if((w&0x7f800000)==0x7f800000)w=0;
+      memcpy(out+i,&w,4);
+    }
+  }else{
+    for(i=0;i<n;i++,d+=4){
+      uint32_t w;
+      memcpy(&w,d,4);
+      if((w&0x7f800000)==0x7f800000)w=0;
+      memcpy(out+i,&w,4);
+    }
+  }
+}
+
+/* doubles are narrowed to float on the way */
+static uint64_t double_swap(uint64_t w){
+  return ((uint64_t)float_swap((uint32_t)w)<<32) | float_swap((uint32_t)(w>>32));
+}
+
+static void expand_double_c(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  int swap = (x->bend!=host_is_big_endian());
+  long i;
+  for(i=0;i<n;i++,d+=8){
+    uint64_t w;
+    double v;
+    memcpy(&w,d,8);
+    if(swap)w = double_swap(w);
+    if((w&0x7ff0000000000000ULL)==0x7ff0000000000000ULL)w=0;
+    memcpy(&v,&w,8);
+    out[i] = v;
+  }
+}
+
+/* number of float samples that are infinite or NaN */
+static off_t float_invalid(const unsigned char *d, off_t n, int bend){
+  uint32_t mask = (bend!=host_is_big_endian() ? 0x807f : 0x7f800000);
+  off_t i,bad=0;
+  for(i=0;i<n;i++,d+=4){
+    uint32_t w;
+    memcpy(&w,d,4);
+    bad += ((w&mask)==mask);
+  }
+  return bad;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void expand_float_sse2(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  const __m128i exp = _mm_set1_epi32(0x7f800000);
+  const __m128i lo = _mm_set1_epi32(0x00ff00ff);
+  int swap = (x->bend!=host_is_big_endian());
+  long i=0;
+
+  for(;i+4<=n;i+=4,d+=16){
+    __m128i v = _mm_loadu_si128((const __m128i *)d);
+    if(swap){
+      /* bytes within halves, then halves within words */
+      v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v,8),lo),
+                       _mm_andnot_si128(lo,_mm_slli_epi16(v,8)));
+      v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v,0xb1),0xb1);
+    }
+    v = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(v,exp),exp),v);
+    _mm_storeu_si128((__m128i *)(out+i),v);
+  }
+  expand_float_c(x,out+i,d,n-i);
+}
+
+__attribute__((target("sse2")))
+static void expand_double_sse2(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  const __m128i exp = _mm_set1_epi64x(0x7ff0000000000000LL);
+  const __m128i lo = _mm_set1_epi32(0x00ff00ff);
+  int swap = (x->bend!=host_is_big_endian());
+  long i=0;
+
+  for(;i+4<=n;i+=4,d+=32){
+    __m128i v[2];
+    int j;
+    for(j=0;j<2;j++){
+      __m128i w = _mm_loadu_si128((const __m128i *)(d+j*16)),e;
+      if(swap){
+        /* bytes within halves, halves within words, words within
+           quadwords */
+        w = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(w,8),lo),
+                         _mm_andnot_si128(lo,_mm_slli_epi16(w,8)));
+        w = _mm_shufflehi_epi16(_mm_shufflelo_epi16(w,0x1b),0x1b);
+      }
+      /* no 64-bit compare in SSE2; both halves of the exponent word
+         must match, so compare the high dwords and spread them */
+      e = _mm_cmpeq_epi32(_mm_and_si128(w,exp),exp);
+      e = _mm_shuffle_epi32(e,0xf5);
+      v[j] = _mm_andnot_si128(e,w);
+    }
+    _mm_storeu_ps(out+i,_mm_movelh_ps(_mm_cvtpd_ps(_mm_castsi128_pd(v[0])),
+                                      _mm_cvtpd_ps(_mm_castsi128_pd(v[1]))));
+  }
+  expand_double_c(x,out+i,d,n-i);
+}
+
+/* SSE2 has no byte shuffle; it covers the formats that can be
+   widened with unpacks and shifts alone.  Big-endian samples are
+   swapped in 16-bit lanes first (and 32-bit samples then swap their
+   halves), after which they are the little-endian case. */
+__attribute__((target("sse2")))
+static void expand_sse2(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i flip = _mm_set1_epi8(x->bend ? 0 : (char)0x80);
+  const __m128 scale = _mm_set1_ps(1.f/2147483648.f);
+  const int swap = (x->bend && x->bits>8);
+  long i=0;
+
+  switch(x->bits){
+  case 8:
+    for(;i+16<=n;i+=16,d+=16){
+      __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)d),flip);
+      __m128i lo = _mm_unpacklo_epi8(zero,v);
+      __m128i hi = _mm_unpackhi_epi8(zero,v);
+      _mm_storeu_ps(out+i,    _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(zero,lo)),scale));
+      _mm_storeu_ps(out+i+4,  _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(zero,lo)),scale));
+      _mm_storeu_ps(out+i+8,  _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(zero,hi)),scale));
+      _mm_storeu_ps(out+i+12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(zero,hi)),scale));
+    }
+    break;
+  case 16:
+    for(;i+8<=n;i+=8,d+=16){
+      __m128i v = _mm_loadu_si128((const __m128i *)d);
+      if(swap)v = _mm_or_si128(_mm_srli_epi16(v,8),_mm_slli_epi16(v,8));
+      _mm_storeu_ps(out+i,   _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(zero,v)),scale));
+      _mm_storeu_ps(out+i+4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(zero,v)),scale));
+    }
+    break;
+  case 32:
+    for(;i+4<=n;i+=4,d+=16){
+      __m128i v = _mm_loadu_si128((const __m128i *)d);
+      if(swap){
+        v = _mm_or_si128(_mm_srli_epi16(v,8),_mm_slli_epi16(v,8));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v,0xb1),0xb1);
+      }
+      _mm_storeu_ps(out+i, _mm_mul_ps(_mm_cvtepi32_ps(v),scale));
+    }
+    break;
+  }
+  expand_c(x,out+i,d,n-i);
+}
+
+__attribute__((target("ssse3")))
+static void expand_ssse3(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  const __m128i shuf = _mm_loadu_si128((const __m128i *)x->shuf);
+  const __m128i flip = _mm_set1_epi32(x->bits==8 && !x->bend ? (int)0x80000000 : 0);
+  const __m128 scale = _mm_set1_ps(1.f/2147483648.f);
+  int B = x->bits/8;
+  long i=0;
+
+  /* each step consumes 4*B bytes but loads 16 */
+  for(;(i+4)*B+16-4*B<=n*B;i+=4,d+=4*B){
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)d),shuf);
+    v = _mm_xor_si128(v,flip);
+    _mm_storeu_ps(out+i, _mm_mul_ps(_mm_cvtepi32_ps(v),scale));
+  }
+  expand_c(x,out+i,d,n-i);
+}
+
+__attribute__((target("avx2")))
+static void expand_avx2(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  const __m128i s = _mm_loadu_si128((const __m128i *)x->shuf);
+  const __m256i shuf = _mm256_inserti128_si256(_mm256_castsi128_si256(s),s,1);
+  const __m256i flip = _mm256_set1_epi32(x->bits==8 && !x->bend ? (int)0x80000000 : 0);
+  const __m256 scale = _mm256_set1_ps(1.f/2147483648.f);
+  int B = x->bits/8;
+  long i=0;
+
+  /* four samples per 128-bit lane; the second lane loads from where
+     the first lane's samples end */
+  for(;(i+8)*B+16-4*B<=n*B;i+=8,d+=8*B){
+    __m256i v = _mm256_inserti128_si256
+      (_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)d)),
+       _mm_loadu_si128((const __m128i *)(d+4*B)),1);
+    v = _mm256_xor_si256(_mm256_shuffle_epi8(v,shuf),flip);
+    _mm256_storeu_ps(out+i, _mm256_mul_ps(_mm256_cvtepi32_ps(v),scale));
+  }
+  expand_c(x,out+i,d,n-i);
+}
+
+static void expand_pick(pcm_expand *x){
+  __builtin_cpu_init();
+  if(x->bits==-64)
+    x->fn = (__builtin_cpu_supports("sse2") ? expand_double_sse2 : expand_double_c);
+  else if(x->bits<0)
+    x->fn = (__builtin_cpu_supports("sse2") ? expand_float_sse2 : expand_float_c);
+  else if(__builtin_cpu_supports("avx2"))
+    x->fn = expand_avx2;
+  else if(__builtin_cpu_supports("ssse3"))
+    x->fn = expand_ssse3;
+  else if(__builtin_cpu_supports("sse2") && x->bits!=24)
+    x->fn = expand_sse2;
+  else
+    x->fn = expand_c;
+}
+
+#elif defined(__GNUC__) && defined(__aarch64__)
+#include <arm_neon.h>
+
+static void expand_neon(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  const uint8x16_t shuf = vld1q_u8(x->shuf);
+  const uint32x4_t flip = vdupq_n_u32(x->bits==8 && !x->bend ? 0x80000000U : 0);
+  int B = x->bits/8;
+  long i=0;
+
+  for(;(i+4)*B+16-4*B<=n*B;i+=4,d+=4*B){
+    uint32x4_t v = vreinterpretq_u32_u8(vqtbl1q_u8(vld1q_u8(d),shuf));
+    v = veorq_u32(v,flip);
+    vst1q_f32(out+i, vcvtq_n_f32_s32(vreinterpretq_s32_u32(v),31));
+  }
+  expand_c(x,out+i,d,n-i);
+}
+
+static void expand_float_neon(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  const uint32x4_t exp = vdupq_n_u32(0x7f800000);
+  int swap = (x->bend!=host_is_big_endian());
+  long i=0;
+
+  for(;i+4<=n;i+=4,d+=16){
+    uint8x16_t b = vld1q_u8(d);
+    uint32x4_t v = vreinterpretq_u32_u8(swap ? vrev32q_u8(b) : b);
+    v = vbicq_u32(v,vceqq_u32(vandq_u32(v,exp),exp));
+    vst1q_u32((uint32_t *)(out+i),v);
+  }
+  expand_float_c(x,out+i,d,n-i);
+}
+
+static void expand_double_neon(const pcm_expand *x, float *out, const unsigned char *d, long n){
+  const uint64x2_t exp = vdupq_n_u64(0x7ff0000000000000ULL);
+  int swap = (x->bend!=host_is_big_endian());
+  long i=0;
+
+  for(;i+4<=n;i+=4,d+=32){
+    uint8x16_t b0 = vld1q_u8(d), b1 = vld1q_u8(d+16);
+    uint64x2_t v0 = vreinterpretq_u64_u8(swap ? vrev64q_u8(b0) : b0);
+    uint64x2_t v1 = vreinterpretq_u64_u8(swap ? vrev64q_u8(b1) : b1);
+    v0 = vbicq_u64(v0,vceqq_u64(vandq_u64(v0,exp),exp));
+    v1 = vbicq_u64(v1,vceqq_u64(vandq_u64(v1,exp),exp));
+    vst1q_f32(out+i,vcombine_f32(vcvt_f32_f64(vreinterpretq_f64_u64(v0)),
+                                 vcvt_f32_f64(vreinterpretq_f64_u64(v1))));
+  }
+  expand_double_c(x,out+i,d,n-i);
+}
+
+static void expand_pick(pcm_expand *x){
+  if(x->bits==-64)
+    x->fn = expand_double_neon;
+  else
+    x->fn = (x->bits<0 ? expand_float_neon : expand_neon);
+}
+
+#else
+
+static void expand_pick(pcm_expand *x){
+  if(x->bits==-64)
+    x->fn = expand_double_c;
+  else
+    x->fn = (x->bits<0 ? expand_float_c : expand_c);
+}
+
+#endif
+
+static void expand_init(pcm_expand *x, int bits, int bend){
+  int B = bits/8;
+  int s,b;
+  x->bits = bits;
+  x->bend = bend;
+  if(bits<0){
+    expand_pick(x);
+    return;
+  }
+  /* sample s, byte b (least significant first) lands in int32 byte
+     4-B+b of lane s; the low bytes are left as zero (0x80 selects
+     zero for both pshufb and tbl) */
+  memset(x->shuf,0x80,sizeof(x->shuf));
+  for(s=0;s<4;s++)
+    for(b=0;b<B;b++)
+      x->shuf[s*4+4-B+b] = s*B + (bend ? B-1-b : b);
+  expand_pick(x);
+}
+
+/* Mapped PCM support *********************************************************/
+
+/* Uncompressed PCM can be played straight out of a read-only
+   mapping of the file; samples are only expanded to float as the
+   render path asks for them, and only the pages actually auditioned
+   become resident.  The same source also serves integer samples
+   kept in memory at their native width (-k). */
+
+typedef struct {
+  unsigned char *map;  /* NULL if data is a heap buffer */
+  size_t maplen;
+  input_source *in;    /* or data is held in memory by this input */
+  unsigned char *data; /* first sample of the data chunk */
+  off_t frames;
+  int ch;
+  int bits;            /* 8, 16, 24 or 32; -32 float, -64 double */
+  int bend;            /* big-endian samples (8-bit: signed) */
+  pcm_expand x;
+  off_t ahead;         /* read-ahead window, frames */
+  off_t advised_from;
+  off_t advised_to;
+  int scanning;
+  off_t invalid;       /* non-finite floats read while scanning */
+} map_source;
+
+static void map_advise(map_source *m, off_t frame, off_t frames){
+  long page = sysconf(_SC_PAGESIZE);
+  off_t bpf = m->ch*(abs(m->bits)/8);
+  unsigned char *a,*b;
+
+  if(frame<0)frame=0;
+  if(frame+frames>m->frames)frames=m->frames-frame;
+  if(frames<=0)return;
+
+  a = m->data+frame*bpf;
+  b = a+frames*bpf;
+  a = m->map+(a-m->map)/page*page;
+  madvise(a,b-a,MADV_WILLNEED);
+}
+
+static void map_prefetch(void *source, off_t frame, off_t frames){
+  map_source *m = (map_source *)source;
+  if(m->map)
+    map_advise(m,frame,frames);
+}
+
+/* The clipping scan reads float sources front to back once.  Reads
+   silence non-finite values, so they're counted here instead. */
+static off_t map_scan(void *source, int on){
+  map_source *m = (map_source *)source;
+  long page = sysconf(_SC_PAGESIZE);
+  if(m->map){
+    unsigned char *a = m->map+(m->data-m->map)/page*page;
+    madvise(a,m->data+m->frames*m->ch*(abs(m->bits)/8)-a,on ? MADV_SEQUENTIAL : MADV_NORMAL);
+  }
+  m->scanning=on;
+  if(on)m->invalid=0;
+  return m->invalid;
+}
+
+static long map_read(void *source, off_t frame, int frames, float *out){
+  map_source *m = (map_source *)source;
+  unsigned char *d;
+  long n;
+
+  if(frame<0 || frame>=m->frames)return 0;
+  if(frames>m->frames-frame)frames=m->frames-frame;
+
+  /* keep the kernel reading ahead of the cursor; a read outside the
+     current window is a seek or a loop restart */
+  if(m->map && (frame<m->advised_from || frame+frames+m->ahead/2>m->advised_to)){
+    map_advise(m,frame,m->ahead);
+    m->advised_from=frame;
+    m->advised_to=frame+m->ahead;
+  }
+
+  d = m->data+frame*m->ch*(abs(m->bits)/8);
+  n = (long)frames*m->ch;
+  if(m->scanning && m->bits==-32)
+    m->invalid+=float_invalid(d,n,m->bend);
+  m->x.fn(&m->x,out,d,n);
+  return frames;
+}
+
+static void map_close(void *source){
+  map_source *m = (map_source *)source;
+  if(m->in)
+    m->in->close(m->in);
+  else if(m->map)
+    munmap(m->map,m->maplen);
+  else
+    free(m->data);
+  free(m);
+}
+
+static int map_attach(pcm_t *pcm, map_source *m){
+  pcm->lazy = calloc(1,sizeof(*pcm->lazy));
+  if(!pcm->lazy)
+    return 1;
+  pcm->lazy->source = m;
+  pcm->lazy->read = map_read;
+  pcm->lazy->prefetch = map_prefetch;
+  pcm->lazy->close = map_close;
+  pcm->lazy->ch = pcm->ch;
+  pcm->lazy->gain = 1.f;
+
+  /* sized as if loaded and expanded to float */
+  pcm->size = m->frames*pcm->ch*sizeof(float);
+  return 0;
+}
+
+/* Map the pcm->size bytes of integer samples at the current file
+   position, or for an input already in memory, use them where they
+   are.  Returns nonzero if the file can't be mapped, in which case
+   the caller loads it normally. */
+static int map_pcm(char *path, input_source *in, pcm_t *pcm, int bits, int bend){
+  off_t offset = in->tell(in);
+  off_t length = in->length(in);
+  off_t bytes = pcm->size;
+  map_source *m;
+
+  if(offset<0 || length<0 || (in->fd<0 && !in->view))
+    return 1;
+
+  if(offset+bytes>length){
+    if(sb_verbose)
+      fprintf(stderr,"\r%s: File ended before declared length (%ld < %ld); continuing...\n",
+              path,(long)(length-offset),(long)bytes);
+    bytes=(length>offset ? length-offset : 0);
+  }
+
+  m = calloc(1,sizeof(*m));
+  if(!m)return 1;
+  if(in->fd>=0){
+    m->maplen = length;
+    m->map = mmap(NULL,m->maplen,PROT_READ,MAP_PRIVATE,in->fd,0);
+    if(m->map==MAP_FAILED){
+      if(sb_verbose)
+        fprintf(stderr,"\r%s: Failed to map file (%s); loading instead.\n",path,strerror(errno));
+      free(m);
+      return 1;
+    }
+    m->data = m->map+offset;
+  }else{
+    /* held open for as long as the pcm is */
+    if(!(m->in=in->reopen(in)) || !(m->data=in->view(in,offset,bytes))){
+      if(m->in)m->in->close(m->in);
+      free(m);
+      return 1;
+    }
+  }
+  m->ch = pcm->ch;
+  m->bits = bits;
+  m->bend = bend;
+  expand_init(&m->x,bits,bend);
+  m->frames = bytes/(pcm->ch*(abs(bits)/8));
+  m->ahead = (off_t)pcm->rate*2;
+
+  if(map_attach(pcm,m)){
+    map_close(m);
+    return 1;
+  }
+  if(bits<0)
+    pcm->lazy->scan = map_scan;
+
+  if(load_verbose())
+    fprintf(stderr,"\rLoading %s: mapped.         ",pcm->name);
+  return 0;
+}
+
+/* Hand a heap buffer of 'bytes' bytes of integer samples to the
+   pcm as its on-demand source; the buffer is freed with it. */
+static int native_pcm(pcm_t *pcm, unsigned char *buf, off_t bytes, int bits, int bend){
+  map_source *m = calloc(1,sizeof(*m));
+  if(!m)return 1;
+  m->data = buf;
+  m->ch = pcm->ch;
+  m->bits = bits;
+  m->bend = bend;
+  expand_init(&m->x,bits,bend);
+  m->frames = bytes/(pcm->ch*(abs(bits)/8));
+  if(map_attach(pcm,m)){
+    free(m);
+    return 1;
+  }
+  pcm->data = NULL;
+  return 0;
+}
+
+#define EXPAND_CHUNK 49152 /* bytes; whole samples at any width */
+
+/* Sequential reads ahead of conversion ************************************/
+
+/* The uncompressed loaders read through this rather than fread, so
+   several large reads are in flight while completed blocks are being
+   converted.  Reads are queued with io_uring where the kernel has it,
+   or else handed to a reader thread; either way the kernel is told
+   the file is read sequentially.  Blocks come back in file order,
+   read into a small ring of buffers or, given a destination, straight
+   to where they belong. */
+
+#define AIO_BLOCK (EXPAND_CHUNK*32) /* bytes; whole samples at any width */
+#define AIO_DEPTH 4
+
+typedef struct {
+  unsigned char *buf;
+  off_t offset;     /* from the start of the read */
+  long want;
+  long got;
+  int state;        /* AIO_IDLE etc */
+  struct iovec iov;
+} aio_slot;
+
+#define AIO_IDLE 0
+#define AIO_QUEUED 1
+#define AIO_DONE 2
+
+typedef struct {
+  input_source *in;
+  int fd;
+  off_t start;
+  off_t bytes;
+  unsigned char *dest;
+  unsigned char *ring;
+  aio_slot slot[AIO_DEPTH];
+  off_t issued;     /* bytes queued so far */
+  off_t consumed;   /* bytes handed back */
+  int next;         /* slot holding the next block in order */
+  int held;         /* slot the caller is working on, or -1 */
+  int error;
+
+  /* reader thread */
+  int threaded;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int closing;
+
+#ifdef AIO_URING
+  int ring_fd;
+  int inflight;     /* queued, including those not yet submitted */
+  int pending;      /* in the ring but not yet taken by the kernel */
+  int ring_failed;  /* fall back to pread once the CQ is let go */
+  unsigned char *sq_map,*cq_map;
+  size_t sq_len,cq_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+  unsigned *cq_head,*cq_tail,*cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+} aio_reader;
+
+/* read as much of the slot as the file holds */
+static void aio_pread(aio_reader *r, aio_slot *s){
+  while(s->got<s->want){
+    ssize_t n=pread(r->fd,s->buf+s->got,s->want-s->got,r->start+s->offset+s->got);
+    if(n<0 && errno==EINTR)continue;
+    if(n<0)r->error=1;
+    if(n<=0)break;
+    s->got+=n;
+  }
+}
+
+static void *aio_thread(void *arg){
+  aio_reader *r = (aio_reader *)arg;
+  int i=0;
+  pthread_mutex_lock(&r->mutex);
+  while(1){
+    aio_slot *s = r->slot+i;
+    while(!r->closing && s->state!=AIO_QUEUED)
+      pthread_cond_wait(&r->cond,&r->mutex);
+    if(r->closing)break;
+    pthread_mutex_unlock(&r->mutex);
+    aio_pread(r,s);
+    pthread_mutex_lock(&r->mutex);
+    s->state=AIO_DONE;
+    pthread_cond_broadcast(&r->cond);
+    i=(i+1)%AIO_DEPTH;
+  }
+  pthread_mutex_unlock(&r->mutex);
+  return NULL;
+}
+
+#ifdef AIO_URING
+static int aio_uring_setup(aio_reader *r){
+  struct io_uring_params p;
+  memset(&p,0,sizeof(p));
+  r->ring_fd=syscall(__NR_io_uring_setup,AIO_DEPTH,&p);
+  if(r->ring_fd<0)return 1;
+
+  r->sq_len=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  r->cq_len=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  r->sqes_len=p.sq_entries*sizeof(struct io_uring_sqe);
+  r->sq_map=mmap(NULL,r->sq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+                 r->ring_fd,IORING_OFF_SQ_RING);
+  r->cq_map=mmap(NULL,r->cq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+                 r->ring_fd,IORING_OFF_CQ_RING);
+  r->sqes=mmap(NULL,r->sqes_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+               r->ring_fd,IORING_OFF_SQES);
+  if(r->sq_map==MAP_FAILED || r->cq_map==MAP_FAILED || r->sqes==MAP_FAILED){
+    if(r->sq_map!=MAP_FAILED)munmap(r->sq_map,r->sq_len);
+    if(r->cq_map!=MAP_FAILED)munmap(r->cq_map,r->cq_len);
+    if(r->sqes!=MAP_FAILED)munmap(r->sqes,r->sqes_len);
+    close(r->ring_fd);
+    r->ring_fd=-1;
+    return 1;
+  }
+  r->sq_head=(unsigned *)(r->sq_map+p.sq_off.head);
+  r->sq_tail=(unsigned *)(r->sq_map+p.sq_off.tail);
+  r->sq_mask=(unsigned *)(r->sq_map+p.sq_off.ring_mask);
+  r->sq_array=(unsigned *)(r->sq_map+p.sq_off.array);
+  r->cq_head=(unsigned *)(r->cq_map+p.cq_off.head);
+  r->cq_tail=(unsigned *)(r->cq_map+p.cq_off.tail);
+  r->cq_mask=(unsigned *)(r->cq_map+p.cq_off.ring_mask);
+  r->cqes=(struct io_uring_cqe *)(r->cq_map+p.cq_off.cqes);
+  return 0;
+}
+
+#define AIO_RETRIES 100
+
+/* submit whatever is pending, waiting for a completion if asked;
+   nonzero if the ring can't be used any more */
+static int aio_uring_enter(aio_reader *r, int wait){
+  int tries=0;
+  while(1){
+    int ret=syscall(__NR_io_uring_enter,r->ring_fd,r->pending,wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+    if(ret>=0){
+      r->pending-=ret;
+      return 0;
+    }
+    if(errno==EINTR)continue;
+    /* out of resources or the CQ is full for now; reaping (or time)
+       clears it */
+    if((errno==EAGAIN || errno==EBUSY) && tries++<AIO_RETRIES){
+      if(wait && errno==EBUSY)return 0;
+      usleep(1000);
+      continue;
+    }
+    return 1;
+  }
+}
+
+/* take back the reads the kernel never saw; the slots stay queued
+   for aio_uring_fallback */
+static void aio_uring_fail(aio_reader *r){
+  __atomic_store_n(r->sq_tail,*r->sq_tail-r->pending,__ATOMIC_RELEASE);
+  r->inflight-=r->pending;
+  r->pending=0;
+  r->error=1;
+  r->ring_failed=1;
+}
+
+/* queue a read of the rest of slot i */
+static void aio_uring_submit(aio_reader *r, int i){
+  aio_slot *s = r->slot+i;
+  unsigned tail = *r->sq_tail;
+  unsigned idx = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = r->sqes+idx;
+
+  if(r->ring_failed)return;
+  s->iov.iov_base=s->buf+s->got;
+  s->iov.iov_len=s->want-s->got;
+  memset(sqe,0,sizeof(*sqe));
+  sqe->opcode=IORING_OP_READV;
+  sqe->fd=r->fd;
+  sqe->off=r->start+s->offset+s->got;
+  sqe->addr=(unsigned long)&s->iov;
+  sqe->len=1;
+  sqe->user_data=i;
+  r->sq_array[idx]=idx;
+  __atomic_store_n(r->sq_tail,tail+1,__ATOMIC_RELEASE);
+  r->inflight++;
+  r->pending++;
+
+  if(aio_uring_enter(r,0))
+    aio_uring_fail(r);
+}
+
+/* Stop using the ring: wait out what the kernel still has, then
+   finish every queued slot with pread.  If the kernel can't be waited
+   on, the ring buffer is abandoned to it rather than reused. */
+static void aio_uring_fallback(aio_reader *r){
+  int i;
+  while(r->inflight>0 && !aio_uring_enter(r,1)){
+    unsigned head=*r->cq_head;
+    while(head!=__atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE)){
+      head++;
+      r->inflight--;
+    }
+    __atomic_store_n(r->cq_head,head,__ATOMIC_RELEASE);
+  }
+  if(r->inflight>0 && !r->dest){
+    unsigned char *ring = malloc((size_t)AIO_BLOCK*AIO_DEPTH);
+    if(ring){
+      r->ring=ring;
+      for(i=0;i<AIO_DEPTH;i++)
+        if(r->slot[i].state==AIO_QUEUED){
+          r->slot[i].buf=r->ring+(off_t)i*AIO_BLOCK;
+          r->slot[i].got=0;
+        }
+    }
+  }
+  munmap(r->sq_map,r->sq_len);
+  munmap(r->cq_map,r->cq_len);
+  munmap(r->sqes,r->sqes_len);
+  close(r->ring_fd);
+  r->ring_fd=-1;
+  r->inflight=0;
+
+  pthread_mutex_init(&r->mutex,NULL);
+  pthread_cond_init(&r->cond,NULL);
+  for(i=0;i<AIO_DEPTH;i++)
+    if(r->slot[i].state==AIO_QUEUED){
+      aio_pread(r,r->slot+i);
+      r->slot[i].state=AIO_DONE;
+    }
+}
+
+/* wait for at least one completion and file them all */
+static void aio_uring_reap(aio_reader *r){
+  unsigned head;
+  if(!r->ring_failed && aio_uring_enter(r,1))
+    aio_uring_fail(r);
+  head=*r->cq_head;
+  while(head!=__atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE)){
+    struct io_uring_cqe *cqe = r->cqes+(head & *r->cq_mask);
+    int i = cqe->user_data;
+    int res = cqe->res;
+    aio_slot *s = r->slot+i;
+    head++;
+    __atomic_store_n(r->cq_head,head,__ATOMIC_RELEASE);
+    r->inflight--;
+
+    if(res==-EINTR || res==-EAGAIN){
+      aio_uring_submit(r,i);
+    }else if(res>0 && s->got+res<s->want){
+      /* short read; queue the rest */
+      s->got+=res;
+      aio_uring_submit(r,i);
+    }else{
+      if(res<0)r->error=1;
+      if(res>0)s->got+=res;
+      s->state=AIO_DONE;
+    }
+  }
+  /* only now is the CQ no longer being walked */
+  if(r->ring_failed)
+    aio_uring_fallback(r);
+}
+#endif
+
+static void aio_issue(aio_reader *r, int i){
+  aio_slot *s = r->slot+i;
+  s->offset=r->issued;
+  s->want=(r->bytes-r->issued>AIO_BLOCK ? AIO_BLOCK : r->bytes-r->issued);
+  s->got=0;
+  s->buf=(r->dest ? r->dest+s->offset : r->ring+(off_t)i*AIO_BLOCK);
+  r->issued+=s->want;
+
+#ifdef AIO_URING
+  if(r->ring_fd>=0){
+    s->state=AIO_QUEUED;
+    aio_uring_submit(r,i);
+    if(r->ring_failed)
+      aio_uring_fallback(r);
+    return;
+  }
+#endif
+  if(r->threaded){
+    pthread_mutex_lock(&r->mutex);
+    s->state=AIO_QUEUED;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+    return;
+  }
+  aio_pread(r,s);
+  s->state=AIO_DONE;
+}
+
+/* read 'bytes' bytes from the current position of 'in', into 'dest'
+   if not NULL; NULL if 'in' isn't a file, or already in memory */
+static aio_reader *aio_open(input_source *in, off_t bytes, unsigned char *dest){
+  aio_reader *r;
+  int i;
+  if(in->fd<0 || in->view || !(r=calloc(1,sizeof(*r))))return NULL;
+  r->in=in;
+  r->fd=in->fd;
+  r->start=in->tell(in);
+  r->bytes=bytes;
+  r->dest=dest;
+  r->held=-1;
+  if(r->start<0){
+    free(r);
+    return NULL;
+  }
+  if(!dest){
+    r->ring=malloc((size_t)AIO_BLOCK*AIO_DEPTH);
+    if(!r->ring){
+      free(r);
+      return NULL;
+    }
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(r->fd,r->start,bytes,POSIX_FADV_SEQUENTIAL);
+#endif
+
+#ifdef AIO_URING
+  if(aio_uring_setup(r))
+#endif
+  {
+    pthread_mutex_init(&r->mutex,NULL);
+    pthread_cond_init(&r->cond,NULL);
+    r->threaded=!pthread_create(&r->thread,NULL,aio_thread,r);
+  }
+
+  for(i=0;i<AIO_DEPTH && r->issued<r->bytes;i++)
+    aio_issue(r,i);
+  return r;
+}
+
+/* the next block in file order; returns its length, 0 at the end */
+static long aio_next(aio_reader *r, unsigned char **buf){
+  aio_slot *s;
+  if(r->held>=0){
+    r->slot[r->held].state=AIO_IDLE;
+    if(r->issued<r->bytes)
+      aio_issue(r,r->held);
+    r->held=-1;
+  }
+  if(r->consumed>=r->issued)
+    return 0;
+
+  s=r->slot+r->next;
+#ifdef AIO_URING
+  while(r->ring_fd>=0 && s->state!=AIO_DONE)
+    aio_uring_reap(r);
+#endif
+  if(r->threaded){
+    pthread_mutex_lock(&r->mutex);
+    while(s->state!=AIO_DONE)
+      pthread_cond_wait(&r->cond,&r->mutex);
+    pthread_mutex_unlock(&r->mutex);
+  }
+
+  if(s->got<s->want){
+    /* end of file or an error; nothing after this counts */
+    r->bytes=r->issued=r->consumed+s->got;
+  }
+  r->consumed+=s->got;
+  r->held=r->next;
+  r->next=(r->next+1)%AIO_DEPTH;
+  *buf=s->buf;
+  return s->got;
+}
+
+/* leaves 'in' positioned after the bytes handed back */
+static void aio_close(aio_reader *r){
+  if(!r)return;
+#ifdef AIO_URING
+  while(r->ring_fd>=0 && r->inflight>0)
+    aio_uring_reap(r);
+  if(r->ring_fd>=0){
+    munmap(r->sq_map,r->sq_len);
+    munmap(r->cq_map,r->cq_len);
+    munmap(r->sqes,r->sqes_len);
+    close(r->ring_fd);
+  }else
+#endif
+  {
+    if(r->threaded){
+      pthread_mutex_lock(&r->mutex);
+      r->closing=1;
+      pthread_cond_broadcast(&r->cond);
+      pthread_mutex_unlock(&r->mutex);
+      pthread_join(r->thread,NULL);
+    }
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->cond);
+  }
+  r->in->seek(r->in,r->start+r->consumed,SEEK_SET);
+  free(r->ring);
+  free(r);
+}
+
+/* read up to 'size' bytes into 'd'; returns the count read */
+static off_t read_all(pcm_t *pcm, input_source *in, unsigned char *d, off_t size){
+  aio_reader *r = aio_open(in,size,d);
+  off_t j=0;
+  long bytes;
+  unsigned char *buf;
+
+  if(r==NULL){
+    while(j<size){
+      bytes = (size-j > 65536 ? 65536 : size-j);
+      if(load_verbose())
+        fprintf(stderr,"\rLoading %s: %ld to go...       ",pcm->name,(long)(size-j));
+      if((bytes=in->read(in,d+j,bytes))<=0)break;
+      j+=bytes;
+    }
+    return j;
+  }
+
+  while(1){
+    if(load_verbose())
+      fprintf(stderr,"\rLoading %s: %ld to go...       ",pcm->name,(long)(size-j));
+    if((bytes=aio_next(r,&buf))<=0)break;
+    j+=bytes;
+  }
+  aio_close(r);
+  return j;
+}
+
+/* Read pcm->size bytes of PCM from the current position, expanding
+   into a newly allocated float buffer as it arrives, or with -k
+   keeping integer samples as read.  Truncated files keep the whole
+   frames that are present. */
+static int read_pcm(char *path, input_source *in, pcm_t *pcm, int bits, int bend){
+  int B = abs(bits)/8;
+  off_t samples = pcm->size/B;
+  off_t j=0;
+  pcm_expand x;
+  aio_reader *r;
+  unsigned char *buf;
+  float *f;
+
+  if(sb_native && bits>0){
+    off_t got=0;
+    /* already in memory; keep it where it is */
+    if(in->view && !map_pcm(path,in,pcm,bits,bend))
+      return 0;
+    buf = malloc(samples*B);
+    if(buf == NULL){
+      fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
+      return -1;
+    }
+    got=read_all(pcm,in,buf,samples*B);
+    if(got<samples*B && sb_verbose)
+      fprintf(stderr,"\r%s: File ended before declared length (%ld < %ld); continuing...\n",
+              path,(long)got,(long)pcm->size);
+    if(native_pcm(pcm,buf,got,bits,bend)){
+      fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
+      free(buf);
+      return -1;
+    }
+    return 0;
+  }
+
+  pcm->data = calloc(samples,sizeof(float));
+  if(pcm->data == NULL){
+    fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
+    return -1;
+  }
+  f = (float *)pcm->data;
+  expand_init(&x,bits,bend);
+
+  if(in->view){
+    off_t pos = in->tell(in);
+    off_t n = (in->length(in)-pos)/B;
+    if(n>samples)n=samples;
+    if(n>0 && (buf=in->view(in,pos,n*B))!=NULL){
+      while(j<n){
+        long c = (n-j > EXPAND_CHUNK/B ? EXPAND_CHUNK/B : n-j);
+        if(load_verbose())
+          fprintf(stderr,"\rLoading %s: %ld to go...       ",pcm->name,(long)((samples-j)*B));
+        x.fn(&x,f+j,buf+j*B,c);
+        j+=c;
+        load_progress(pcm,j-j%pcm->ch,samples);
+      }
+    }
+    in->seek(in,pos+j*B,SEEK_SET);
+  }else if((r=aio_open(in,samples*B,NULL))!=NULL){
+    /* blocks are whole samples until the last */
+    long got;
+    while(1){
+      if(load_verbose())
+        fprintf(stderr,"\rLoading %s: %ld to go...       ",pcm->name,(long)((samples-j)*B));
+      if((got=aio_next(r,&buf))<=0)break;
+      x.fn(&x,f+j,buf,got/B);
+      j+=got/B;
+      load_progress(pcm,j-j%pcm->ch,samples);
+    }
+    aio_close(r);
+  }else{
+    buf = malloc(EXPAND_CHUNK);
+    if(buf == NULL){
+      fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
+      return -1;
+    }
+    while(j<samples){
+      long want = (samples-j > EXPAND_CHUNK/B ? EXPAND_CHUNK/B : samples-j)*B;
+      long got=0,bytes;
+      if(load_verbose())
+        fprintf(stderr,"\rLoading %s: %ld to go...       ",pcm->name,(long)((samples-j)*B));
+      while(got<want && (bytes=in->read(in,buf+got,want-got))>0)
+        got+=bytes;
+      x.fn(&x,f+j,buf,got/B);
+      j+=got/B;
+      load_progress(pcm,j-j%pcm->ch,samples);
+      if(got<want)break;
+    }
+    free(buf);
+  }
+
+  if(j<samples){
+    if(sb_verbose)
+      fprintf(stderr,"\r%s: File ended before declared length (%ld < %ld); continuing...\n",
+              path,(long)(j*B),(long)pcm->size);
+    j-=j%pcm->ch;
+  }
+  pcm->size=j*sizeof(float);
+  return 0;
+}
+
+/* Read pcm->size bytes of IEEE float samples.  Floats are read
+   straight into place and at most byte swapped there; doubles are
+   narrowed as they're read, like integer samples. */
+static int read_float(char *path, input_source *in, pcm_t *pcm, int bits, int bend){
+  off_t j;
+
+  if(bits==-64)
+    return read_pcm(path,in,pcm,bits,bend);
+
+  pcm->data = calloc(1,pcm->size);
+  if(pcm->data == NULL){
+    fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
+    return -1;
+  }
+
+  j=read_all(pcm,in,pcm->data,pcm->size);
+  if(j<pcm->size && sb_verbose)
+    fprintf(stderr,"\r%s: File ended before declared length (%ld < %ld); continuing...\n",path,(long)j,(long)pcm->size);
+  pcm->size=j-j%(pcm->ch*4);
+
+  if(float_invalid(pcm->data,pcm->size/4,bend)){
+    fprintf(stderr,"%s: Input file contains invalid floating point values.\n",pcm->name);
+    exit(6);
+  }
+  if(bend!=host_is_big_endian()){
+    pcm_expand x;
+    expand_init(&x,-32,bend);
+    x.fn(&x,(float *)pcm->data,pcm->data,pcm->size/4);
+  }
+  return 0;
 }
 
 /* WAV file support ***********************************************************/
 
-static int find_wav_chunk(FILE *in, char *path, char *type, unsigned int *len){
-  unsigned char buf[8];
+/* WAV container flavors.  RF64 (and BW64, its broadcast twin) is
+   RIFF with 64-bit sizes in a leading ds64 chunk standing in for
+   32-bit sizes of 0xffffffff; Wave64 has GUID chunk IDs and 64-bit
+   sizes that include the 24 byte chunk header, padded to 8 bytes. */
+#define WAV_RIFF 0
+#define WAV_RF64 1
+#define WAV_W64  2
+
+/* bytes of padding after a chunk of 'len' bytes */
+static off_t wav_pad(int form, off_t len){
+  return form==WAV_W64 ? -len&7 : len&1;
+}
+
+static int find_wav_chunk(input_source *in, char *path, int form, off_t ds64_data,
+                          char *type, off_t *len){
+  unsigned char buf[24];
+  int hlen = (form==WAV_W64 ? 24 : 8);
 
   while(1){
-    if(fread(buf,1,8,in) < 8){
+    int match;
+    if(in->read(in,buf,hlen) < hlen){
       fprintf(stderr, "%s: Unexpected EOF in reading WAV header\n",path);
       return 0; /* EOF before reaching the appropriate chunk */
     }
 
-    if(memcmp(buf, type, 4)){
-      *len = READ_U32_LE(buf+4);
-      if(fseek(in, *len, SEEK_CUR))
+    if(form==WAV_W64){
+      match = !memcmp(buf, type, 4) && !memcmp(buf+4, w64_wave+4, 12);
+      *len = READ_U64_LE(buf+16)-24;
+      if(*len<0)
         return 0;
-
-      buf[4] = 0;
     }else{
-      *len = READ_U32_LE(buf+4);
-      return 1;
+      match = !memcmp(buf, type, 4);
+      *len = (unsigned int)READ_U32_LE(buf+4);
+      if(form==WAV_RF64 && *len==0xffffffffU && !memcmp(buf, "data", 4))
+        *len = ds64_data;
     }
+
+    if(match)
+      return 1;
+    if(in->seek(in,*len+wav_pad(form,*len),SEEK_CUR))
+      return 0;
   }
 }
 
-static pcm_t *wav_load(char *path, FILE *in){
+static pcm_t *wav_load(char *path, input_source *in){
   unsigned char buf[40];
-  unsigned int len;
+  off_t len,fmtlen;
+  off_t ds64_data=0;
+  int form=WAV_RIFF;
   pcm_t *pcm = NULL;
+  int huge;
   int i;
 
-  if(fseek(in,12,SEEK_SET)==-1){
+  if(in->seek(in,0,SEEK_SET)==-1 || in->read(in,buf,40)<40){
+    fprintf(stderr,"%s: Failed to seek\n",path);
+    goto err;
+  }
+  if(!memcmp(buf,w64_riff,16))
+    form=WAV_W64;
+  else if(!memcmp(buf,"RF64",4) || !memcmp(buf,"BW64",4))
+    form=WAV_RF64;
+  if(in->seek(in,form==WAV_W64 ? 40 : 12,SEEK_SET)==-1){
     fprintf(stderr,"%s: Failed to seek\n",path);
     goto err;
   }
@@ -164,10 +1737,22 @@ static pcm_t *wav_load(char *path, FILE *in){
   pcm = calloc(1,sizeof(pcm_t));
   pcm->name=strdup(trim_path(path));
 
-  if(!find_wav_chunk(in, path, "fmt ", &len)){
+  if(form==WAV_RF64){
+    /* riff size, data size, sample count, then a table for any other
+       oversized chunks, which we have no use for */
+    if(!find_wav_chunk(in, path, WAV_RIFF, 0, "ds64", &len) || len<24 ||
+       in->read(in,buf,24)<24 || in->seek(in,len-24+wav_pad(form,len),SEEK_CUR)){
+      fprintf(stderr,"%s: Failed to read ds64 chunk in RF64 file\n",path);
+      goto err;
+    }
+    ds64_data=READ_U64_LE(buf+8);
+  }
+
+  if(!find_wav_chunk(in, path, form, ds64_data, "fmt ", &len)){
     fprintf(stderr,"%s: Failed to find fmt chunk in WAV file\n",path);
     goto err;
   }
+  fmtlen=len;
 
   if(len < 16){
     fprintf(stderr, "%s: Unrecognised format chunk in WAV header\n",path);
@@ -190,7 +1775,8 @@ static pcm_t *wav_load(char *path, FILE *in){
 
   if(len>40)len=40;
 
-  if(fread(buf,1,len,in) < len){
+  if(in->read(in,buf,len) < len ||
+     in->seek(in,fmtlen-len+wav_pad(form,fmtlen),SEEK_CUR)){
     fprintf(stderr,"%s: Unexpected EOF in reading WAV header\n",path);
     goto err;
   }
@@ -267,8 +1853,8 @@ static pcm_t *wav_load(char *path, FILE *in){
     }
   }
 
-  if(!find_wav_chunk(in, path, "data", &len)){
-    fprintf(stderr,"%s: Failed to find fmt chunk in WAV file\n",path);
+  if(!find_wav_chunk(in, path, form, ds64_data, "data", &len)){
+    fprintf(stderr,"%s: Failed to find data chunk in WAV file\n",path);
     goto err;
   }
 
@@ -283,8 +1869,9 @@ static pcm_t *wav_load(char *path, FILE *in){
     }
   }
 
-  if((format==1 && (samplesize == 24 || samplesize == 16 || samplesize == 8)) ||
-     (samplesize == 32 && format == 3)){
+  if((format==1 && (samplesize == 32 || samplesize == 24 ||
+                    samplesize == 16 || samplesize == 8)) ||
+     (format==3 && (samplesize == 32 || samplesize == 64))){
     /* OK, good - we have a supported format,
        now we want to find the size of the file */
     pcm->rate = samplerate;
@@ -294,129 +1881,56 @@ static pcm_t *wav_load(char *path, FILE *in){
 
     if(len){
       pcm->size = len;
+      /* a pipe or buffer ends where it ends; don't size the load
+         buffer from a placeholder length such as a streaming
+         writer's 0xffffffff */
+      if(in->fd<0){
+        off_t left = in->length(in)-in->tell(in);
+        if(left>=0 && pcm->size>left)pcm->size=left;
+      }
     }else{
-      long pos;
-      pos = ftell(in);
-      if(fseek(in, 0, SEEK_END) == -1){
+      off_t pos;
+      pos = in->tell(in);
+      if(in->seek(in,0,SEEK_END) == -1){
         fprintf(stderr,"%s failed to seek: %s\n",path,strerror(errno));
         goto err;
       }else{
-        pcm->size = ftell(in) - pos;
-        fseek(in,pos, SEEK_SET);
+        pcm->size = in->tell(in) - pos;
+        in->seek(in,pos,SEEK_SET);
       }
     }
 
   }else{
     fprintf(stderr,
-            "%s: Wav file is unsupported subformat (must be 8,16, or 24-bit PCM\n"
-            "or floating point PCM\n",path);
+            "%s: Wav file is unsupported subformat (must be 8, 16, 24 or 32-bit\n"
+            "integer PCM or 32 or 64-bit floating point PCM\n",path);
     goto err;
   }
 
-  /* read the samples into memory */
-  switch(pcm->nativebits){
-  case 8:
-    pcm->data = calloc(1,pcm->size*sizeof(float));
-    break;
-  case 16:
-    pcm->data = calloc(1,pcm->size/2*sizeof(float));
-    break;
-  case 24:
-    pcm->data = calloc(1,pcm->size/3*sizeof(float));
-    break;
-  case -32:
-  case 32:
-    pcm->data = calloc(1,pcm->size/4*sizeof(float));
-    break;
-  default:
-    /* Won't get here unless the code is modified and the modifier
-       misses expanding here and below */
-    fprintf(stderr,"%s: Unsupported bit depth\n",path);
-    goto err;
-  }
+  /* data too big for a 32-bit size is far too big to expand to float
+     in memory; it's mapped as if -m were given.  Anything smaller
+     loads as usual whatever its container. */
+  huge = pcm->size>(off_t)0xffffffffLL;
 
-  if(pcm->data == NULL){
-    fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
+  if(window_pcm(path,in,pcm,pcm->ch*(abs(pcm->nativebits)/8)))
     goto err;
-  }
-
-  {
-    off_t j=0,k;
-    unsigned char *d = pcm->data;
-    float         *f = (float *)pcm->data;
-
-    while(j<pcm->size){
-      off_t bytes = (pcm->size-j > 65536 ? 65536 : pcm->size-j);
-      if(sb_verbose)
-        fprintf(stderr,"\rLoading %s: %ld to go...       ",pcm->name,(long)(pcm->size-j));
-      j+=bytes=fread(d+j,1,bytes,in);
-      if(bytes==0)break;
-    }
-    if(j<pcm->size){
-      if(sb_verbose)
-        fprintf(stderr,"\r%s: File ended before declared length (%ld < %ld); continuing...\n",path,(long)j,(long)pcm->size);
-      pcm->size=j;
-    }
 
-    /* non float must be expanded to float */
-    if(sb_verbose)
-      fprintf(stderr,"\rLoading %s: parsing...      ",pcm->name);
+  if((sb_mmap || huge) &&
+     !map_pcm(path,in,pcm,pcm->nativebits,0))
+    return pcm;
 
-    switch(pcm->nativebits){
-    case 8:
-      k=pcm->size;
-      for(j=pcm->size-1;j>=0;j--)
-        f[--k] = (int32_t)((d[j]-128)<<24) * (1.f/2147483648.f);
-      pcm->size=pcm->size*sizeof(float);
-      break;
-    case 16:
-      k=pcm->size/2;
-      for(j=pcm->size-2;j>=0;j-=2)
-        f[--k] = (int32_t)((d[j]<<16)|(d[j+1]<<24)) * (1.f/2147483648.f);
-      pcm->size=pcm->size/2*sizeof(float);
-      break;
-    case 24:
-      k=pcm->size/3;
-      for(j=pcm->size-3;j>=0;j-=3)
-        f[--k] = (int32_t)((d[j]<<8)|(d[j+1]<<16)|(d[j+2]<<24)) * (1.f/2147483648.f);
-      pcm->size=pcm->size/3*sizeof(float);
-      break;
-    case 32:
-      k=pcm->size/4;
-      for(j=pcm->size-4;j>=0;j-=4)
-        f[--k] = (int32_t)(d[j]|(d[j+1]<<8)|(d[j+2]<<16)|(d[j+3]<<24)) * (1.f/2147483648.f);
-      pcm->size=pcm->size/4*sizeof(float);
-      break;
-    case -32:
-      k=pcm->size/4;
-      for(j=pcm->size-4;j>=0;j-=4){
-        int val=0;
-        int mantissa = d[j] | (d[j+1]<<8) | ((d[j+2]&0x7f)<<16) | (1<<23);
-        int exponent = 127 - ((d[j+2]>>7) | ((d[j+3]&0x7f)<<1));
-        int sign = d[j+3]>>7;
-        if(exponent <= 0){
-          if(exponent == -128){
-            fprintf(stderr,"%s: Input file contains invalid floating point values.\n",pcm->name);
-            exit(6);
-          }
-          if(sign)
-            val = 8388608;
-          else
-            val = 8388607;
-        }else if(exponent <= 24){
-          val = mantissa>>exponent;
-          /* round with tiebreaks toward even */
-          if(((mantissa<<(24-exponent))&0xffffff) + (val&1) > 0x800000) ++val;
-        }
-        if(sign) val= -val;
-        f[--k] = val/8388608.;
-      }
-      pcm->size=pcm->size/4*sizeof(float);
-      break;
-    }
+  /* integer samples are expanded to float as they're read */
+  if(pcm->nativebits>0){
+    if(read_pcm(path,in,pcm,pcm->nativebits,0))
+      goto err;
+    if(load_verbose())
+      fprintf(stderr,"\rLoading %s: loaded.         ",pcm->name);
+    return pcm;
   }
 
-  if(sb_verbose)
+  if(read_float(path,in,pcm,pcm->nativebits,0))
+    goto err;
+  if(load_verbose())
     fprintf(stderr,"\rLoading %s: loaded.         ",pcm->name);
 
   return pcm;
@@ -427,17 +1941,17 @@ static pcm_t *wav_load(char *path, FILE *in){
 
 /* AIFF file support ***********************************************************/
 
-static int find_aiff_chunk(FILE *in, char *path, char *type, unsigned int *len){
+static int find_aiff_chunk(input_source *in, char *path, char *type, unsigned int *len){
   unsigned char buf[8];
   int restarted = 0;
 
   while(1){
-    if(fread(buf,1,8,in)<8){
+    if(in->read(in,buf,8)<8){
       if(!restarted) {
         /* Handle out of order chunks by seeking back to the start
          * to retry */
         restarted = 1;
-        fseek(in, 12, SEEK_SET);
+        in->seek(in,12,SEEK_SET);
         continue;
       }
       fprintf(stderr,"%s: Unexpected EOF in AIFF chunk\n",path);
@@ -450,7 +1964,7 @@ static int find_aiff_chunk(FILE *in, char *path, char *type, unsigned int *len){
       if((*len) & 0x1)
         (*len)++;
 
-      if(fseek(in,*len,SEEK_CUR))
+      if(in->seek(in,*len,SEEK_CUR))
         return 0;
     }else
       return 1;
@@ -484,7 +1998,7 @@ static double read_IEEE80(unsigned char *buf){
   return ldexp(f, e-16446);
 }
 
-static pcm_t *aiff_load(char *path, FILE *in){
+static pcm_t *aiff_load(char *path, input_source *in){
   pcm_t *pcm = NULL;
   int aifc; /* AIFC or AIFF? */
   unsigned int len;
@@ -492,12 +2006,13 @@ static pcm_t *aiff_load(char *path, FILE *in){
   unsigned char buf2[12];
   int bend = 1;
   int fp = 0;
+  int unsigned8 = 0;
 
-  if(fseek(in,0,SEEK_SET)==-1){
+  if(in->seek(in,0,SEEK_SET)==-1){
     fprintf(stderr,"%s: Failed to seek\n",path);
     goto err;
   }
-  if(fread(buf2,1,12,in)!=12){
+  if(in->read(in,buf2,12)!=12){
     fprintf(stderr,"%s: Failed to read AIFF header\n",path);
     goto err;
   }
@@ -522,7 +2037,7 @@ static pcm_t *aiff_load(char *path, FILE *in){
 
   buffer = alloca(len);
 
-  if(fread(buffer,1,len,in) < len){
+  if(in->read(in,buffer,len) < len){
     fprintf(stderr, "%s: Unexpected EOF in reading AIFF header\n",path);
     goto err;
   }
@@ -530,7 +2045,6 @@ static pcm_t *aiff_load(char *path, FILE *in){
   pcm->ch = READ_U16_BE(buffer);
   pcm->rate = (int)read_IEEE80(buffer+8);
   pcm->nativebits = READ_U16_BE(buffer+6);
-  pcm->size = READ_U32_BE(buffer+2)*pcm->ch*((pcm->nativebits+7)/8);
   pcm->currentbits = -32;
 
   switch(pcm->ch){
@@ -558,12 +2072,21 @@ static pcm_t *aiff_load(char *path, FILE *in){
       goto err;
     }
 
-    if(!memcmp(buffer+18, "NONE", 4) || !memcmp(buffer+18, "twos", 4)){
+    /* the sample size field of float files isn't always trusted
+       by the writer; the compression type says it all */
+    if(!memcmp(buffer+18, "NONE", 4) || !memcmp(buffer+18, "twos", 4) ||
+       !memcmp(buffer+18, "in24", 4) || !memcmp(buffer+18, "in32", 4)){
       bend = 1;
-    }else if(!memcmp(buffer+18, "sowt", 4)){
+    }else if(!memcmp(buffer+18, "sowt", 4) || !memcmp(buffer+18, "42ni", 4) ||
+             !memcmp(buffer+18, "23ni", 4)){
       bend = 0;
-    }else if(!memcmp(buffer+18, "fl32", 4)){
-      bend = 1;
+    }else if(!memcmp(buffer+18, "raw ", 4) && pcm->nativebits==8){
+      unsigned8 = 1;
+    }else if(!memcmp(buffer+18, "fl32", 4) || !memcmp(buffer+18, "FL32", 4)){
+      pcm->nativebits = 32;
+      fp = 1;
+    }else if(!memcmp(buffer+18, "fl64", 4) || !memcmp(buffer+18, "FL64", 4)){
+      pcm->nativebits = 64;
       fp = 1;
     }else{
       fprintf(stderr, "%s: Can't handle compressed AIFF-C (%c%c%c%c)\n", path,
@@ -571,6 +2094,12 @@ static pcm_t *aiff_load(char *path, FILE *in){
       goto err;
     }
   }
+  pcm->size = (off_t)READ_U32_BE(buffer+2)*pcm->ch*((pcm->nativebits+7)/8);
+
+  /* 8-bit samples are signed unless stored raw; that's what bend
+     means to the expanders at 8 bits */
+  if(pcm->nativebits==8)
+    bend = !unsigned8;
 
   if(!find_aiff_chunk(in, path, "SSND", &len)){
     fprintf(stderr, "%s: No SSND chunk found in AIFF file\n",path);
@@ -581,258 +2110,911 @@ static pcm_t *aiff_load(char *path, FILE *in){
     goto err;
   }
 
-  if(fread(buf2,1,8, in) < 8){
+  if(in->read(in,buf2,8) < 8){
     fprintf(stderr, "%s: Unexpected EOF reading AIFF header\n",path);
     goto err;
   }
 
-  int offset = READ_U32_BE(buf2);
+  off_t offset = (unsigned int)READ_U32_BE(buf2);
 
   if(!((fp==0 && (pcm->nativebits==32 ||
                   pcm->nativebits==24 ||
                   pcm->nativebits==16 ||
                   pcm->nativebits==8)) ||
-       (fp==1 && pcm->nativebits==32))){
+       (fp==1 && (pcm->nativebits==32 ||
+                  pcm->nativebits==64)))){
     fprintf(stderr,
             "%s: Unsupported type of AIFF/AIFC file\n"
-            " Must be 8-, 16-, 24- or 32-bit integer or 32-bit floating point PCM.\n",
+            " Must be 8-, 16-, 24- or 32-bit integer or 32- or 64-bit floating point PCM.\n",
             path);
     goto err;
   }
   if(fp==1)
     pcm->nativebits = -pcm->nativebits;
 
-  fseek(in, offset, SEEK_CUR); /* Swallow some data */
+  in->seek(in,offset,SEEK_CUR); /* Swallow some data */
 
-  /* read the samples into memory */
-  switch(pcm->nativebits){
-  case 8:
-    pcm->data = calloc(1,pcm->size*sizeof(float));
-    break;
-  case 16:
-    pcm->data = calloc(1,pcm->size/2*sizeof(float));
-    break;
-  case 24:
-    pcm->data = calloc(1,pcm->size/3*sizeof(float));
-    break;
-  case 32:
-  case -32:
-    pcm->data = calloc(1,pcm->size/4*sizeof(float));
-    break;
+  if(window_pcm(path,in,pcm,pcm->ch*(abs(pcm->nativebits)/8)))
+    goto err;
+
+  if(sb_mmap && !map_pcm(path,in,pcm,pcm->nativebits,bend))
+    return pcm;
+
+  /* integer samples are expanded to float as they're read */
+  if(!fp){
+    if(read_pcm(path,in,pcm,pcm->nativebits,bend))
+      goto err;
+  }else{
+    if(read_float(path,in,pcm,pcm->nativebits,bend))
+      goto err;
   }
 
-  if(pcm->data == NULL){
-    fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
+  if(load_verbose())
+    fprintf(stderr,"\rLoading %s: loaded.         ",pcm->name);
+
+  return pcm;
+ err:
+  free_pcm(pcm);
+  return NULL;
+
+}
+
+/* SW loading to make JM happy *******************************************************/
+
+static pcm_t *sw_load(char *path, input_source *in){
+  pcm_t *pcm = calloc(1,sizeof(pcm_t));
+  pcm->name=strdup(trim_path(path));
+  pcm->nativebits=16;
+  pcm->currentbits=-32;
+  pcm->ch=1;
+  pcm->rate=48000;
+  pcm->matrix=strdup("M");
+  pcm->mix=strdup("A");
+
+  if(in->seek(in,0,SEEK_END)==-1){
+    fprintf(stderr,"%s: Failed to seek\n",path);
+    goto err;
+  }
+  pcm->size=in->tell(in);
+  if(pcm->size==-1 || in->seek(in,0,SEEK_SET)==-1){
+    fprintf(stderr,"%s: Failed to seek\n",path);
     goto err;
   }
+  if(window_pcm(path,in,pcm,2))
+    goto err;
 
-  {
-    unsigned char *d = pcm->data;
-    float *f = (float *)pcm->data;
-    off_t j=0,k;
-    while(j<pcm->size){
-      off_t bytes = (pcm->size-j > 65536 ? 65536 : pcm->size-j);
-      if(sb_verbose)
-        fprintf(stderr,"\rLoading %s: %ld to go...       \r",pcm->name,(long)(pcm->size-j));
-      j+=bytes=fread(d+j,1,bytes,in);
-      if(bytes==0)break;
+  if(sb_mmap && !map_pcm(path,in,pcm,16,0))
+    return pcm;
+
+  if(read_pcm(path,in,pcm,16,0))
+    goto err;
+
+  if(load_verbose())
+    fprintf(stderr,"\rLoading %s: loaded.         ",pcm->name);
+
+  return pcm;
+ err:
+  free_pcm(pcm);
+  return NULL;
+}
+
+/* Streaming decode support **************************************************/
+
+/* Compressed inputs can stay open and be decoded on demand into a
+   small cache of fixed-size blocks instead of being decoded in their
+   entirety before playback.  Blocks are replaced least-recently-used;
+   the cursor and loop start of each file are touched every fragment
+   (see pcm_prefetch), so they stay resident while anything else
+   ages out.  The decoder only seeks when a block is wanted that
+   doesn't follow on from the last one decoded.
+
+   Once a stream is attached for playback, its decoder belongs to a
+   decode-ahead thread: prefetches queue blocks for it and return at
+   once, so the render path only waits on a block it needs right now
+   that hasn't arrived yet. */
+
+#define STREAM_BLOCK 8192 /* frames */
+#define STREAM_MINBLOCKS 8
+#define STREAM_QUEUE 16   /* blocks */
+
+typedef struct {
+  off_t index;          /* block number, -1 if empty */
+  unsigned long used;
+  long fill;            /* frames; < STREAM_BLOCK only at EOF */
+  float *data;
+} stream_block;
+
+typedef struct stream_source stream_source;
+struct stream_source {
+  char *name;
+  input_source *in;
+  void *dec;
+  int (*seek)(stream_source *s, off_t frame);
+  long (*decode)(stream_source *s, float *out, int frames);
+  void (*free)(stream_source *s);
+
+  int ch;
+  off_t frames;
+  off_t decpos;         /* decoder position; -1 if unknown */
+  int failed;
+
+  int nblocks;
+  stream_block *blocks;
+  unsigned long clock;
+
+  /* decode-ahead; everything above is under the mutex once the thread
+     runs, except the decoder itself, which only the thread touches */
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int threaded;
+  int exiting;
+  off_t urgent;               /* block playback is waiting on, or -1 */
+  off_t queue[STREAM_QUEUE];  /* blocks to decode ahead */
+  int queued;
+};
+
+static stream_block *stream_find(stream_source *s, off_t index){
+  int i;
+  for(i=0;i<s->nblocks;i++)
+    if(s->blocks[i].index==index){
+      s->blocks[i].used=++s->clock;
+      return s->blocks+i;
     }
-    if(j<pcm->size){
-      if(sb_verbose)
-        fprintf(stderr,"\r%s: File ended before declared length (%ld < %ld); continuing...\n",path,(long)j,(long)pcm->size);
-      pcm->size=j;
+  return NULL;
+}
+
+/* decode block 'index' over the least recently used one.  With the
+   decode-ahead thread running, only it gets here; the mutex is
+   dropped while decoding. */
+static stream_block *stream_decode_block(stream_source *s, off_t index){
+  stream_block *b = NULL;
+  long fill=0;
+  int i,failed=0;
+
+  for(i=0;i<s->nblocks;i++)
+    if(!b || s->blocks[i].used<b->used)
+      b=s->blocks+i;
+
+  if(!b->data){
+    b->data=malloc(STREAM_BLOCK*s->ch*sizeof(*b->data));
+    if(!b->data){
+      /* as for a decode error; it plays as silence from here on, and
+         pcm_failed says so */
+      fprintf(stderr,"\r%s: Unable to allocate streaming cache\n",s->name);
+      s->failed=1;
+      return NULL;
     }
+  }
+  b->index=-1;
+  b->fill=0;
+  if(s->threaded)pthread_mutex_unlock(&s->mutex);
+
+  if(s->decpos!=index*STREAM_BLOCK){
+    if(s->seek(s,index*STREAM_BLOCK)){
+      fprintf(stderr,"\r%s: Failed to seek for streaming decode\n",s->name);
+      failed=1;
+    }else
+      s->decpos=index*STREAM_BLOCK;
+  }
 
-    /* expand to float */
-    if(sb_verbose)
-      fprintf(stderr,"\rLoading %s: parsing...      ",pcm->name);
+  while(!failed && fill<STREAM_BLOCK){
+    long ret = s->decode(s,b->data+fill*s->ch,STREAM_BLOCK-fill);
+    if(ret<0){
+      fprintf(stderr,"\r%s: Error while decoding file\n",s->name);
+      s->decpos=-1;
+      failed=1;
+    }
+    if(ret<=0)break;
+    fill+=ret;
+  }
 
-    switch(pcm->nativebits){
-    case 8:
-      k=pcm->size;
-      for(j=pcm->size-1;j>=0;j--)
-        f[--k] = (int32_t)((d[j]-128)<<24) * (1.f/2147483648.f);
-      pcm->size=pcm->size*sizeof(float);
-      break;
-    case 16:
-      k=pcm->size/2;
-      if(bend){
-        for(j=pcm->size-2;j>=0;j-=2)
-          f[--k] = (int32_t)((d[j]<<24)|(d[j+1]<<16)) * (1.f/2147483648.f);
-      }else{
-        for(j=pcm->size-2;j>=0;j-=2)
-          f[--k] = (int32_t)((d[j]<<16)|(d[j+1]<<24)) * (1.f/2147483648.f);
-      }
-      pcm->size=pcm->size/2*sizeof(float);
-      break;
-    case 24:
-      k=pcm->size/3;
-      if(bend){
-        for(j=pcm->size-3;j>=0;j-=3)
-          f[--k] = (int32_t)(d[j+2]|(d[j+1]<<8)|(d[j]<<16)) * (1.f/2147483648.f);
-      }else{
-        for(j=pcm->size-3;j>=0;j-=3)
-          f[--k] = (int32_t)(d[j]|(d[j+1]<<8)|(d[j+2]<<16)) * (1.f/2147483648.f);
-      }
-      pcm->size=pcm->size/3*sizeof(float);
-      break;
-    case 32:
-      k=pcm->size/4;
-      if(bend){
-        for(j=pcm->size-4;j>=0;j-=4)
-          f[--k] = (int32_t)(d[j+3]|(d[j+2]<<8)|(d[j+1]<<16)|(d[j]<<24)) * (1.f/2147483648.f);
-      }else{
-        for(j=pcm->size-4;j>=0;j-=4)
-          f[--k] = (int32_t)(d[j]|(d[j+1]<<8)|(d[j+2]<<16)|(d[j+3]<<24)) * (1.f/2147483648.f);
-      }
-      pcm->size=pcm->size/4*sizeof(float);
-      break;
-    case -32:
-      k=pcm->size/4;
-      for(j=pcm->size-4;j>=0;j-=4){
-        int val=0;
-        int mantissa;
-        int exponent;
-        int sign;
-
-        if(bend){
-          mantissa = d[j+3] | (d[j+2]<<8) | ((d[j+1]&0x7f)<<16) | (1<<23);
-          exponent = 127 - ((d[j+1]>>7) | ((d[j]&0x7f)<<1));
-          sign = d[j]>>7;
-        }else{
-          mantissa = d[j] | (d[j+1]<<8) | ((d[j+2]&0x7f)<<16) | (1<<23);
-          exponent = 127 - ((d[j+2]>>7) | ((d[j+3]&0x7f)<<1));
-          sign = d[j+3]>>7;
-        }
+  if(s->threaded)pthread_mutex_lock(&s->mutex);
+  if(failed){
+    s->failed=1;
+    return NULL;
+  }
+  s->decpos+=fill;
+  b->fill=fill;
+  b->index=index;
+  b->used=++s->clock;
+  return b;
+}
 
-        if(exponent <= 0){
-          if(exponent == -128){
-            fprintf(stderr,"%s: Input file contains invalid floating point values.\n",pcm->name);
-            exit(6);
-          }
-          if(sign)
-            val = 8388608;
-          else
-            val = 8388607;
-        }else if(exponent <= 24){
-          val = mantissa>>exponent;
-          /* round with tiebreaks toward even */
-          if(((mantissa<<(24-exponent))&0xffffff) + (val&1) > 0x800000) ++val;
-        }
-        if(sign) val= -val;
-        f[--k] = val/8388608.;
-      }
-      pcm->size=pcm->size/4*sizeof(float);
-      break;
+/* the mutex is held if the decode-ahead thread runs */
+static stream_block *stream_get_block(stream_source *s, off_t index){
+  stream_block *b;
+  while(!(b=stream_find(s,index))){
+    if(s->failed || index*STREAM_BLOCK>=s->frames)
+      return NULL;
+    if(!s->threaded)
+      return stream_decode_block(s,index);
+    s->urgent=index;
+    pthread_cond_broadcast(&s->cond);
+    pthread_cond_wait(&s->cond,&s->mutex);
+  }
+  return b;
+}
+
+static void *stream_thread(void *arg){
+  stream_source *s = (stream_source *)arg;
+
+  pthread_mutex_lock(&s->mutex);
+  while(!s->exiting){
+    off_t index;
+    if(s->urgent>=0){
+      index=s->urgent;
+      s->urgent=-1;
+    }else if(s->queued>0){
+      index=s->queue[0];
+      s->queued--;
+      memmove(s->queue,s->queue+1,s->queued*sizeof(*s->queue));
+    }else{
+      pthread_cond_wait(&s->cond,&s->mutex);
+      continue;
     }
+    if(!s->failed && index*STREAM_BLOCK<s->frames && !stream_find(s,index))
+      stream_decode_block(s,index);
+    pthread_cond_broadcast(&s->cond);
   }
+  pthread_mutex_unlock(&s->mutex);
+  return NULL;
+}
 
-  if(sb_verbose)
-    fprintf(stderr,"\rLoading %s: loaded.         ",pcm->name);
+static long stream_read(void *source, off_t frame, int frames, float *out){
+  stream_source *s = (stream_source *)source;
+  long done=0;
+
+  if(s->threaded)pthread_mutex_lock(&s->mutex);
+  while(done<frames){
+    stream_block *b = stream_get_block(s,frame/STREAM_BLOCK);
+    long off = frame%STREAM_BLOCK;
+    long n;
+    if(!b || b->fill<=off)break;
+    n = b->fill-off;
+    if(n>frames-done)n=frames-done;
+    memcpy(out,b->data+off*s->ch,n*s->ch*sizeof(*out));
+    out+=n*s->ch;
+    frame+=n;
+    done+=n;
+  }
+  if(s->threaded)pthread_mutex_unlock(&s->mutex);
+  return done;
+}
 
-  return pcm;
- err:
-  free_pcm(pcm);
+/* queue a block for decode-ahead; when the queue is full, the oldest
+   request is the one least likely to still matter */
+static void stream_queue(stream_source *s, off_t index){
+  int i;
+  for(i=0;i<s->queued;i++)
+    if(s->queue[i]==index)return;
+  if(s->queued==STREAM_QUEUE){
+    s->queued--;
+    memmove(s->queue,s->queue+1,s->queued*sizeof(*s->queue));
+  }
+  s->queue[s->queued++]=index;
+}
+
+static void stream_prefetch(void *source, off_t frame, off_t frames){
+  stream_source *s = (stream_source *)source;
+  off_t i;
+  if(frame<0)frame=0;
+  if(!s->threaded){
+    for(i=frame/STREAM_BLOCK;i*STREAM_BLOCK<frame+frames;i++)
+      stream_get_block(s,i);
+    return;
+  }
+
+  pthread_mutex_lock(&s->mutex);
+  for(i=frame/STREAM_BLOCK;i*STREAM_BLOCK<frame+frames && i*STREAM_BLOCK<s->frames;i++)
+    if(!stream_find(s,i))
+      stream_queue(s,i);
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static void stream_close(void *source){
+  stream_source *s = (stream_source *)source;
+  int i;
+  if(s->threaded){
+    pthread_mutex_lock(&s->mutex);
+    s->exiting=1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    pthread_join(s->thread,NULL);
+  }
+  pthread_mutex_destroy(&s->mutex);
+  pthread_cond_destroy(&s->cond);
+  if(s->free)s->free(s);
+  if(s->in)s->in->close(s->in);
+  for(i=0;i<s->nblocks;i++)
+    if(s->blocks[i].data)free(s->blocks[i].data);
+  free(s->blocks);
+  free(s->name);
+  free(s);
+}
+
+/* The loader's input is closed once loading returns; a streaming
+   decoder needs its own. */
+static input_source *stream_reopen(char *path, input_source *in){
+  input_source *ret = in->reopen(in);
+  if(!ret)
+    fprintf(stderr,"%s: Unable to reopen for streaming: %s\n",path,strerror(errno));
+  return ret;
+}
+
+static stream_source *stream_new(pcm_t *pcm, input_source *in, off_t frames){
+  stream_source *s = calloc(1,sizeof(*s));
+  int i;
+  s->name=strdup(pcm->name);
+  s->in=in;
+  s->ch=pcm->ch;
+  s->frames=frames;
+  s->decpos=0;
+  s->urgent=-1;
+  pthread_mutex_init(&s->mutex,NULL);
+  pthread_cond_init(&s->cond,NULL);
+  s->nblocks=sb_stream_cache/(STREAM_BLOCK*pcm->ch*sizeof(float));
+  if(s->nblocks<STREAM_MINBLOCKS)s->nblocks=STREAM_MINBLOCKS;
+  s->blocks=calloc(s->nblocks,sizeof(*s->blocks));
+  for(i=0;i<s->nblocks;i++)
+    s->blocks[i].index=-1;
+  return s;
+}
+
+static void stream_attach(pcm_t *pcm, stream_source *s){
+  pcm->lazy = calloc(1,sizeof(*pcm->lazy));
+  pcm->lazy->source = s;
+  pcm->lazy->read = stream_read;
+  pcm->lazy->prefetch = stream_prefetch;
+  pcm->lazy->close = stream_close;
+  pcm->lazy->ch = pcm->ch;
+  pcm->lazy->gain = 1.f;
+  pcm->lazy->origin = pcm->origin;
+  /* without the thread, blocks are decoded as they're asked for */
+  s->threaded = !pthread_create(&s->thread,NULL,stream_thread,s);
+}
+
+/* Parallel decode support ****************************************************/
+
+/* Long compressed files can be decoded in segments on several
+   threads, each with its own file handle and decoder (a
+   stream_source, for its seek/decode hooks) writing straight into
+   its part of pcm->data.  A segment's decoder seeks 'preroll' frames
+   early and throws that much away, so that the decoder state the
+   codec carries across packets is in place by the segment start; the
+   caller derives it from the codec.  Each thread but the last also
+   decodes a little past its end; if that doesn't exactly match what
+   the next thread produced, the seams aren't trustworthy and the
+   caller decodes serially. */
+
+#define PARALLEL_SEGMENT_MIN (1<<20) /* frames */
+#define PARALLEL_CHECK 4096          /* frames */
+
+typedef struct {
+  input_source *in;  /* this segment's own, until the decoder takes it */
+  pcm_t *pcm;
+  stream_source *(*open)(input_source *in, pcm_t *pcm);
+  off_t preroll;
+  off_t origin;  /* file position of pcm->data[0] */
+  off_t start;
+  off_t end;
+  float *check;  /* PARALLEL_CHECK frames past 'end' */
+  long checked;
+  int failed;
+} parallel_segment;
+
+static long parallel_read(stream_source *s, float *out, off_t frames){
+  long got=0;
+  while(got<frames){
+    long n = (frames-got>STREAM_BLOCK ? STREAM_BLOCK : frames-got);
+    long ret = s->decode(s,out+got*s->ch,n);
+    if(ret<=0)break;
+    got+=ret;
+  }
+  return got;
+}
+
+static void *parallel_thread(void *arg){
+  parallel_segment *seg = (parallel_segment *)arg;
+  pcm_t *pcm = seg->pcm;
+  stream_source *s = seg->open(seg->in,pcm);
+  off_t at = seg->origin+seg->start;
+  off_t from = at-seg->preroll;
+  float *d = (float *)pcm->data;
+
+  seg->in=NULL;
+  if(!s){
+    seg->failed=1;
+    return NULL;
+  }
+  if(from<0)from=0;
+  if(from>0 && s->seek(s,from))
+    seg->failed=1;
+
+  /* pre-roll is decoded and discarded; the scratch block is on the
+     heap, as at 255 channels it'd be most of a thread's stack */
+  if(!seg->failed && from<at){
+    float *buf = malloc(STREAM_BLOCK*s->ch*sizeof(*buf));
+    if(!buf)seg->failed=1;
+    while(!seg->failed && from<at){
+      long n = (at-from>STREAM_BLOCK ? STREAM_BLOCK : at-from);
+      if(parallel_read(s,buf,n)<n)
+        seg->failed=1;
+      from+=n;
+    }
+    free(buf);
+  }
+
+  if(!seg->failed &&
+     parallel_read(s,d+seg->start*s->ch,seg->end-seg->start)<seg->end-seg->start)
+    seg->failed=1;
+
+  if(!seg->failed && seg->check)
+    seg->checked=parallel_read(s,seg->check,PARALLEL_CHECK);
+
+  stream_close(s);
   return NULL;
+}
+
+/* Decode the 'frames' frames of an unchained file starting at
+   'origin' into pcm->data.  Returns nonzero if it wasn't attempted or
+   didn't work out, in which case the caller's own decode is still
+   wanted. */
+static int parallel_decode(char *path, input_source *in, pcm_t *pcm, off_t origin, off_t frames,
+                           stream_source *(*open)(input_source *in, pcm_t *pcm),
+                           off_t preroll){
+  int n = sb_decode_threads;
+  parallel_segment seg[n];
+  pthread_t threads[n];
+  int started[n];
+  int i,failed=0,seams=0;
+
+  if(frames/PARALLEL_SEGMENT_MIN<n)
+    n=frames/PARALLEL_SEGMENT_MIN;
+  if(n<2)
+    return 1;
+
+  if(load_verbose())
+    fprintf(stderr,"\rLoading %s: decoding on %d threads...",pcm->name,n);
+
+  memset(seg,0,sizeof(seg));
+  for(i=0;i<n;i++){
+    seg[i].in=in->reopen(in);
+    seg[i].pcm=pcm;
+    seg[i].open=open;
+    seg[i].preroll=preroll;
+    seg[i].origin=origin;
+    seg[i].start=frames*i/n;
+    seg[i].end=frames*(i+1)/n;
+    if(!seg[i].in)failed=1;
+    if(i<n-1){
+      seg[i].check=malloc(PARALLEL_CHECK*pcm->ch*sizeof(float));
+      if(!seg[i].check)failed=1;
+    }
+  }
+
+  /* the calling thread takes the first segment */
+  for(i=1;i<n && !failed;i++){
+    started[i] = !pthread_create(threads+i,NULL,parallel_thread,seg+i);
+    if(!started[i])seg[i].failed=1;
+  }
+  if(!failed){
+    parallel_thread(seg);
+    for(i=1;i<n;i++)
+      if(started[i])pthread_join(threads[i],NULL);
+  }
+
+  for(i=0;i<n;i++){
+    if(seg[i].in)seg[i].in->close(seg[i].in);
+    if(seg[i].failed)failed=1;
+    if(seg[i].check){
+      float *d = (float *)pcm->data+seg[i].end*pcm->ch;
+      long c = seg[i].checked;
+      if(c>frames-seg[i].end)c=frames-seg[i].end;
+      if(!failed && (c<=0 || memcmp(seg[i].check,d,c*pcm->ch*sizeof(float))))
+        failed=seams=1;
+      free(seg[i].check);
+    }
+  }
+
+  if(failed && sb_verbose)
+    fprintf(stderr,"\r%s: Parallel decode %s; decoding serially.\n",path,
+            seams ? "seams didn't match" : "failed");
+  return failed;
+}
+
+/* Planar to interleaved conversion ******************************************/
+
+/* libFLAC and libvorbis hand over decoded audio as one array per
+   channel.  FLAC's integer samples are shifted to the top of an int32
+   and scaled by 2^-31, as the uncompressed expanders do, while being
+   interleaved; Vorbis floats are only interleaved.  The SIMD kernels
+   transpose four frames at a time for the common channel counts
+   (1, 2, 6 and 8); others fall back to the scalar loop. */
+
+typedef void (*flac_interleave)(float *out, const FLAC__int32 *const in[],
+                                int ch, long n, int shift);
+typedef void (*float_interleave)(float *out, float *const *in, int ch, long n);
+
+static void interleave_tail(float *out, const FLAC__int32 *const in[],
+                            int ch, long j, long n, int shift){
+  int i;
+  for(out+=j*ch;j<n;j++)
+    for(i=0;i<ch;i++)
+      *out++ = (in[i][j]<<shift)*(1.f/2147483648.f);
+}
+
+static void interleave_c(float *out, const FLAC__int32 *const in[],
+                         int ch, long n, int shift){
+  interleave_tail(out,in,ch,0,n,shift);
+}
+
+static void interleave_float_tail(float *out, float *const *in, int ch, long j, long n){
+  int i;
+  for(out+=j*ch;j<n;j++)
+    for(i=0;i<ch;i++)
+      *out++ = in[i][j];
+}
+
+static void interleave_float_c(float *out, float *const *in, int ch, long n){
+  interleave_float_tail(out,in,ch,0,n);
+}
+
+static int interleave_simd(int ch){
+  return ch==1 || ch==2 || ch==6 || ch==8;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+/* v holds four frames of each channel */
+__attribute__((target("sse2")))
+static inline void interleave4_sse2(float *o, __m128 *v, int ch){
+  int i;
+  switch(ch){
+  case 1:
+    _mm_storeu_ps(o,v[0]);
+    break;
+  case 2:
+    _mm_storeu_ps(o,  _mm_unpacklo_ps(v[0],v[1]));
+    _mm_storeu_ps(o+4,_mm_unpackhi_ps(v[0],v[1]));
+    break;
+  case 6:
+    {
+      __m128 lo = _mm_unpacklo_ps(v[4],v[5]);
+      __m128 hi = _mm_unpackhi_ps(v[4],v[5]);
+      _MM_TRANSPOSE4_PS(v[0],v[1],v[2],v[3]);
+      _mm_storeu_ps(o,   v[0]); _mm_storel_pi((__m64 *)(o+4), lo);
+      _mm_storeu_ps(o+6, v[1]); _mm_storeh_pi((__m64 *)(o+10),lo);
+      _mm_storeu_ps(o+12,v[2]); _mm_storel_pi((__m64 *)(o+16),hi);
+      _mm_storeu_ps(o+18,v[3]); _mm_storeh_pi((__m64 *)(o+22),hi);
+    }
+    break;
+  case 8:
+    _MM_TRANSPOSE4_PS(v[0],v[1],v[2],v[3]);
+    _MM_TRANSPOSE4_PS(v[4],v[5],v[6],v[7]);
+    for(i=0;i<4;i++){
+      _mm_storeu_ps(o+i*8,  v[i]);
+      _mm_storeu_ps(o+i*8+4,v[i+4]);
+    }
+    break;
+  }
+}
+
+__attribute__((target("sse2")))
+static void interleave_sse2(float *out, const FLAC__int32 *const in[],
+                            int ch, long n, int shift){
+  const __m128i count = _mm_cvtsi32_si128(shift);
+  const __m128 scale = _mm_set1_ps(1.f/2147483648.f);
+  __m128 v[8];
+  long j=0;
+  int i;
+
+  if(interleave_simd(ch))
+    for(;j+4<=n;j+=4){
+      for(i=0;i<ch;i++)
+        v[i] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_sll_epi32
+                                          (_mm_loadu_si128((const __m128i *)(in[i]+j)),count)),scale);
+      interleave4_sse2(out+j*ch,v,ch);
+    }
+  interleave_tail(out,in,ch,j,n,shift);
+}
+
+__attribute__((target("sse2")))
+static void interleave_float_sse2(float *out, float *const *in, int ch, long n){
+  __m128 v[8];
+  long j=0;
+  int i;
 
+  if(interleave_simd(ch))
+    for(;j+4<=n;j+=4){
+      for(i=0;i<ch;i++)
+        v[i] = _mm_loadu_ps(in[i]+j);
+      interleave4_sse2(out+j*ch,v,ch);
+    }
+  interleave_float_tail(out,in,ch,j,n);
 }
 
-/* SW loading to make JM happy *******************************************************/
+static flac_interleave interleave_pick(void){
+  __builtin_cpu_init();
+  return (__builtin_cpu_supports("sse2") ? interleave_sse2 : interleave_c);
+}
 
-static pcm_t *sw_load(char *path, FILE *in){
-  pcm_t *pcm = calloc(1,sizeof(pcm_t));
-  pcm->name=strdup(trim_path(path));
-  pcm->nativebits=16;
-  pcm->currentbits=-32;
-  pcm->ch=1;
-  pcm->rate=48000;
-  pcm->matrix=strdup("M");
-  pcm->mix=strdup("A");
+static float_interleave interleave_float_pick(void){
+  __builtin_cpu_init();
+  return (__builtin_cpu_supports("sse2") ? interleave_float_sse2 : interleave_float_c);
+}
 
-  if(fseek(in,0,SEEK_END)==-1){
-    fprintf(stderr,"%s: Failed to seek\n",path);
-    goto err;
-  }
-  pcm->size=ftell(in);
-  if(pcm->size==-1 || fseek(in,0,SEEK_SET)==-1){
-    fprintf(stderr,"%s: Failed to seek\n",path);
-    goto err;
-  }
+#elif defined(__GNUC__) && defined(__aarch64__)
 
-  pcm->data = calloc(1,pcm->size/2*sizeof(float));
+static void transpose4_neon(float32x4_t *v){
+  float32x4_t a = vzip1q_f32(v[0],v[1]), b = vzip2q_f32(v[0],v[1]);
+  float32x4_t c = vzip1q_f32(v[2],v[3]), d = vzip2q_f32(v[2],v[3]);
+  v[0] = vreinterpretq_f32_f64(vzip1q_f64(vreinterpretq_f64_f32(a),vreinterpretq_f64_f32(c)));
+  v[1] = vreinterpretq_f32_f64(vzip2q_f64(vreinterpretq_f64_f32(a),vreinterpretq_f64_f32(c)));
+  v[2] = vreinterpretq_f32_f64(vzip1q_f64(vreinterpretq_f64_f32(b),vreinterpretq_f64_f32(d)));
+  v[3] = vreinterpretq_f32_f64(vzip2q_f64(vreinterpretq_f64_f32(b),vreinterpretq_f64_f32(d)));
+}
 
-  if(pcm->data == NULL){
-    fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
-    goto err;
+/* v holds four frames of each channel */
+static inline void interleave4_neon(float *o, float32x4_t *v, int ch){
+  int i;
+  switch(ch){
+  case 1:
+    vst1q_f32(o,v[0]);
+    break;
+  case 2:
+    {
+      float32x4x2_t p = {{v[0],v[1]}};
+      vst2q_f32(o,p);
+    }
+    break;
+  case 6:
+    {
+      float32x4_t lo = vzip1q_f32(v[4],v[5]);
+      float32x4_t hi = vzip2q_f32(v[4],v[5]);
+      transpose4_neon(v);
+      vst1q_f32(o,   v[0]); vst1_f32(o+4, vget_low_f32(lo));
+      vst1q_f32(o+6, v[1]); vst1_f32(o+10,vget_high_f32(lo));
+      vst1q_f32(o+12,v[2]); vst1_f32(o+16,vget_low_f32(hi));
+      vst1q_f32(o+18,v[3]); vst1_f32(o+22,vget_high_f32(hi));
+    }
+    break;
+  case 8:
+    transpose4_neon(v);
+    transpose4_neon(v+4);
+    for(i=0;i<4;i++){
+      vst1q_f32(o+i*8,  v[i]);
+      vst1q_f32(o+i*8+4,v[i+4]);
+    }
+    break;
   }
+}
 
-  {
-    off_t j=0;
-    int16_t *d = (int16_t *)pcm->data;
-    float   *f = (float *)pcm->data;
+static void interleave_neon(float *out, const FLAC__int32 *const in[],
+                            int ch, long n, int shift){
+  const int32x4_t count = vdupq_n_s32(shift);
+  float32x4_t v[8];
+  long j=0;
+  int i;
 
-    while(j<pcm->size){
-      off_t bytes = (pcm->size-j > 65536 ? 65536 : pcm->size-j);
-      if(sb_verbose)
-        fprintf(stderr,"\rLoading %s: %ld to go...       ",pcm->name,(long)(pcm->size-j));
-      j+=bytes=fread(pcm->data+j,1,bytes,in);
-      if(bytes==0)break;
+  if(interleave_simd(ch))
+    for(;j+4<=n;j+=4){
+      for(i=0;i<ch;i++)
+        v[i] = vcvtq_n_f32_s32(vshlq_s32(vld1q_s32(in[i]+j),count),31);
+      interleave4_neon(out+j*ch,v,ch);
     }
-    if(j<pcm->size){
-      if(sb_verbose)
-        fprintf(stderr,"\r%s: File ended before declared length (%ld < %ld); continuing...\n",path,(long)j,(long)pcm->size);
-      pcm->size=j;
+  interleave_tail(out,in,ch,j,n,shift);
+}
+
+static void interleave_float_neon(float *out, float *const *in, int ch, long n){
+  float32x4_t v[8];
+  long j=0;
+  int i;
+
+  if(interleave_simd(ch))
+    for(;j+4<=n;j+=4){
+      for(i=0;i<ch;i++)
+        v[i] = vld1q_f32(in[i]+j);
+      interleave4_neon(out+j*ch,v,ch);
     }
+  interleave_float_tail(out,in,ch,j,n);
+}
 
-    if(sb_verbose)
-      fprintf(stderr,"\rLoading %s: parsing...      ",pcm->name);
+static flac_interleave interleave_pick(void){
+  return interleave_neon;
+}
 
-    for(j=pcm->size/2-1;j>=0;j--)
-      f[j] = d[j]/32768.;
+static float_interleave interleave_float_pick(void){
+  return interleave_float_neon;
+}
 
-    pcm->size=pcm->size/2*sizeof(float);
-  }
+#else
 
-  if(sb_verbose)
-    fprintf(stderr,"\rLoading %s: loaded.         ",pcm->name);
+static flac_interleave interleave_pick(void){
+  return interleave_c;
+}
 
-  return pcm;
- err:
-  free_pcm(pcm);
-  return NULL;
+static float_interleave interleave_float_pick(void){
+  return interleave_float_c;
 }
 
+#endif
+
 /* FLAC and OggFLAC load support *****************************************************************/
 
 typedef struct {
-  FILE *in;
+  input_source *in;
   pcm_t *pcm;
   off_t fill;
+  flac_interleave interleave;
+
+  /* from STREAMINFO/SEEKTABLE */
+  int channels;
+  int bits;
+  int seekpoints;
+  int bps;
+  int md5;       /* the stream carries an MD5 signature */
+  unsigned char md5sum[16];
+
+  /* MD5 check: the samples as the signature covers them (see
+     flac_verify), or NULL where the -k buffer already is that */
+  int check;
+  unsigned char *md5buf;
+
+  /* parallel decode: this thread's segment, in samples */
+  int segment;
+  int oggp;
+  off_t origin;  /* first frame decoded, for -s/-e */
+  off_t seg_end;
+  int failed;
+
+  /* streaming: decoded frames waiting to be handed to the cache */
+  FLAC__StreamDecoder *decoder;
+  stream_source *stream;
+  float *pend;
+  long pend_size;
+  long pend_fill;
+  long pend_pos;
 } flac_callback_arg;
 
-/* glorified fread wrapper */
+/* glorified read wrapper */
 static FLAC__StreamDecoderReadStatus read_callback(const FLAC__StreamDecoder *decoder,
                                             FLAC__byte buffer[],
                                             size_t *bytes,
                                             void *client_data){
   flac_callback_arg *flac = (flac_callback_arg *)client_data;
   pcm_t *pcm = flac->pcm;
+  long ret;
 
-  if(feof(flac->in)){
+  if(flac->in->eof){
     *bytes = 0;
     return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
-  }else if(ferror(flac->in)){
-    *bytes = 0;
-    return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
   }
 
-  if(sb_verbose)
+  if(load_verbose() && !flac->stream && !flac->seg_end)
     fprintf(stderr,"\rLoading %s: %ld to go...       ",flac->pcm->name,(long)(pcm->size-flac->fill));
-  *bytes = fread(buffer, sizeof(FLAC__byte), *bytes, flac->in);
+  ret = flac->in->read(flac->in,buffer,*bytes);
+  if(ret<0){
+    *bytes = 0;
+    return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+  }
+  *bytes = ret;
 
   return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
 }
 
+static FLAC__StreamDecoderSeekStatus seek_callback(const FLAC__StreamDecoder *decoder,
+                                                   FLAC__uint64 offset,
+                                                   void *client_data){
+  flac_callback_arg *flac = (flac_callback_arg *)client_data;
+  if(flac->in->seek(flac->in,offset,SEEK_SET))
+    return FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+  return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+}
+
+static FLAC__StreamDecoderTellStatus tell_callback(const FLAC__StreamDecoder *decoder,
+                                                   FLAC__uint64 *offset,
+                                                   void *client_data){
+  flac_callback_arg *flac = (flac_callback_arg *)client_data;
+  off_t pos = flac->in->tell(flac->in);
+  if(pos<0)
+    return FLAC__STREAM_DECODER_TELL_STATUS_ERROR;
+  *offset = pos;
+  return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+static FLAC__StreamDecoderLengthStatus length_callback(const FLAC__StreamDecoder *decoder,
+                                                       FLAC__uint64 *length,
+                                                       void *client_data){
+  flac_callback_arg *flac = (flac_callback_arg *)client_data;
+  off_t len = flac->in->length(flac->in);
+  if(len<0)
+    return FLAC__STREAM_DECODER_LENGTH_STATUS_UNSUPPORTED;
+  *length = len;
+  return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+}
+
+/* FLAC channel assignments are fixed by the channel count */
+static void flac_channel_map(pcm_t *pcm){
+  switch(pcm->ch){
+  case 1:
+    pcm->matrix = strdup("M");
+    pcm->mix = strdup("A");
+    break;
+  case 2:
+    pcm->matrix = strdup("L,R");
+    pcm->mix = strdup("BC");
+    break;
+  case 3:
+    pcm->matrix = strdup("L,R,C");
+    pcm->mix = strdup("BCD");
+    break;
+  case 4:
+    pcm->matrix = strdup("L,R,BL,BR");
+    pcm->mix = strdup("BCFG");
+    break;
+  case 5:
+    pcm->matrix = strdup("L,R,C,BL,BR");
+    pcm->mix = strdup("BCDFG");
+    break;
+  case 6:
+    pcm->matrix = strdup("L,R,C,LFE,BL,BR");
+    pcm->mix = strdup("BCDEFG");
+    break;
+  case 7:
+    pcm->matrix = strdup("L,R,C,LFE,BC,SL,SR");
+    pcm->mix = strdup("BCDEJKL");
+    break;
+  default:
+    pcm->matrix = strdup("L,R,C,LFE,BL,BR,SL,SR");
+    pcm->mix = strdup("BCDEFGKL");
+    break;
+  }
+}
+
+/* pcm->size holds the length in frames until the buffer exists */
+static void flac_alloc(pcm_t *pcm, int channels, int bits_per_sample){
+  pcm->ch = channels;
+  if(!pcm->matrix)
+    flac_channel_map(pcm);
+  pcm->nativebits = (bits_per_sample+7)/8*8;
+  pcm->currentbits = -32;
+  if(sb_native){
+    /* kept as little-endian integers at native width */
+    pcm->data = calloc(pcm->size*channels,pcm->nativebits/8);
+    pcm->size *= channels*sizeof(float);
+  }else{
+    pcm->size *= channels*sizeof(float);
+    pcm->data = calloc(pcm->size,1);
+  }
+}
+
+/* the MD5 signature covers each sample little-endian in the fewest
+   whole bytes that hold it */
+static void flac_md5_alloc(flac_callback_arg *flac){
+  pcm_t *pcm = flac->pcm;
+  if(!flac->check || !pcm->data || (sb_native && flac->bps==pcm->nativebits))
+    return;
+  flac->md5buf = malloc(pcm->size/sizeof(float)*(pcm->nativebits/8));
+  if(!flac->md5buf){
+    if(sb_verbose)
+      fprintf(stderr,"\r%s: Not enough memory to check the MD5 signature.\n",pcm->name);
+    flac->check=0;
+  }
+}
+
+static void flac_md5_write(unsigned char *d, const FLAC__int32 *const buffer[],
+                           int channels, int samples, int B){
+  int i,j,k;
+  for (j = 0; j < samples; j++)
+    for (i = 0; i < channels; i++){
+      int v = buffer[i][j];
+      for (k = 0; k < B; k++)
+        *d++ = v>>(k*8);
+    }
+}
+
 static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *decoder,
                                               const FLAC__Frame *frame,
                                               const FLAC__int32 *const buffer[],
@@ -845,13 +3027,29 @@ static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *
   off_t fill = flac->fill;
   int i, j;
 
+  if(flac->stream){
+    /* streaming; park the frame for flac_stream_decode */
+    if(channels != flac->channels || (bits_per_sample+7)/8*8 != flac->bits){
+      fprintf(stderr,"\r%s: stream format changes part way through file\n",pcm->name);
+      return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+    if(samples*channels>flac->pend_size){
+      free(flac->pend);
+      flac->pend_size=samples*channels;
+      flac->pend=malloc(flac->pend_size*sizeof(*flac->pend));
+      if(!flac->pend)
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+    flac->interleave(flac->pend,buffer,channels,samples,32-bits_per_sample);
+    flac->pend_fill=samples;
+    flac->pend_pos=0;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+  }
+
   if(pcm->data == NULL){
     /* lazy initialization */
-    pcm->ch = channels;
-    pcm->nativebits = (bits_per_sample+7)/8*8;
-    pcm->size *= channels*sizeof(float);
-    pcm->currentbits = -32;
-    pcm->data = calloc(pcm->size,1);
+    flac_alloc(pcm,channels,bits_per_sample);
+    flac_md5_alloc(flac);
   }
 
   if(channels != pcm->ch){
@@ -863,29 +3061,75 @@ static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *
     return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
   }
 
-  if(sb_verbose)
+  if(flac->seg_end){
+    /* stop at the start of the next thread's segment */
+    if(fill>=flac->seg_end)
+      return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    if(fill+samples*channels>flac->seg_end)
+      samples=(flac->seg_end-fill)/channels;
+  }else if(load_verbose())
     fprintf(stderr,"\rLoading %s: parsing...      ",pcm->name);
 
-  {
-    float *d = (float *)pcm->data;
+  if(flac->md5buf && fill+samples*channels<=(off_t)(pcm->size/sizeof(float)))
+    flac_md5_write(flac->md5buf+fill*(pcm->nativebits/8),buffer,channels,samples,
+                   pcm->nativebits/8);
+
+  if(sb_native){
+    unsigned char *d = pcm->data;
     int shift = pcm->nativebits - bits_per_sample;
     switch(pcm->nativebits){
     case 16:
+      d += fill*2;
       for (j = 0; j < samples; j++)
-        for (i = 0; i < channels; i++)
-          d[fill++] = (buffer[i][j]<<shift)*(1.f/32768.f);
+        for (i = 0; i < channels; i++){
+          int v = buffer[i][j]<<shift;
+          *d++ = v;
+          *d++ = v>>8;
+        }
       break;
     case 24:
+      d += fill*3;
+      for (j = 0; j < samples; j++)
+        for (i = 0; i < channels; i++){
+          int v = buffer[i][j]<<shift;
+          *d++ = v;
+          *d++ = v>>8;
+          *d++ = v>>16;
+        }
+      break;
+    case 32:
+      d += fill*4;
       for (j = 0; j < samples; j++)
-        for (i = 0; i < channels; i++)
-          d[fill++] = (buffer[i][j]<<shift)*(1.f/8388608.f);
+        for (i = 0; i < channels; i++){
+          int v = buffer[i][j];
+          *d++ = v;
+          *d++ = v>>8;
+          *d++ = v>>16;
+          *d++ = v>>24;
+        }
+      break;
+    default:
+      fprintf(stderr,"\r%s: Only 16-, 24- and 32-bit FLACs are supported for decode right now.\n",pcm->name);
+      return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+    fill += samples*channels;
+  }else{
+    switch(pcm->nativebits){
+    case 16:
+    case 24:
+    case 32:
+      flac->interleave((float *)pcm->data+fill,buffer,channels,samples,32-bits_per_sample);
+      fill += samples*channels;
       break;
     default:
-      fprintf(stderr,"\r%s: Only 16- and 24-bit FLACs are supported for decode right now.\n",pcm->name);
+      fprintf(stderr,"\r%s: Only 16-, 24- and 32-bit FLACs are supported for decode right now.\n",pcm->name);
       return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
     }
   }
   flac->fill=fill;
+  /* serial decodes fill from the front */
+  if(!flac->segment)
+    load_progress(pcm,fill,pcm->size/sizeof(float));
 
   return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
@@ -900,6 +3144,17 @@ static void metadata_callback(const FLAC__StreamDecoder *decoder,
   case FLAC__METADATA_TYPE_STREAMINFO:
     pcm->size = metadata->data.stream_info.total_samples; /* temp setting */
     pcm->rate = metadata->data.stream_info.sample_rate;
+    flac->channels = metadata->data.stream_info.channels;
+    flac->bps = metadata->data.stream_info.bits_per_sample;
+    flac->bits = (flac->bps+7)/8*8;
+    {
+      static const FLAC__byte none[16];
+      flac->md5 = memcmp(metadata->data.stream_info.md5sum,none,16)!=0;
+      memcpy(flac->md5sum,metadata->data.stream_info.md5sum,16);
+    }
+    break;
+  case FLAC__METADATA_TYPE_SEEKTABLE:
+    flac->seekpoints = metadata->data.seek_table.num_points;
     break;
   default:
     break;
@@ -910,44 +3165,459 @@ static void error_callback(const FLAC__StreamDecoder *decoder,
                     FLAC__StreamDecoderErrorStatus status,
                     void *client_data){
 
-  flac_callback_arg *flac = (flac_callback_arg *)client_data;
-  pcm_t *pcm = flac->pcm;
-  fprintf(stderr,"\r%s: Error decoding file.\n",pcm->name);
+  flac_callback_arg *flac = (flac_callback_arg *)client_data;
+  pcm_t *pcm = flac->pcm;
+  fprintf(stderr,"\r%s: Error decoding file.\n",pcm->name);
+}
+
+static FLAC__bool eof_callback(const FLAC__StreamDecoder *decoder,
+                        void *client_data){
+  flac_callback_arg *flac = (flac_callback_arg *)client_data;
+  return flac->in->eof ? true : false;
+}
+
+/* Random access goes through FLAC__stream_decoder_seek_absolute,
+   which uses the SEEKTABLE when there is one and otherwise bisects
+   the file using the length callback; either way only the frames
+   around the target are decoded.  The write callback delivers the
+   frame containing the target sample already trimmed to start at
+   it. */
+static int flac_stream_seek(stream_source *s, off_t frame){
+  flac_callback_arg *flac = (flac_callback_arg *)s->dec;
+  flac->pend_fill=flac->pend_pos=0;
+  if(!FLAC__stream_decoder_seek_absolute(flac->decoder,frame)){
+    if(FLAC__stream_decoder_get_state(flac->decoder)==FLAC__STREAM_DECODER_SEEK_ERROR)
+      FLAC__stream_decoder_flush(flac->decoder);
+    return -1;
+  }
+  return 0;
+}
+
+static long flac_stream_decode(stream_source *s, float *out, int frames){
+  flac_callback_arg *flac = (flac_callback_arg *)s->dec;
+  long got=0;
+  while(got<frames){
+    if(flac->pend_pos<flac->pend_fill){
+      long n = flac->pend_fill-flac->pend_pos;
+      if(n>frames-got)n=frames-got;
+      memcpy(out,flac->pend+flac->pend_pos*s->ch,n*s->ch*sizeof(*out));
+      flac->pend_pos+=n;
+      out+=n*s->ch;
+      got+=n;
+      continue;
+    }
+    flac->pend_fill=flac->pend_pos=0;
+    if(FLAC__stream_decoder_get_state(flac->decoder)==FLAC__STREAM_DECODER_END_OF_STREAM)
+      break;
+    if(!FLAC__stream_decoder_process_single(flac->decoder))
+      return got ? got : -1;
+  }
+  return got;
+}
+
+static void flac_stream_free(stream_source *s){
+  flac_callback_arg *flac = (flac_callback_arg *)s->dec;
+  FLAC__stream_decoder_finish(flac->decoder);
+  FLAC__stream_decoder_delete(flac->decoder);
+  free(flac->pend);
+  free(flac);
+}
+
+/* Long files are split into one segment per thread.  Each thread
+   has its own handle on the input and a decoder of its own, seeks (by SEEKTABLE, or
+   by bisection when there is none) to the first sample of its
+   segment and decodes straight into its part of the shared buffer,
+   and of the MD5 check's copy; see flac_verify below. */
+
+#define FLAC_SEGMENT_MIN (1<<20) /* frames */
+
+static void *flac_segment_thread(void *arg){
+  flac_callback_arg *flac = (flac_callback_arg *)arg;
+  pcm_t *pcm = flac->pcm;
+  FLAC__StreamDecoder *decoder;
+  int ret;
+
+  if(!flac->in){
+    flac->failed=1;
+    return NULL;
+  }
+  decoder = FLAC__stream_decoder_new();
+  FLAC__stream_decoder_set_md5_checking(decoder, false);
+  /* leave the shared pcm's header fields alone */
+  FLAC__stream_decoder_set_metadata_ignore(decoder, FLAC__METADATA_TYPE_STREAMINFO);
+  if(flac->oggp)
+    ret=FLAC__stream_decoder_init_ogg_stream(decoder,read_callback,seek_callback,
+                                             tell_callback,length_callback,eof_callback,
+                                             write_callback,metadata_callback,
+                                             error_callback,flac);
+  else
+    ret=FLAC__stream_decoder_init_stream(decoder,read_callback,seek_callback,
+                                         tell_callback,length_callback,eof_callback,
+                                         write_callback,metadata_callback,
+                                         error_callback,flac);
+
+  if(ret!=FLAC__STREAM_DECODER_INIT_STATUS_OK ||
+     !FLAC__stream_decoder_process_until_end_of_metadata(decoder) ||
+     (flac->origin+flac->fill>0 &&
+      !FLAC__stream_decoder_seek_absolute(decoder,flac->origin+flac->fill/pcm->ch)))
+    flac->failed=1;
+
+  while(!flac->failed && flac->fill<flac->seg_end){
+    if(FLAC__stream_decoder_get_state(decoder)==FLAC__STREAM_DECODER_END_OF_STREAM)
+      break;
+    if(!FLAC__stream_decoder_process_single(decoder))
+      flac->failed=1;
+  }
+  if(flac->fill<flac->seg_end)
+    flac->failed=1;
+
+  FLAC__stream_decoder_finish(decoder);
+  FLAC__stream_decoder_delete(decoder);
+  return NULL;
+}
+
+/* returns nonzero if the caller should decode serially instead */
+static int flac_parallel(char *path, int oggp, pcm_t *pcm, flac_callback_arg *flac){
+  off_t frames = pcm->size;
+  int n = sb_decode_threads;
+  flac_callback_arg seg[n];
+  pthread_t threads[n];
+  int started[n];
+  int i,failed=0;
+
+  if(frames/FLAC_SEGMENT_MIN<n)
+    n=frames/FLAC_SEGMENT_MIN;
+  if(n<2)
+    return 1;
+  if(flac->bits!=16 && flac->bits!=24 && flac->bits!=32){
+    if(sb_verbose)
+      fprintf(stderr,"\r%s: %d bit FLAC; decoding serially.\n",path,flac->bits);
+    return 1;
+  }
+
+  flac_alloc(pcm,flac->channels,flac->bits);
+  if(!pcm->data){
+    fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
+    return 1;
+  }
+  flac_md5_alloc(flac);
+  if(load_verbose())
+    fprintf(stderr,"\rLoading %s: decoding on %d threads...",pcm->name,n);
+
+  memset(seg,0,sizeof(seg));
+  for(i=0;i<n;i++){
+    seg[i].in=flac->in->reopen(flac->in);
+    seg[i].segment=1;
+    seg[i].oggp=oggp;
+    seg[i].pcm=pcm;
+    seg[i].channels=flac->channels;
+    seg[i].bits=flac->bits;
+    seg[i].bps=flac->bps;
+    seg[i].md5buf=flac->md5buf;
+    seg[i].interleave=flac->interleave;
+    seg[i].origin=flac->origin;
+    seg[i].fill=frames*i/n*pcm->ch;
+    seg[i].seg_end=frames*(i+1)/n*pcm->ch;
+  }
+
+  /* the calling thread takes the first segment */
+  for(i=1;i<n;i++){
+    started[i] = !pthread_create(threads+i,NULL,flac_segment_thread,seg+i);
+    if(!started[i])seg[i].failed=1;
+  }
+  flac_segment_thread(seg);
+  for(i=1;i<n;i++)
+    if(started[i])pthread_join(threads[i],NULL);
+
+  for(i=0;i<n;i++){
+    if(seg[i].in)seg[i].in->close(seg[i].in);
+    if(seg[i].failed)failed=1;
+  }
+
+  if(failed){
+    if(sb_verbose)
+      fprintf(stderr,"\r%s: Parallel decode failed; decoding serially.\n",path);
+    free(pcm->data);
+    pcm->data=NULL;
+    free(flac->md5buf);
+    flac->md5buf=NULL;
+    pcm->size=frames;
+    return 1;
+  }
+  flac->fill=frames*pcm->ch;
+  return 0;
+}
+
+/* decode only the frames of the -s/-e window */
+static FLAC__bool flac_window(FLAC__StreamDecoder *decoder, flac_callback_arg *flac){
+  flac->fill=0;
+  flac->seg_end=flac->pcm->size*flac->channels;
+  if(flac->origin>0 && !FLAC__stream_decoder_seek_absolute(decoder,flac->origin))
+    return false;
+  while(flac->fill<flac->seg_end){
+    if(FLAC__stream_decoder_get_state(decoder)==FLAC__STREAM_DECODER_END_OF_STREAM)
+      break;
+    if(!FLAC__stream_decoder_process_single(decoder))
+      return false;
+  }
+  return true;
+}
+
+/* FLAC MD5 verification ******************************************************/
+
+/* The MD5 signature in STREAMINFO covers the whole stream in order.
+   libFLAC checks it only in a decoder that sees every frame in
+   order, which neither parallel segments nor the first frames of a
+   progressive load wait for; instead the loading decoders write each
+   sample out as the signature covers it (with -k the buffer already
+   holds exactly that), each into its own part of the copy, and a
+   thread of its own hashes the copy front to back, so segment by
+   segment in order, and frees it.  It starts as soon as the file is
+   loaded, or with --md5 defer once verify_release() says playback is
+   under way, at idle priority.  Excerpts (-s/-e) and streamed (-z)
+   files aren't decoded whole and so aren't checked. */
+
+typedef struct {
+  uint32_t h[4];
+  uint64_t bytes;
+  unsigned char block[64];
+} md5_ctx;
+
+static const uint32_t md5_k[64]={
+  0xd76aa478,0xe8c7b756,0x242070db,0xc1bdceee,0xf57c0faf,0x4787c62a,0xa8304613,0xfd469501,
+  0x698098d8,0x8b44f7af,0xffff5bb1,0x895cd7be,0x6b901122,0xfd987193,0xa679438e,0x49b40821,
+  0xf61e2562,0xc040b340,0x265e5a51,0xe9b6c7aa,0xd62f105d,0x02441453,0xd8a1e681,0xe7d3fbc8,
+  0x21e1cde6,0xc33707d6,0xf4d50d87,0x455a14ed,0xa9e3e905,0xfcefa3f8,0x676f02d9,0x8d2a4c8a,
+  0xfffa3942,0x8771f681,0x6d9d6122,0xfde5380c,0xa4beea44,0x4bdecfa9,0xf6bb4b60,0xbebfbc70,
+  0x289b7ec6,0xeaa127fa,0xd4ef3085,0x04881d05,0xd9d4d039,0xe6db99e5,0x1fa27cf8,0xc4ac5665,
+  0xf4292244,0x432aff97,0xab9423a7,0xfc93a039,0x655b59c3,0x8f0ccc92,0xffeff47d,0x85845dd1,
+  0x6fa87e4f,0xfe2ce6e0,0xa3014314,0x4e0811a1,0xf7537e82,0xbd3af235,0x2ad7d2bb,0xeb86d391
+};
+
+static const unsigned char md5_r[64]={
+  7,12,17,22,7,12,17,22,7,12,17,22,7,12,17,22,
+  5,9,14,20,5,9,14,20,5,9,14,20,5,9,14,20,
+  4,11,16,23,4,11,16,23,4,11,16,23,4,11,16,23,
+  6,10,15,21,6,10,15,21,6,10,15,21,6,10,15,21
+};
+
+static void md5_block(md5_ctx *c, const unsigned char *p){
+  uint32_t w[16],a=c->h[0],b=c->h[1],cc=c->h[2],d=c->h[3];
+  int i;
+  for(i=0;i<16;i++)
+    w[i]=p[i*4]|(uint32_t)p[i*4+1]<<8|(uint32_t)p[i*4+2]<<16|(uint32_t)p[i*4+3]<<24;
+  for(i=0;i<64;i++){
+    uint32_t f,t;
+    int g;
+    if(i<16){
+      f=(b&cc)|(~b&d); g=i;
+    }else if(i<32){
+      f=(d&b)|(~d&cc); g=(5*i+1)&15;
+    }else if(i<48){
+      f=b^cc^d; g=(3*i+5)&15;
+    }else{
+      f=cc^(b|~d); g=(7*i)&15;
+    }
+    t=a+f+md5_k[i]+w[g];
+    a=d; d=cc; cc=b;
+    b+=(t<<md5_r[i])|(t>>(32-md5_r[i]));
+  }
+  c->h[0]+=a; c->h[1]+=b; c->h[2]+=cc; c->h[3]+=d;
+}
+
+static void md5_init(md5_ctx *c){
+  c->h[0]=0x67452301;
+  c->h[1]=0xefcdab89;
+  c->h[2]=0x98badcfe;
+  c->h[3]=0x10325476;
+  c->bytes=0;
+}
+
+static void md5_update(md5_ctx *c, const unsigned char *p, size_t n){
+  size_t fill = c->bytes&63;
+  c->bytes+=n;
+  if(fill){
+    size_t k = (n<64-fill ? n : 64-fill);
+    memcpy(c->block+fill,p,k);
+    p+=k;
+    n-=k;
+    if(fill+k<64)return;
+    md5_block(c,c->block);
+  }
+  for(;n>=64;n-=64,p+=64)
+    md5_block(c,p);
+  memcpy(c->block,p,n);
+}
+
+static void md5_final(md5_ctx *c, unsigned char *digest){
+  uint64_t bits = c->bytes*8;
+  unsigned char pad[72];
+  size_t n = 64-((c->bytes+8)&63);
+  int i;
+  memset(pad,0,sizeof(pad));
+  pad[0]=0x80;
+  for(i=0;i<8;i++)
+    pad[n+i]=bits>>(i*8);
+  md5_update(c,pad,n+8);
+  for(i=0;i<16;i++)
+    digest[i]=c->h[i/4]>>((i&3)*8);
+}
+
+struct verify_struct {
+  pthread_t thread;
+  unsigned char *data; /* samples as the signature covers them */
+  off_t bytes;
+  int owned;           /* data is ours to free */
+  unsigned char md5sum[16];
+  int start;  /* wanted now; under verify_mutex */
+  int joined;
+  int state;  /* VERIFY_*; atomic */
+  int abort;  /* atomic */
+};
+
+static pthread_mutex_t verify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t verify_cond = PTHREAD_COND_INITIALIZER;
+static int verify_released;
+
+#define VERIFY_CHUNK (1<<20)
+
+static void *verify_thread(void *arg){
+  verify_t *v = (verify_t *)arg;
+  unsigned char md5sum[16];
+  md5_ctx c;
+  off_t i;
+  int start;
+
+  pthread_mutex_lock(&verify_mutex);
+  while(!verify_released && !v->start && !__atomic_load_n(&v->abort,__ATOMIC_ACQUIRE))
+    pthread_cond_wait(&verify_cond,&verify_mutex);
+  start=v->start;
+  pthread_mutex_unlock(&verify_mutex);
+
+#ifdef SCHED_IDLE
+  /* unless something is waiting on the result */
+  if(!start){
+    struct sched_param sp;
+    memset(&sp,0,sizeof(sp));
+    pthread_setschedparam(pthread_self(),SCHED_IDLE,&sp);
+  }
+#endif
+
+  md5_init(&c);
+  for(i=0;i<v->bytes;i+=VERIFY_CHUNK){
+    if(__atomic_load_n(&v->abort,__ATOMIC_ACQUIRE))
+      return NULL;
+    md5_update(&c,v->data+i,(v->bytes-i<VERIFY_CHUNK ? v->bytes-i : VERIFY_CHUNK));
+  }
+  md5_final(&c,md5sum);
+
+  if(v->owned){
+    free(v->data);
+    v->data=NULL;
+  }
+  __atomic_store_n(&v->state,memcmp(md5sum,v->md5sum,16) ? VERIFY_FAILED : VERIFY_OK,
+                   __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* takes 'data' if 'owned' */
+static void flac_verify(pcm_t *pcm, unsigned char *data, off_t bytes, int owned,
+                        unsigned char *md5sum){
+  verify_t *v = calloc(1,sizeof(*v));
+  if(!v){
+    if(owned)free(data);
+    return;
+  }
+  v->data=data;
+  v->bytes=bytes;
+  v->owned=owned;
+  memcpy(v->md5sum,md5sum,16);
+  v->start=(sb_verify==MD5_LOAD);
+  v->state=VERIFY_PENDING;
+  if(pthread_create(&v->thread,NULL,verify_thread,v)){
+    if(sb_verbose)
+      fprintf(stderr,"\r%s: Failed to start MD5 check.\n",pcm->name);
+    if(owned)free(data);
+    free(v);
+    return;
+  }
+  pcm->verify=v;
+}
+
+/* start the check now if it's deferred, and wait for the result */
+static int verify_wait(verify_t *v){
+  pthread_mutex_lock(&verify_mutex);
+  v->start=1;
+  pthread_cond_broadcast(&verify_cond);
+  pthread_mutex_unlock(&verify_mutex);
+  if(!v->joined){
+    pthread_join(v->thread,NULL);
+    v->joined=1;
+  }
+  return __atomic_load_n(&v->state,__ATOMIC_ACQUIRE);
+}
+
+static void verify_free(verify_t *v){
+  pthread_mutex_lock(&verify_mutex);
+  __atomic_store_n(&v->abort,1,__ATOMIC_RELEASE);
+  pthread_cond_broadcast(&verify_cond);
+  pthread_mutex_unlock(&verify_mutex);
+  if(!v->joined)
+    pthread_join(v->thread,NULL);
+  if(v->owned)
+    free(v->data);
+  free(v);
 }
 
-static FLAC__bool eof_callback(const FLAC__StreamDecoder *decoder,
-                        void *client_data){
-  flac_callback_arg *flac = (flac_callback_arg *)client_data;
-  return feof(flac->in)? true : false;
+/* deferred checks may start */
+void verify_release(void){
+  pthread_mutex_lock(&verify_mutex);
+  verify_released=1;
+  pthread_cond_broadcast(&verify_cond);
+  pthread_mutex_unlock(&verify_mutex);
 }
 
-static pcm_t *flac_load_i(char *path, FILE *in, int oggp){
+static pcm_t *flac_load_i(char *path, input_source *in, int oggp){
   pcm_t *pcm;
   flac_callback_arg *flac;
   FLAC__StreamDecoder *decoder;
   FLAC__bool ret;
+  input_source *sin=NULL;
+  off_t flac_fill;
+  unsigned char md5sum[16];
+  unsigned char *md5buf=NULL,*native;
+  int check=0;
 
-  if(fseek(in,0,SEEK_SET)==-1){
+  if(in->seek(in,0,SEEK_SET)==-1){
     fprintf(stderr,"%s: Failed to seek\n",path);
     goto err;
   }
 
+  if(sb_stream_cache){
+    if(!(sin=stream_reopen(path,in)))goto err;
+    in=sin;
+  }
+
   pcm = calloc(1,sizeof(pcm_t));
   flac = calloc(1,sizeof(flac_callback_arg));
   decoder = FLAC__stream_decoder_new();
-  FLAC__stream_decoder_set_md5_checking(decoder, true);
+  /* checked from what the decode writes out, by flac_verify */
+  FLAC__stream_decoder_set_md5_checking(decoder, false);
   FLAC__stream_decoder_set_metadata_respond(decoder, FLAC__METADATA_TYPE_STREAMINFO);
+  FLAC__stream_decoder_set_metadata_respond(decoder, FLAC__METADATA_TYPE_SEEKTABLE);
 
   pcm->name=strdup(trim_path(path));
   flac->in=in;
   flac->pcm=pcm;
+  flac->decoder=decoder;
+  flac->interleave=interleave_pick();
 
   if(oggp)
     FLAC__stream_decoder_init_ogg_stream(decoder,
                                          read_callback,
-                                         /*seek_callback=*/0,
-                                         /*tell_callback=*/0,
-                                         /*length_callback=*/0,
+                                         seek_callback,
+                                         tell_callback,
+                                         length_callback,
                                          eof_callback,
                                          write_callback,
                                          metadata_callback,
@@ -956,62 +3626,89 @@ static pcm_t *flac_load_i(char *path, FILE *in, int oggp){
   else
     FLAC__stream_decoder_init_stream(decoder,
                                      read_callback,
-                                     /*seek_callback=*/0,
-                                     /*tell_callback=*/0,
-                                     /*length_callback=*/0,
+                                     seek_callback,
+                                     tell_callback,
+                                     length_callback,
                                      eof_callback,
                                      write_callback,
                                      metadata_callback,
                                      error_callback,
                                      flac);
 
+  if(sin){
+    ret=FLAC__stream_decoder_process_until_end_of_metadata(decoder);
+    if(ret && pcm->size>0 && (flac->bits==16 || flac->bits==24 || flac->bits==32)){
+      stream_source *s;
+      off_t from,to;
+      pcm->ch = flac->channels;
+      s=stream_new(pcm,sin,pcm->size);
+      window_frames(pcm->rate,pcm->size,&from,&to);
+      pcm->origin = from;
+      pcm->nativebits = flac->bits;
+      pcm->currentbits = -32;
+      pcm->size = (to-from)*pcm->ch*sizeof(float);
+      s->dec=flac;
+      s->seek=flac_stream_seek;
+      s->decode=flac_stream_decode;
+      s->free=flac_stream_free;
+      flac->stream=s;
+      stream_attach(pcm,s);
+      if(load_verbose())
+        fprintf(stderr,"\rLoading %s: streaming (%d seek points).         ",
+                pcm->name,flac->seekpoints);
+      goto matrix;
+    }
+    /* unknown length or unsupported depth; decode it all as usual */
+    if(sb_verbose && ret)
+      fprintf(stderr,"\r%s: can't stream this file; loading instead.\n",path);
+  }
+
   /* setup and sample reading handled by configured callbacks */
-  ret=FLAC__stream_decoder_process_until_end_of_stream(decoder);
+  if(!sin &&
+     (ret=FLAC__stream_decoder_process_until_end_of_metadata(decoder)) &&
+     pcm->size>0){
+    off_t from,to,total=pcm->size;
+    window_frames(pcm->rate,total,&from,&to);
+    pcm->origin=flac->origin=from;
+    pcm->size=to-from;
+    flac->check=(flac->md5 && sb_verify!=MD5_OFF && from==0 && to==total);
+    if(sb_decode_threads>1 && !flac_parallel(path,oggp,pcm,flac)){
+      /* done; the serial decoder never got past the metadata */
+    }else if(from>0 || to<total)
+      ret=flac_window(decoder,flac);
+    else
+      ret=FLAC__stream_decoder_process_until_end_of_stream(decoder);
+  }else
+    ret=FLAC__stream_decoder_process_until_end_of_stream(decoder);
   FLAC__stream_decoder_finish(decoder);
   FLAC__stream_decoder_delete(decoder);
+  flac_fill=flac->fill;
+  check=flac->check;
+  md5buf=flac->md5buf;
+  memcpy(md5sum,flac->md5sum,16);
   free(flac);
+  if(sin)sin->close(sin);
   if(!ret){
+    free(md5buf);
     free_pcm(pcm);
     return NULL;
   }
-
-  /* set channel matrix */
-  switch(pcm->ch){
-  case 1:
-    pcm->matrix = strdup("M");
-    pcm->mix = strdup("A");
-    break;
-  case 2:
-    pcm->matrix = strdup("L,R");
-    pcm->mix = strdup("BC");
-    break;
-  case 3:
-    pcm->matrix = strdup("L,R,C");
-    pcm->mix = strdup("BCD");
-    break;
-  case 4:
-    pcm->matrix = strdup("L,R,BL,BR");
-    pcm->mix = strdup("BCFG");
-    break;
-  case 5:
-    pcm->matrix = strdup("L,R,C,BL,BR");
-    pcm->mix = strdup("BCDFG");
-    break;
-  case 6:
-    pcm->matrix = strdup("L,R,C,LFE,BL,BR");
-    pcm->mix = strdup("BCDEFG");
-    break;
-  case 7:
-    pcm->matrix = strdup("L,R,C,LFE,BC,SL,SR");
-    pcm->mix = strdup("BCDEJKL");
-    break;
-  default:
-    pcm->matrix = strdup("L,R,C,LFE,BL,BR,SL,SR");
-    pcm->mix = strdup("BCDEFGKL");
-    break;
+  native=pcm->data;
+  if(sb_native && pcm->data &&
+     native_pcm(pcm,pcm->data,flac_fill*(pcm->nativebits/8),pcm->nativebits,0)){
+    fprintf(stderr,"Unable to allocate enough memory to load sample into memory\n");
+    free(md5buf);
+    free_pcm(pcm);
+    return NULL;
   }
+  if(check)
+    flac_verify(pcm,md5buf ? md5buf : native,flac_fill*(pcm->nativebits/8),md5buf!=NULL,md5sum);
 
-  if(sb_verbose)
+ matrix:
+  if(!pcm->matrix)
+    flac_channel_map(pcm);
+
+  if(load_verbose() && !pcm->lazy)
     fprintf(stderr,"\rLoading %s: loaded.         ",pcm->name);
 
   return pcm;
@@ -1019,44 +3716,117 @@ static pcm_t *flac_load_i(char *path, FILE *in, int oggp){
   return NULL;
 }
 
-static pcm_t *flac_load(char *path, FILE *in){
+static pcm_t *flac_load(char *path, input_source *in){
   return flac_load_i(path,in,0);
 }
 
-static pcm_t *oggflac_load(char *path, FILE *in){
+static pcm_t *oggflac_load(char *path, input_source *in){
   return flac_load_i(path,in,1);
 }
 
 /* Vorbis load support **************************************************************************/
-static pcm_t *vorbis_load(char *path, FILE *in){
-  OggVorbis_File vf;
+
+static size_t ovc_read(void *_ptr,size_t _size,size_t _nmemb,void *_stream){
+  input_source *in = (input_source *)_stream;
+  long ret = in->read(in,_ptr,_size*_nmemb);
+  if(ret<0){
+    errno=EIO;
+    return 0;
+  }
+  return ret/_size;
+}
+
+static int ovc_seek(void *_stream,ogg_int64_t _offset,int _whence){
+  input_source *in = (input_source *)_stream;
+  return in->seek(in,_offset,_whence);
+}
+
+static long ovc_tell(void *_stream){
+  input_source *in = (input_source *)_stream;
+  return in->tell(in);
+}
+
+static ov_callbacks vorbis_callbacks =
+  { ovc_read,ovc_seek,NULL,ovc_tell };
+
+static int vorbis_stream_seek(stream_source *s, off_t frame){
+  return ov_pcm_seek((OggVorbis_File *)s->dec,frame);
+}
+
+static long vorbis_stream_decode(stream_source *s, float *out, int frames){
+  OggVorbis_File *vf = (OggVorbis_File *)s->dec;
+  float_interleave interleave = interleave_float_pick();
+  long got=0;
+  while(got<frames){
+    int current_section;
+    float **pcmout;
+    long ret=ov_read_float(vf,&pcmout,frames-got,&current_section);
+    if(ret<0)return -1;
+    if(ret==0)break;
+    interleave(out,pcmout,s->ch,ret);
+    out+=ret*s->ch;
+    got+=ret;
+  }
+  return got;
+}
+
+static void vorbis_stream_free(stream_source *s){
+  ov_clear((OggVorbis_File *)s->dec);
+  free(s->dec);
+}
+
+static stream_source *vorbis_segment_open(input_source *in, pcm_t *pcm){
+  OggVorbis_File *vf=calloc(1,sizeof(*vf));
+  stream_source *s;
+  if(ov_open_callbacks(in, vf, NULL, 0, vorbis_callbacks) < 0){
+    free(vf);
+    in->close(in);
+    return NULL;
+  }
+  s=stream_new(pcm,in,ov_pcm_total(vf,-1));
+  s->dec=vf;
+  s->seek=vorbis_stream_seek;
+  s->decode=vorbis_stream_decode;
+  s->free=vorbis_stream_free;
+  return s;
+}
+
+static pcm_t *vorbis_load(char *path, input_source *in){
+  OggVorbis_File *vf=calloc(1,sizeof(*vf));
   vorbis_info *vi=NULL;
   pcm_t *pcm=NULL;
   off_t fill=0;
+  off_t from,to;
   int throttle=0;
   int last_section=-1;
+  input_source *sin=NULL;
+  float_interleave interleave=interleave_float_pick();
 
-  memset(&vf,0,sizeof(vf));
-
-  if(fseek(in,0,SEEK_SET)==-1){
+  if(in->seek(in,0,SEEK_SET)==-1){
     fprintf(stderr,"%s: Failed to seek\n",path);
     goto err;
   }
 
-  if(ov_open_callbacks(in, &vf, NULL, 0, OV_CALLBACKS_NOCLOSE) < 0) {
+  if(sb_stream_cache){
+    if(!(sin=stream_reopen(path,in)))goto err;
+    in=sin;
+  }
+
+  if(ov_open_callbacks(in, vf, NULL, 0, vorbis_callbacks) < 0) {
     fprintf(stderr,"Input does not appear to be an Ogg bitstream.\n");
     goto err;
   }
 
-  vi=ov_info(&vf,-1);
+  vi=ov_info(vf,-1);
   pcm = calloc(1,sizeof(pcm_t));
   pcm->name=strdup(trim_path(path));
   pcm->nativebits=-32;
   pcm->currentbits=-32;
   pcm->ch=vi->channels;
   pcm->rate=vi->rate;
-  pcm->size=ov_pcm_total(&vf,-1)*vi->channels*sizeof(float);
-  pcm->data=calloc(pcm->size,1);
+  window_frames(pcm->rate,ov_pcm_total(vf,-1),&from,&to);
+  pcm->origin=from;
+  pcm->size=(to-from)*vi->channels*sizeof(float);
 
   switch(pcm->ch){
   case 1:
@@ -1093,16 +3863,56 @@ static pcm_t *vorbis_load(char *path, FILE *in){
     break;
   }
 
+  if(sin){
+    /* decode on demand; the stream is checked for consistency up front
+       since there's no later point to bail out */
+    stream_source *s;
+    long i;
+    for(i=0;i<ov_streams(vf);i++){
+      vorbis_info *li=ov_info(vf,i);
+      if(li->channels != pcm->ch || li->rate!=pcm->rate){
+        fprintf(stderr,"%s: Chained file changes channel count/sample rate\n",path);
+        goto err;
+      }
+    }
+    s=stream_new(pcm,sin,ov_pcm_total(vf,-1));
+    s->dec=vf;
+    s->seek=vorbis_stream_seek;
+    s->decode=vorbis_stream_decode;
+    s->free=vorbis_stream_free;
+    stream_attach(pcm,s);
+    if(load_verbose())
+      fprintf(stderr,"\rLoading %s: streaming.         ",pcm->name);
+    return pcm;
+  }
+
+  pcm->data=calloc(pcm->size,1);
+
+  /* a Vorbis packet is overlapped with the one before it, so each
+     segment starts a long block early */
+  if(sb_decode_threads>1 && pcm->data && ov_streams(vf)!=1 && sb_verbose)
+    fprintf(stderr,"\r%s: Chained stream; decoding serially.\n",path);
+  if(sb_decode_threads>1 && pcm->data && ov_streams(vf)==1 &&
+     !parallel_decode(path,in,pcm,from,to-from,vorbis_segment_open,
+                      vorbis_info_blocksize(vi,1)))
+    fill=pcm->size/sizeof(float);
+  else if(from>0 && ov_pcm_seek(vf,from)){
+    fprintf(stderr,"%s: Failed to seek\n",path);
+    goto err;
+  }
+
   while(fill*sizeof(float)<pcm->size){
     int current_section;
-    int i,j;
     float **pcmout;
-    long ret=ov_read_float(&vf,&pcmout,4096,&current_section);
+    /* ask for the rest of the load window; a read returns at most a
+       packet, and never runs past the window */
+    long want=(pcm->size/sizeof(float)-fill)/pcm->ch;
+    long ret=ov_read_float(vf,&pcmout,(want>INT_MAX ? INT_MAX : want),&current_section);
     float *d = (float *)pcm->data;
 
     if(current_section!=last_section){
       last_section=current_section;
-      vi=ov_info(&vf,-1);
+      vi=ov_info(vf,-1);
       if(vi->channels != pcm->ch || vi->rate!=pcm->rate){
         fprintf(stderr,"%s: Chained file changes channel count/sample rate\n",path);
         goto err;
@@ -1118,22 +3928,25 @@ static pcm_t *vorbis_load(char *path, FILE *in){
       goto err;
     }
 
-    for(i=0;i<ret;i++)
-      for(j=0;j<pcm->ch;j++)
-        d[fill++]=pcmout[j][i];
+    interleave(d+fill,pcmout,pcm->ch,ret);
+    fill+=ret*pcm->ch;
 
-    if (sb_verbose && (throttle&0x3f)==0)
+    if (load_verbose() && (throttle&0x3f)==0)
       fprintf(stderr,"\rLoading %s: %ld to go...       ",pcm->name,(long)(pcm->size-fill*sizeof(float)));
     throttle++;
+    load_progress(pcm,fill,pcm->size/sizeof(float));
   }
-  ov_clear(&vf);
+  ov_clear(vf);
+  free(vf);
 
-  if(sb_verbose)
+  if(load_verbose())
     fprintf(stderr,"\rLoading %s: loaded.         ",pcm->name);
 
   return pcm;
  err:
-  ov_clear(&vf);
+  ov_clear(vf);
+  free(vf);
+  if(sin)sin->close(sin);
   free_pcm(pcm);
   return NULL;
 }
@@ -1141,15 +3954,18 @@ static pcm_t *vorbis_load(char *path, FILE *in){
 /* Opus load support **************************************************************************/
 
 int opc_read(void *_stream,unsigned char *_ptr,int _nbytes){
-  return fread(_ptr,1,_nbytes,_stream);
+  input_source *in = (input_source *)_stream;
+  return in->read(in,_ptr,_nbytes);
 }
 
 int opc_seek(void *_stream,opus_int64 _offset,int _whence){
-  return fseek(_stream,_offset,_whence);
+  input_source *in = (input_source *)_stream;
+  return in->seek(in,_offset,_whence);
 }
 
 opus_int64 opc_tell(void *_stream){
-  return ftell(_stream);
+  input_source *in = (input_source *)_stream;
+  return in->tell(in);
 }
 
 int opc_close(void *_stream){
@@ -1159,18 +3975,71 @@ int opc_close(void *_stream){
 static OpusFileCallbacks opus_callbacks =
   { opc_read,opc_seek,opc_tell,opc_close };
 
-static pcm_t *opus_load(char *path, FILE *in){
+static int opus_stream_seek(stream_source *s, off_t frame){
+  return op_pcm_seek((OggOpusFile *)s->dec,frame);
+}
+
+static long opus_stream_decode(stream_source *s, float *out, int frames){
+  OggOpusFile *of = (OggOpusFile *)s->dec;
+  long got=0;
+  while(got<frames){
+    int ret=op_read_float(of,out,(frames-got)*s->ch,NULL);
+    if(ret<0)return -1;
+    if(ret==0)break;
+    out+=ret*s->ch;
+    got+=ret;
+  }
+  return got;
+}
+
+static void opus_stream_free(stream_source *s){
+  op_free((OggOpusFile *)s->dec);
+}
+
+#define OPUS_PREROLL 3840 /* 80ms */
+
+static off_t opus_preroll(OggOpusFile *of){
+  const OpusHead *head = op_head(of,0);
+  if(head && head->pre_skip>OPUS_PREROLL)
+    return head->pre_skip;
+  return OPUS_PREROLL;
+}
+
+static stream_source *opus_segment_open(input_source *in, pcm_t *pcm){
   OggOpusFile *of;
+  stream_source *s;
+  of = op_open_callbacks(in, &opus_callbacks , NULL, 0, NULL);
+  if(!of){
+    in->close(in);
+    return NULL;
+  }
+  s=stream_new(pcm,in,op_pcm_total(of,-1));
+  s->dec=of;
+  s->seek=opus_stream_seek;
+  s->decode=opus_stream_decode;
+  s->free=opus_stream_free;
+  return s;
+}
+
+static pcm_t *opus_load(char *path, input_source *in){
+  OggOpusFile *of=NULL;
   pcm_t *pcm=NULL;
   off_t fill=0;
+  off_t from,to;
   int throttle=0;
   int last_section=-1;
+  input_source *sin=NULL;
 
-  if(fseek(in,0,SEEK_SET)==-1){
+  if(in->seek(in,0,SEEK_SET)==-1){
     fprintf(stderr,"%s: Failed to seek\n",path);
     goto err;
   }
 
+  if(sb_stream_cache){
+    if(!(sin=stream_reopen(path,in)))goto err;
+    in=sin;
+  }
+
   of = op_open_callbacks(in, &opus_callbacks , NULL, 0, NULL);
   if(!of){
     fprintf(stderr,"Input does not appear to be an Opus bitstream.\n");
@@ -1183,9 +4052,9 @@ static pcm_t *opus_load(char *path, FILE *in){
   pcm->currentbits=-32;
   pcm->ch=op_channel_count(of,-1);
   pcm->rate=48000;
-  pcm->size=op_pcm_total(of,-1)*pcm->ch*sizeof(float);
-  pcm->data=calloc(pcm->size,1);
-
+  window_frames(pcm->rate,op_pcm_total(of,-1),&from,&to);
+  pcm->origin=from;
+  pcm->size=(to-from)*pcm->ch*sizeof(float);
 
   switch(pcm->ch){
   case 1:
@@ -1222,13 +4091,50 @@ static pcm_t *opus_load(char *path, FILE *in){
     break;
   }
 
+  if(sin){
+    stream_source *s;
+    int i;
+    for(i=0;i<op_link_count(of);i++){
+      if(op_channel_count(of,i) != pcm->ch){
+        fprintf(stderr,"%s: Chained file changes channel count\n",path);
+        goto err;
+      }
+    }
+    s=stream_new(pcm,sin,op_pcm_total(of,-1));
+    s->dec=of;
+    s->seek=opus_stream_seek;
+    s->decode=opus_stream_decode;
+    s->free=opus_stream_free;
+    stream_attach(pcm,s);
+    if(load_verbose())
+      fprintf(stderr,"\rLoading %s: streaming.         ",pcm->name);
+    return pcm;
+  }
+
+  pcm->data=calloc(pcm->size,1);
+
+  /* RFC 7845 has a decoder start at least 80ms before a seek target
+     (and at least pre-skip into the stream) for its output to have
+     converged; each segment does the same */
+  if(sb_decode_threads>1 && pcm->data && op_link_count(of)!=1 && sb_verbose)
+    fprintf(stderr,"\r%s: Chained stream; decoding serially.\n",path);
+  if(sb_decode_threads>1 && pcm->data && op_link_count(of)==1 &&
+     !parallel_decode(path,in,pcm,from,to-from,opus_segment_open,
+                      opus_preroll(of)))
+    fill=pcm->size/sizeof(float);
+  else if(from>0 && op_pcm_seek(of,from)){
+    fprintf(stderr,"%s: Failed to seek\n",path);
+    goto err;
+  }
+
   while(fill*sizeof(float)<pcm->size){
     int current_section;
-    int i,j;
-    float pcmout[4096];
-    long ret=op_read_float(of,pcmout,4096,&current_section);
-    float *d = (float *)pcm->data;
-    float *s = pcmout;
+    /* decode straight into place; given room for a whole packet,
+       opusfile skips its own buffer, and a read never runs past the
+       load window */
+    long want=pcm->size/sizeof(float)-fill;
+    long ret=op_read_float(of,(float *)pcm->data+fill,(want>INT_MAX ? INT_MAX : want),
+                           &current_section);
 
     if(current_section!=last_section){
       last_section=current_section;
@@ -1246,79 +4152,740 @@ static pcm_t *opus_load(char *path, FILE *in){
       fprintf(stderr,"%s: Audio data ended prematurely\n",path);
       goto err;
     }
+    fill+=ret*pcm->ch;
 
-    for(i=0;i<ret;i++)
-      for(j=0;j<pcm->ch;j++)
-        d[fill++]=*s++;
-
-    if (sb_verbose && (throttle&0x3f)==0)
+    if (load_verbose() && (throttle&0x3f)==0)
       fprintf(stderr,"\rLoading %s: %ld to go...       ",pcm->name,(long)(pcm->size-fill*sizeof(float)));
     throttle++;
+    load_progress(pcm,fill,pcm->size/sizeof(float));
   }
   op_free(of);
 
-  if(sb_verbose)
+  if(load_verbose())
     fprintf(stderr,"\rLoading %s: loaded.         ",pcm->name);
 
   return pcm;
  err:
-  op_free(of);
+  if(of)op_free(of);
+  if(sin)sin->close(sin);
   free_pcm(pcm);
   return NULL;
 }
 
-#define MAX_ID_LEN 36
-unsigned char buf[MAX_ID_LEN];
+/* Decoded PCM cache **********************************************************/
+
+/* With -C, compressed inputs are decoded once and the result kept
+   under $XDG_CACHE_HOME/squishyball (~/.cache/squishyball by
+   default), named for the SHA-256 digest of the file's contents and
+   for the options that change what the loader produces.  A later run
+   maps the entry back in instead of decoding.  The digest is kept in
+   the entry and checked again when it is loaded.  So that an
+   unchanged file isn't read through twice per run just to name it,
+   digests are remembered in small .idx files keyed on the file's
+   device, inode, size and modification time.  Entries are touched on
+   every hit; when the directory grows past the limit, the least
+   recently used are deleted, along with index files that haven't
+   been used since. */
+
+#define CACHE_MAGIC "SBPCM\0\0\2"
+#define CACHE_INDEX_MAGIC "SBIDX\0\0\1"
+#define CACHE_HEADER 4096 /* payload starts page aligned */
+#define CACHE_KEY 68      /* hex digest, option suffix */
+
+typedef struct {
+  char magic[8];
+  int32_t rate;
+  int32_t ch;
+  int32_t nativebits;
+  int32_t currentbits;
+  int32_t bits;        /* stored width; -32 for float */
+  int64_t bytes;       /* payload */
+  int64_t size;        /* pcm->size */
+  char matrix[256];
+  char mix[64];
+  unsigned char digest[32]; /* SHA-256 of the source file */
+} cache_header;
+
+typedef struct {
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime;
+  int64_t mtime_ns;
+  unsigned char digest[32];
+} cache_index;
+
+typedef struct {
+  char *name;
+  time_t used;
+  off_t size;
+} cache_entry;
+
+static char *cache_dir(void){
+  char *xdg = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  char *dir;
+  if(xdg && *xdg){
+    dir = malloc(strlen(xdg)+14);
+    sprintf(dir,"%s/squishyball",xdg);
+    mkdir(xdg,0700);
+  }else if(home && *home){
+    dir = malloc(strlen(home)+21);
+    sprintf(dir,"%s/.cache",home);
+    mkdir(dir,0700);
+    strcat(dir,"/squishyball");
+  }else
+    return NULL;
+  if(mkdir(dir,0700) && errno!=EEXIST){
+    free(dir);
+    return NULL;
+  }
+  return dir;
+}
+
+/* SHA-256 (FIPS 180-4) */
+
+typedef struct {
+  uint32_t h[8];
+  uint64_t bytes;
+  unsigned char block[64];
+} sha256_ctx;
+
+static const uint32_t sha256_k[64]={
+  0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+  0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+  0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+  0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+  0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+  0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+  0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+  0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+#define ROR32(x,n) (((x)>>(n))|((x)<<(32-(n))))
+
+static void sha256_block(sha256_ctx *c, const unsigned char *p){
+  uint32_t w[64],a,b,d,e,f,g,h,cc;
+  int i;
+  for(i=0;i<16;i++)
+    w[i]=(uint32_t)p[i*4]<<24|(uint32_t)p[i*4+1]<<16|(uint32_t)p[i*4+2]<<8|p[i*4+3];
+  for(;i<64;i++){
+    uint32_t s0=ROR32(w[i-15],7)^ROR32(w[i-15],18)^(w[i-15]>>3);
+    uint32_t s1=ROR32(w[i-2],17)^ROR32(w[i-2],19)^(w[i-2]>>10);
+    w[i]=w[i-16]+s0+w[i-7]+s1;
+  }
+  a=c->h[0]; b=c->h[1]; cc=c->h[2]; d=c->h[3];
+  e=c->h[4]; f=c->h[5]; g=c->h[6]; h=c->h[7];
+  for(i=0;i<64;i++){
+    uint32_t t1=h+(ROR32(e,6)^ROR32(e,11)^ROR32(e,25))+((e&f)^(~e&g))+sha256_k[i]+w[i];
+    uint32_t t2=(ROR32(a,2)^ROR32(a,13)^ROR32(a,22))+((a&b)^(a&cc)^(b&cc));
+    h=g; g=f; f=e; e=d+t1;
+    d=cc; cc=b; b=a; a=t1+t2;
+  }
+  c->h[0]+=a; c->h[1]+=b; c->h[2]+=cc; c->h[3]+=d;
+  c->h[4]+=e; c->h[5]+=f; c->h[6]+=g; c->h[7]+=h;
+}
+
+static void sha256_init(sha256_ctx *c){
+  static const uint32_t h0[8]={
+    0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19
+  };
+  memcpy(c->h,h0,sizeof(h0));
+  c->bytes=0;
+}
+
+static void sha256_update(sha256_ctx *c, const unsigned char *p, size_t n){
+  size_t fill = c->bytes&63;
+  c->bytes+=n;
+  if(fill){
+    size_t k = (n<64-fill ? n : 64-fill);
+    memcpy(c->block+fill,p,k);
+    p+=k;
+    n-=k;
+    if(fill+k<64)return;
+    sha256_block(c,c->block);
+  }
+  for(;n>=64;n-=64,p+=64)
+    sha256_block(c,p);
+  memcpy(c->block,p,n);
+}
+
+static void sha256_final(sha256_ctx *c, unsigned char *digest){
+  uint64_t bits = c->bytes*8;
+  unsigned char pad[72];
+  size_t n = 64-((c->bytes+8)&63);
+  int i;
+  memset(pad,0,sizeof(pad));
+  pad[0]=0x80;
+  for(i=0;i<8;i++)
+    pad[n+i]=bits>>(56-i*8);
+  sha256_update(c,pad,n+8);
+  for(i=0;i<32;i++)
+    digest[i]=c->h[i/4]>>(24-(i&3)*8);
+}
+
+static void cache_index_name(char *name, char *dir, struct stat *st){
+  sprintf(name,"%s/%llx-%llx.idx",dir,
+          (unsigned long long)st->st_dev,(unsigned long long)st->st_ino);
+}
+
+/* the digest remembered for this file, if it hasn't changed since */
+static int cache_index_load(char *dir, struct stat *st, unsigned char *digest){
+  char name[strlen(dir)+40];
+  cache_index x;
+  int fd,ok;
+  cache_index_name(name,dir,st);
+  fd = open(name,O_RDONLY);
+  if(fd<0)return 1;
+  ok = (read(fd,&x,sizeof(x))==sizeof(x) && !memcmp(x.magic,CACHE_INDEX_MAGIC,8) &&
+        x.dev==(uint64_t)st->st_dev && x.ino==(uint64_t)st->st_ino &&
+        x.size==st->st_size && x.mtime==st->st_mtim.tv_sec &&
+        x.mtime_ns==st->st_mtim.tv_nsec);
+  if(ok){
+    memcpy(digest,x.digest,32);
+    futimens(fd,NULL);
+  }
+  close(fd);
+  return !ok;
+}
+
+static void cache_index_store(char *dir, struct stat *st, unsigned char *digest){
+  char name[strlen(dir)+40];
+  char tmp[strlen(dir)+80];
+  cache_index x;
+  int fd;
+  memset(&x,0,sizeof(x));
+  memcpy(x.magic,CACHE_INDEX_MAGIC,8);
+  x.dev = st->st_dev;
+  x.ino = st->st_ino;
+  x.size = st->st_size;
+  x.mtime = st->st_mtim.tv_sec;
+  x.mtime_ns = st->st_mtim.tv_nsec;
+  memcpy(x.digest,digest,32);
+  cache_index_name(name,dir,st);
+  sprintf(tmp,"%s.%ld.%lx.tmp",name,(long)getpid(),(unsigned long)pthread_self());
+  fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0600);
+  if(fd<0)return;
+  if(write(fd,&x,sizeof(x))!=sizeof(x) || close(fd) || rename(tmp,name))
+    unlink(tmp);
+}
+
+/* Names the entry for this input in 'key' (CACHE_KEY bytes) and
+   leaves the SHA-256 of its contents in 'digest'. */
+static int cache_key(input_source *in, char *dir, char *key, unsigned char *digest){
+  struct stat st;
+  int indexed = (in->fd>=0 && !fstat(in->fd,&st) && S_ISREG(st.st_mode));
+  int i;
+
+  if(!indexed || cache_index_load(dir,&st,digest)){
+    sha256_ctx c;
+    long n;
+    unsigned char *buf = malloc(1<<20);
+    if(!buf || in->seek(in,0,SEEK_SET)){
+      free(buf);
+      return -1;
+    }
+    sha256_init(&c);
+    while((n=in->read(in,buf,1<<20))>0)
+      sha256_update(&c,buf,n);
+    free(buf);
+    if(n<0 || in->seek(in,0,SEEK_SET))
+      return -1;
+    sha256_final(&c,digest);
+    if(indexed)
+      cache_index_store(dir,&st,digest);
+  }
+
+  for(i=0;i<32;i++)
+    sprintf(key+i*2,"%02x",digest[i]);
+  /* stored representation depends on -k */
+  strcpy(key+64,sb_native ? "-k" : "");
+  return 0;
+}
+
+static int cache_entry_cmp(const void *a, const void *b){
+  const cache_entry *A = a, *B = b;
+  return (A->used>B->used) - (A->used<B->used);
+}
+
+/* delete least recently used entries until under the limit, then
+   index files older than every entry that's left */
+static void cache_evict(char *dir){
+  DIR *d = opendir(dir);
+  struct dirent *de;
+  cache_entry *e=NULL;
+  int n=0,max=0,i;
+  off_t total=0;
+  time_t oldest=0;
+
+  if(!d)return;
+  while((de=readdir(d))){
+    size_t len = strlen(de->d_name);
+    char path[strlen(dir)+len+2];
+    struct stat st;
+    if(len<4 || (strcmp(de->d_name+len-4,".pcm") && strcmp(de->d_name+len-4,".idx")))
+      continue;
+    sprintf(path,"%s/%s",dir,de->d_name);
+    if(stat(path,&st))continue;
+    if(n==max){
+      max = max ? max*2 : 64;
+      e = realloc(e,max*sizeof(*e));
+    }
+    e[n].name = strdup(path);
+    e[n].used = st.st_mtime;
+    e[n].size = st.st_size;
+    total += st.st_size;
+    n++;
+  }
+  closedir(d);
+
+  qsort(e,n,sizeof(*e),cache_entry_cmp);
+  for(i=0;i<n;i++){
+    size_t len = strlen(e[i].name);
+    if(strcmp(e[i].name+len-4,".pcm"))continue;
+    if(total>sb_cache_limit && !unlink(e[i].name)){
+      total -= e[i].size;
+      if(sb_verbose)
+        fprintf(stderr,"\rEvicted %s from the decode cache.\n",e[i].name);
+    }else if(!oldest)
+      oldest = e[i].used;
+  }
+  for(i=0;i<n;i++){
+    size_t len = strlen(e[i].name);
+    if(!strcmp(e[i].name+len-4,".idx") && (!oldest || e[i].used<oldest))
+      unlink(e[i].name);
+    free(e[i].name);
+  }
+  free(e);
+}
+
+/* returns NULL on a miss */
+static pcm_t *cache_load(char *path, char *dir, char *key, unsigned char *digest){
+  char file[strlen(dir)+strlen(key)+6];
+  cache_header h;
+  input_source *in;
+  pcm_t *pcm;
+  int bend;
+
+  sprintf(file,"%s/%s.pcm",dir,key);
+  in = input_open(file);
+  if(!in)return NULL;
+  if(in->read(in,&h,sizeof(h))!=sizeof(h) || memcmp(h.magic,CACHE_MAGIC,8) ||
+     in->length(in)!=CACHE_HEADER+h.bytes ||
+     h.ch<1 || h.rate<=0 || h.bytes<=0 ||
+     (h.bits!=8 && h.bits!=16 && h.bits!=24 && h.bits!=32 && h.bits!=-32) ||
+     (h.bits<0 && (h.size<=0 || h.size>h.bytes)) ||
+     memchr(h.matrix,0,sizeof(h.matrix))==NULL ||
+     memchr(h.mix,0,sizeof(h.mix))==NULL ||
+     memcmp(h.digest,digest,sizeof(h.digest)) ||
+     in->seek(in,CACHE_HEADER,SEEK_SET)){
+    /* stale or damaged; it'll be replaced */
+    in->close(in);
+    return NULL;
+  }
+
+  pcm = calloc(1,sizeof(*pcm));
+  pcm->name = strdup(trim_path(path));
+  pcm->rate = h.rate;
+  pcm->ch = h.ch;
+  pcm->nativebits = h.nativebits;
+  pcm->currentbits = h.currentbits;
+  pcm->matrix = strdup(h.matrix);
+  pcm->mix = strdup(h.mix);
+  pcm->size = (h.bits<0 ? h.size : h.bytes);
+
+  /* integer entries are -k buffers and stay at their stored width,
+     mapped; float entries are host order and load like a float WAV */
+  bend = (h.bits<0 ? host_is_big_endian() : 0);
+  if((sb_mmap || h.bits>0) && !map_pcm(file,in,pcm,h.bits,bend)){
+    /* mapped */
+  }else if(h.bits<0 ? read_float(file,in,pcm,h.bits,bend) : read_pcm(file,in,pcm,h.bits,bend)){
+    in->close(in);
+    free_pcm(pcm);
+    return NULL;
+  }
+  in->close(in);
+
+  /* most recently used */
+  utimensat(AT_FDCWD,file,NULL,0);
+  if(load_verbose())
+    fprintf(stderr,"\rLoading %s: cached.         ",pcm->name);
+  return pcm;
+}
+
+static void cache_store(pcm_t *pcm, char *dir, char *key, unsigned char *digest){
+  char file[strlen(dir)+strlen(key)+6];
+  char tmp[strlen(dir)+strlen(key)+32];
+  cache_header h;
+  unsigned char *data;
+  char pad[CACHE_HEADER-sizeof(h)];
+  FILE *out;
+
+  memset(&h,0,sizeof(h));
+  memcpy(h.magic,CACHE_MAGIC,8);
+  h.rate = pcm->rate;
+  h.ch = pcm->ch;
+  h.nativebits = pcm->nativebits;
+  h.currentbits = pcm->currentbits;
+  h.size = pcm->size;
+  memcpy(h.digest,digest,sizeof(h.digest));
+
+  if(pcm->lazy){
+    /* only native-width integer buffers (-k) are stored as is */
+    map_source *m = (map_source *)pcm->lazy->source;
+    if(pcm->lazy->read!=map_read || m->map || m->in)return;
+    h.bits = m->bits;
+    h.bytes = m->frames*m->ch*(m->bits/8);
+    data = m->data;
+  }else{
+    h.bits = -32;
+    h.bytes = pcm->size;
+    data = pcm->data;
+  }
+  if(!data || h.bytes<=0 ||
+     strlen(pcm->matrix)>=sizeof(h.matrix) || strlen(pcm->mix)>=sizeof(h.mix))
+    return;
+  strcpy(h.matrix,pcm->matrix);
+  strcpy(h.mix,pcm->mix);
+
+  /* written under a private name and renamed into place, so that
+     concurrent runs (or loader threads) never see a partial entry */
+  sprintf(file,"%s/%s.pcm",dir,key);
+  sprintf(tmp,"%s/%s.%ld.%lx.tmp",dir,key,(long)getpid(),(unsigned long)pthread_self());
+  out = fopen(tmp,"wb");
+  if(!out)return;
+  memset(pad,0,sizeof(pad));
+  if(fwrite(&h,sizeof(h),1,out)!=1 ||
+     fwrite(pad,sizeof(pad),1,out)!=1 ||
+     fwrite(data,1,h.bytes,out)!=(size_t)h.bytes){
+    fclose(out);
+    unlink(tmp);
+    if(sb_verbose)
+      fprintf(stderr,"\r%s: Unable to write decode cache entry.\n",pcm->name);
+    return;
+  }
+  if(fclose(out) || rename(tmp,file)){
+    unlink(tmp);
+    return;
+  }
+  cache_evict(dir);
+}
+
+#define MAX_ID_LEN 40
 
 /* Define the supported formats here */
 static input_format formats[] = {
-  {wav_id,     wav_load,    "wav"},
-  {aiff_id,    aiff_load,   "aiff"},
-  {flac_id,    flac_load,   "flac"},
-  {oggflac_id, oggflac_load,"oggflac"},
-  {vorbis_id,  vorbis_load, "oggvorbis"},
-  {opus_id,    opus_load,   "oggopus"},
-  {sw_id,      sw_load,     "sw"},
-  {NULL,       NULL,        NULL}
+  {wav_id,     wav_load,    "wav",      0},
+  {aiff_id,    aiff_load,   "aiff",     0},
+  {flac_id,    flac_load,   "flac",     1},
+  {oggflac_id, oggflac_load,"oggflac",  1},
+  {vorbis_id,  vorbis_load, "oggvorbis",1},
+  {opus_id,    opus_load,   "oggopus",  1},
+  {sw_id,      sw_load,     "sw",       0},
+  {NULL,       NULL,        NULL,       0}
 };
 
-pcm_t *load_audio_file(char *path){
-  FILE *f = fopen(path,"rb");
+/* identifies and loads the input, then closes it */
+static pcm_t *load_input(char *path, input_source *f, double from, double to){
+  unsigned char buf[MAX_ID_LEN];
   int j=0;
-  int fill;
+  long fill;
 
-  if(!f){
-    fprintf(stderr,"Unable to open file %s: %s\n",path,strerror(errno));
-    return NULL;
-  }
+  window_from=from;
+  window_to=to;
 
-  fill = fread(buf, 1, MAX_ID_LEN, f);
+  fill = f->read(f, buf, MAX_ID_LEN);
   if(fill<MAX_ID_LEN){
     fprintf(stderr,"%s: Input file truncated or NULL\n",path);
-    fclose(f);
+    f->close(f);
     return NULL;
   }
 
   while(formats[j].id_func){
     if(formats[j].id_func(path,buf)){
-      pcm_t *ret=formats[j].load_func(path,f);
-      fclose(f);
+      pcm_t *ret;
+      char *dir=NULL;
+      char key[CACHE_KEY];
+      unsigned char digest[32];
+      if(sb_cache_limit && formats[j].decoded && !sb_stream_cache && !window_active() &&
+         (dir=cache_dir()) && !cache_key(f,dir,key,digest)){
+        ret=cache_load(path,dir,key,digest);
+        if(!ret){
+          ret=formats[j].load_func(path,f);
+          /* only what decodes to its signature, where it has one */
+          if(ret && (!ret->verify || verify_wait(ret->verify)==VERIFY_OK))
+            cache_store(ret,dir,key,digest);
+        }
+      }else
+        ret=formats[j].load_func(path,f);
+      if(dir)free(dir);
+      f->close(f);
       return ret;
     }
     j++;
   }
   fprintf(stderr,"%s: Unrecognized file format\n",path);
+  f->close(f);
   return NULL;
 }
 
+/* may be called from several loader threads at once; "-" is stdin */
+/* 'from' and 'to' are the part of the file to load, in seconds; 0
+   and -1 for all of it */
+pcm_t *load_audio_file(char *path, double from, double to){
+  input_source *f = input_open(path);
+
+  if(!f){
+    fprintf(stderr,"Unable to open file %s: %s\n",path,strerror(errno));
+    return NULL;
+  }
+  return load_input(strcmp(path,"-") ? path : "stdin",f,from,to);
+}
+
+/* load from 'bytes' bytes of an audio file already in memory; 'data'
+   must outlive the pcm */
+pcm_t *load_audio_memory(char *name, unsigned char *data, off_t bytes){
+  input_source *f = input_memory(data,bytes);
+
+  if(!f){
+    fprintf(stderr,"Unable to allocate memory for %s\n",name);
+    return NULL;
+  }
+  return load_input(name,f,0,-1);
+}
+
 void free_pcm(pcm_t *pcm){
   if(pcm){
+    progress_source *p = progress_self;
+    if(p && p->pcm==pcm){
+      /* a failed progressive load; stop readers before the data goes */
+      pthread_mutex_lock(&p->mutex);
+      p->pcm=NULL;
+      p->data=NULL;
+      pthread_mutex_unlock(&p->mutex);
+    }
+    /* a check may be reading the -k buffer */
+    if(pcm->verify)verify_free(pcm->verify);
     if(pcm->name)free(pcm->name);
     if(pcm->matrix)free(pcm->matrix);
     if(pcm->mix)free(pcm->mix);
-    if(pcm->data)free(pcm->data);
+    if(pcm->data){
+      if(pcm->mapped)
+        munmap(pcm->data,pcm->mapped);
+      else
+        free(pcm->data);
+    }
+    if(pcm->lazy)free_lazy(pcm->lazy);
     memset(pcm,0,sizeof(*pcm));
     free(pcm);
   }
 }
 
+/* Progressive loading ********************************************************/
+
+#define PROGRESS_START 5 /* seconds loaded before playback may begin */
+
+static void progress_release(progress_source *p){
+  int refs;
+  pthread_mutex_lock(&p->mutex);
+  refs=--p->refs;
+  pthread_mutex_unlock(&p->mutex);
+  if(!refs){
+    free_pcm(p->pcm);
+    if(p->flag)free(p->flag);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->cond);
+    free(p->path);
+    free(p);
+  }
+}
+
+static void *progress_thread(void *arg){
+  progress_source *p = arg;
+  pcm_t *pcm;
+
+  progress_self=p;
+  pcm=load_audio_file(p->path,p->from,p->to);
+  progress_self=NULL;
+  if(pcm && p->data && p->data==(float *)pcm->data)
+    progress_scan(p,pcm,pcm->size/sizeof(float)/p->ch);
+
+  pthread_mutex_lock(&p->mutex);
+  /* if playback already started on this file, it goes on in silence
+     (the data went with the loader's pcm) and the panel says so */
+  if(p->handed && !pcm)
+    p->failed=1;
+  p->pcm=pcm;
+  if(pcm && p->data){
+    p->ready=pcm->size/sizeof(float)/p->ch;
+    progress_publish(p);
+  }
+  p->done=1;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+
+  progress_release(p);
+  return NULL;
+}
+
+/* reads wait for the loader to get past them */
+static long progress_read(void *source, off_t frame, int frames, float *out){
+  progress_source *p = source;
+  long n;
+  pthread_mutex_lock(&p->mutex);
+  while(!p->done && frame+frames>p->ready)
+    pthread_cond_wait(&p->cond,&p->mutex);
+  n = p->ready-frame;
+  if(n>frames)n=frames;
+  if(n<0 || !p->data)n=0;
+  if(n>0)
+    memcpy(out,p->data+frame*p->ch,n*p->ch*sizeof(*out));
+  pthread_mutex_unlock(&p->mutex);
+  return n;
+}
+
+static double progress_loaded(void *source){
+  progress_source *p = source;
+  double ret;
+  pthread_mutex_lock(&p->mutex);
+  ret = (p->done || p->frames<=0 ? 1. : (double)p->ready/p->frames);
+  pthread_mutex_unlock(&p->mutex);
+  return ret;
+}
+
+static void progress_close(void *source){
+  progress_release(source);
+}
+
+/* Start loading a file on its own thread and return once its first
+   PROGRESS_START seconds are decoded, as an on-demand pcm_t reading
+   from the growing buffer.  Files that don't load progressively
+   (mapped, streamed, cached, kept native, float) are returned as
+   loaded. */
+pcm_t *load_audio_progressive(char *path, double from, double to){
+  progress_source *p = calloc(1,sizeof(*p));
+  pthread_t thread;
+  pthread_attr_t attr;
+  pcm_t *pcm,*loading;
+  lazy_t *l;
+
+  if(!p){
+    fprintf(stderr,"Unable to allocate memory for progressive load\n");
+    return NULL;
+  }
+  pthread_mutex_init(&p->mutex,NULL);
+  pthread_cond_init(&p->cond,NULL);
+  p->path=strdup(path);
+  p->from=from;
+  p->to=to;
+  p->refs=2;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+  if(pthread_create(&thread,&attr,progress_thread,p)){
+    pthread_attr_destroy(&attr);
+    p->refs=1;
+    progress_release(p);
+    return load_audio_file(path,from,to);
+  }
+  pthread_attr_destroy(&attr);
+
+  pthread_mutex_lock(&p->mutex);
+  /* a file that's all in by now may as well be taken as loaded */
+  while(!p->done &&
+        (!p->data || p->ready>=p->frames || p->ready<(off_t)p->rate*PROGRESS_START))
+    pthread_cond_wait(&p->cond,&p->mutex);
+
+  if(p->done){
+    pcm=p->pcm;
+    p->pcm=NULL;
+    pthread_mutex_unlock(&p->mutex);
+    progress_release(p);
+    return pcm;
+  }
+
+  loading=p->pcm;
+  pcm=calloc(1,sizeof(*pcm));
+  l=calloc(1,sizeof(*l));
+  if(!pcm || !l){
+    fprintf(stderr,"Unable to allocate memory for progressive load\n");
+    exit(5);
+  }
+  pcm->name=strdup(loading->name);
+  pcm->rate=p->rate;
+  pcm->ch=p->ch;
+  pcm->nativebits=loading->nativebits;
+  pcm->currentbits=-32;
+  pcm->matrix=strdup(loading->matrix);
+  pcm->mix=strdup(loading->mix);
+  pcm->size=p->frames*p->ch*sizeof(float);
+  pcm->origin=loading->origin;
+
+  l->source=p;
+  l->read=progress_read;
+  l->close=progress_close;
+  l->loaded=progress_loaded;
+  l->ch=p->ch;
+  l->gain=1.f;
+  pcm->lazy=l;
+
+  p->handed=1;
+  pthread_mutex_unlock(&p->mutex);
+
+  if(sb_verbose)
+    fprintf(stderr,"\rLoading %s: started; continuing during playback.\n",pcm->name);
+  return pcm;
+}
+
+/* nonzero if a progressive load, or a streamed decode, failed after
+   playback started */
+int pcm_failed(pcm_t *pcm){
+  int ret=0;
+  if(pcm->lazy && pcm->lazy->close==progress_close){
+    progress_source *p = pcm->lazy->source;
+    pthread_mutex_lock(&p->mutex);
+    ret=p->failed;
+    pthread_mutex_unlock(&p->mutex);
+  }
+  if(pcm->lazy && pcm->lazy->close==stream_close){
+    stream_source *s = pcm->lazy->source;
+    if(s->threaded)pthread_mutex_lock(&s->mutex);
+    ret=s->failed;
+    if(s->threaded)pthread_mutex_unlock(&s->mutex);
+  }
+  return ret;
+}
+
+/* nonzero if the overs of a still-loading float pcm are being
+   tallied; fills in the clipping stats as of what's decoded so far.
+   A downmixed pcm has no such stats, as they're per channel. */
+int pcm_clip_state(pcm_t *pcm, float *min, float *max, size_t *count){
+  int ret=0;
+  if(pcm->lazy && pcm->lazy->close==progress_close && !pcm->lazy->mix){
+    progress_source *p = pcm->lazy->source;
+    pthread_mutex_lock(&p->mutex);
+    if(p->flag){
+      if(min)*min=p->min;
+      if(max)*max=p->max;
+      if(count)*count=p->count;
+      ret=1;
+    }
+    pthread_mutex_unlock(&p->mutex);
+  }
+  return ret;
+}
+
+/* VERIFY_* status of a pcm's MD5 check; a progressive load has
+   none until its loader finishes */
+int pcm_verified(pcm_t *pcm){
+  verify_t *v = pcm->verify;
+  if(!v && pcm->lazy && pcm->lazy->close==progress_close){
+    progress_source *p = pcm->lazy->source;
+    pthread_mutex_lock(&p->mutex);
+    if(p->done && p->pcm)
+      v=p->pcm->verify;
+    pthread_mutex_unlock(&p->mutex);
+  }
+  return v ? __atomic_load_n(&v->state,__ATOMIC_ACQUIRE) : VERIFY_NONE;
+}
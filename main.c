@@ -38,6 +38,7 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <signal.h>
 #include <ncurses.h>
@@ -49,34 +50,52 @@
 #include "main.h"
 
 #define MAXFILES 10
+#define WINDOW_MARGIN 2. /* seconds loaded either side of -s/-e */
 int sb_verbose=0;
-
-char *short_options="abcd:De:hn:NrRs:tvVxBMSg12";
+int sb_mmap=0;
+int sb_native=0;
+long sb_stream_cache=0;
+off_t sb_cache_limit=0;
+int sb_decode_threads=1;
+int sb_progressive=0;
+int sb_verify=MD5_LOAD;
+unsigned int sb_dither_seed=0;
+int sb_dither_shape=0;
+
+char *short_options="abcC:d:De:hH:kmn:NprRs:tT:vVxz:BMSg125:";
 
 struct option long_options[] = {
   {"ab",no_argument,0,'a'},
   {"abx",no_argument,0,'b'},
   {"beep-flip",no_argument,0,'B'},
   {"casual",no_argument,0,'c'},
+  {"cache",required_argument,0,'C'},
   {"device",required_argument,0,'d'},
   {"force-dither",no_argument,0,'D'},
   {"end-time",no_argument,0,'e'},
   {"gabbagabbahey",no_argument,0,'g'},
   {"score-display",no_argument,0,'g'},
   {"help",no_argument,0,'h'},
+  {"noise-shape",required_argument,0,'H'},
+  {"keep-native",no_argument,0,'k'},
+  {"mmap",no_argument,0,'m'},
   {"mark-flip",no_argument,0,'M'},
   {"trials",required_argument,0,'n'},
   {"do-not-normalize",no_argument,0,'N'},
+  {"progressive",no_argument,0,'p'},
   {"restart-after",no_argument,0,'r'},
   {"restart-every",no_argument,0,'R'},
   {"start-time",required_argument,0,'s'},
   {"seamless-flip",no_argument,0,'S'},
   {"force-truncate",no_argument,0,'t'},
+  {"dither-seed",required_argument,0,'T'},
   {"verbose",no_argument,0,'v'},
   {"version",no_argument,0,'V'},
   {"xxy",no_argument,0,'x'},
+  {"stream",required_argument,0,'z'},
   {"downmix-to-mono",no_argument,0,'1'},
   {"downmix-to-stereo",no_argument,0,'2'},
+  {"md5",required_argument,0,'5'},
   {0,0,0,0}
 };
 
@@ -86,6 +105,7 @@ void usage(FILE *out){
           "perform sample comparison testing on the command line\n\n"
           "USAGE:\n"
           "  squishyball [options] fileA [fileB [fileN...]] [> results.txt]\n\n"
+          "  One file may be given as - to read it from standard input.\n\n"
           "OPTIONS:\n"
           "  -a --ab                : Perform A/B test\n"
           "  -b --abx               : Perform A/B/X test\n"
@@ -94,6 +114,10 @@ void usage(FILE *out){
           "  -c --casual            : casual mode; load up to ten\n"
           "                           samples for non-randomized\n"
           "                           comparison without trials (default).\n"
+          "  -C --cache <MB>        : Keep decoded FLAC, Vorbis and Opus\n"
+          "                           files in a cache of at most <MB>\n"
+          "                           megabytes under $XDG_CACHE_HOME so\n"
+          "                           later runs skip decoding.\n"
           "  -d --device <N|dev>    : If a number, output to Nth\n"
           "                           sound device.  If a device name,\n"
           "                           use output driver/device matching\n"
@@ -111,29 +135,68 @@ void usage(FILE *out){
           "                           was correct or incorrect.  Disables\n"
           "                           undo/redo.\n"
           "  -h --help              : Print this usage information.\n"
+          "  -H --noise-shape <s>   : Shape 16-bit dither with filter\n"
+          "                           <s>: 'flat' (default), 'hp1' or\n"
+          "                           'hp2' (first or second order\n"
+          "                           highpass), 'lipshitz' (5-tap\n"
+          "                           E-weighted), 'wannamaker3' or\n"
+          "                           'wannamaker9' (3- or 9-tap\n"
+          "                           F-weighted).\n"
+          "  -k --keep-native       : Keep integer samples in memory at\n"
+          "                           their native width and convert them\n"
+          "                           during playback; roughly halves memory\n"
+          "                           use for 16-bit files.\n"
+          "  -m --mmap              : Map uncompressed (WAV, AIFF, SW)\n"
+          "                           integer samples into memory and\n"
+          "                           convert them during playback rather\n"
+          "                           than loading them up front.\n"
+          "                           Mapped float samples are still\n"
+          "                           read through once to check for\n"
+          "                           clipping.\n"
           "  -M --mark-flip         : Mark transitions between samples with\n"
           "                           a short period of silence\n"
           "  -n --trials <n>        : Set desired number of trials\n"
           "                           (default: 20)\n"
           "  -N --do-not-normalize  : Do not autonormalize samples to avoid\n"
           "                           clipping\n"
+          "  -p --progressive       : Start playback once the first seconds\n"
+          "                           of each sample are decoded and keep\n"
+          "                           loading during playback.  The level\n"
+          "                           is set from what has loaded and isn't\n"
+          "                           lowered later; overs past it clamp.\n"
           "  -r --restart-after     : Restart playback from sample start\n"
           "                           after every trial.\n"
           "  -R --restart-every     : Restart playback from sample start\n"
           "                           after every 'flip' as well as after\n"
           "                           every trial.\n"
           "  -s --start-time <time> : Set start time within sample for\n"
-          "                           playback\n"
+          "                           playback; -s and -e load only the\n"
+          "                           excerpt (see 'w' below)\n"
           "  -S --seamless-flip     : Do not mark transitions between samples;\n"
           "                           flip with a seamless crossfade (default)\n"
           "  -t --force-truncate    : Always truncate (never dither) when\n"
           "                           down-converting samples to 16-bit for\n"
           "                           playback.\n"
+          "  -T --dither-seed <n>   : Seed the 16-bit dither generator\n"
+          "                           (default: 0); the same seed always\n"
+          "                           produces the same dither.\n"
           "  -v --verbose           : Produce more progress information.\n"
           "  -V --version           : Print version and exit.\n"
           "  -x --xxy               : Perform X/X/Y (triangle) test.\n"
+          "  -z --stream <MB>       : Decode FLAC, Vorbis and Opus files on\n"
+          "                           demand during playback, caching at most\n"
+          "                           <MB> megabytes of decoded audio per file.\n"
+          "                           Streamed files are not normalized\n"
+          "                           (a warning names each lossy one).\n"
           "  -1 --downmix-to-mono   : Downmix surround samples to mono.\n"
           "  -2 --downmix-to-stereo : Downmix surround samples to stereo.\n"
+          "  -5 --md5 <when>        : Check FLAC MD5 signatures against\n"
+          "                           the decoded samples in the\n"
+          "                           background as files load ('load',\n"
+          "                           default), once playback starts\n"
+          "                           ('defer') or not at all ('off').\n"
+          "                           Files are cached by -C only once\n"
+          "                           they pass, and not checked again.\n"
           "\n"
           "INTERACTION:\n"
           "    a b x    : Switch playback between A, B [and X] samples.\n"
@@ -153,15 +216,19 @@ void usage(FILE *out){
           "      r      : Cycle through restart-after/restart-every/no-restart.\n"
           "      s      : set start playback point to current playback time.\n"
           "      S      : reset start playback time to 0:00:00.00\n"
+          "      w      : Load the whole of each sample when -s/-e limited\n"
+          "               loading to the excerpt (in the background, at\n"
+          "               the excerpt's level).\n"
           "      ?      : Print this keymap\n"
           "     ^-c     : Quit\n"
           "\n"
           "SUPPORTED FILE TYPES:\n"
-          "  WAV and WAVEX    : 8-, 16-, 24-bit linear integer PCM (format 1)\n"
-          "                     32 bit float (format 3)\n"
-          "  AIFF and AIFC    : 8-, 16-, 24-bit linear integer PCM or\n"
-          "                     32-bit floating point PCM\n"
-          "  FLAC and OggFLAC : 16- and 24-bit\n"
+          "  WAV and WAVEX    : 8-, 16-, 24-, 32-bit linear integer PCM (format 1)\n"
+          "  (RF64, W64)        32- and 64-bit float (format 3)\n"
+          "  AIFF and AIFC    : 8-, 16-, 24-, 32-bit linear integer PCM\n"
+          "                     (big or little endian) or 32- and\n"
+          "                     64-bit floating point PCM\n"
+          "  FLAC and OggFLAC : 16-, 24- and 32-bit\n"
           "  SW               : mono signed 16-bit little endian raw\n"
           "  OggVorbis        : all Vorbis I files\n"
           "  OggOpus          : all Opus files\n"
@@ -354,6 +421,299 @@ void *key_thread(void *arg){
   return NULL;
 }
 
+/* Stimuli are decoded in parallel; each file is independent up to
+   the point where rates, channel counts and normalization have to be
+   reconciled across all of them, which happens back in main(). */
+typedef struct {
+  char *path;
+  pcm_t *pcm;
+  float att;
+} load_job_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  load_job_t *jobs;
+  int n;
+  int next;
+  int downmix;
+  int no_normalize;
+  double from;     /* load window, as for load_audio_file */
+  double to;
+} load_pool_t;
+
+static void *load_thread(void *arg){
+  load_pool_t *p = (load_pool_t *)arg;
+  while(1){
+    load_job_t *job;
+    pthread_mutex_lock(&p->mutex);
+    if(p->next>=p->n){
+      pthread_mutex_unlock(&p->mutex);
+      break;
+    }
+    job=p->jobs+p->next++;
+    pthread_mutex_unlock(&p->mutex);
+
+    if(sb_progressive)
+      job->pcm=load_audio_progressive(job->path,p->from,p->to);
+    else
+      job->pcm=load_audio_file(job->path,p->from,p->to);
+    if(job->pcm){
+      int loading=pcm_clip_state(job->pcm,NULL,NULL,NULL);
+      job->att=check_warn_clipping(job->pcm,p->no_normalize);
+      if(p->downmix==1 && job->pcm->ch>1) job->att=convert_to_mono(job->pcm);
+      if(p->downmix==2 && job->pcm->ch>2) job->att=convert_to_stereo(job->pcm);
+      if(loading && !pcm_clip_state(job->pcm,NULL,NULL,NULL) && !p->no_normalize)
+        /* the loader's tally is per channel; it says nothing of a mix */
+        fprintf(stderr,"WARNING: %s is still loading, so its downmix can't be checked\n"
+                "         for clipping or normalized; overrange values will be clamped.\n",
+                job->pcm->name);
+    }
+  }
+  return NULL;
+}
+
+/* returns nonzero, with nothing left loaded, if any input failed */
+static int load_all(char **paths, pcm_t **pcm, float *att, int n,
+                    int downmix, int no_normalize, double from, double to){
+  load_job_t jobs[MAXFILES];
+  pthread_t threads[MAXFILES];
+  load_pool_t pool;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = (cpus<1 ? 1 : (cpus<n ? cpus : n));
+  int i;
+
+  memset(jobs,0,sizeof(jobs));
+  memset(&pool,0,sizeof(pool));
+  pthread_mutex_init(&pool.mutex,NULL);
+  pool.jobs=jobs;
+  pool.n=n;
+  pool.downmix=downmix;
+  pool.no_normalize=no_normalize;
+  pool.from=from;
+  pool.to=to;
+  for(i=0;i<n;i++)
+    jobs[i].path=paths[i];
+
+  /* cores left over go to splitting up individual files.  Progressive
+     loads start every file at once and must fill from the front, so
+     they're never split. */
+  if(sb_progressive){
+    workers=n;
+    sb_decode_threads=1;
+  }else if(cpus>workers)
+    sb_decode_threads=cpus/workers;
+
+  if(sb_verbose && workers>1)
+    fprintf(stderr,"Loading %d files on %d threads...\n",n,workers);
+
+  /* the calling thread is one of the workers */
+  for(i=1;i<workers;i++)
+    if(pthread_create(threads+i,NULL,load_thread,&pool)){
+      fprintf(stderr,"Failed to create loader thread.\n");
+      exit(7);
+    }
+  load_thread(&pool);
+  for(i=1;i<workers;i++)
+    pthread_join(threads[i],NULL);
+  pthread_mutex_destroy(&pool.mutex);
+
+  for(i=0;i<n;i++)
+    if(!jobs[i].pcm){
+      for(i=0;i<n;i++)
+        if(jobs[i].pcm)free_pcm(jobs[i].pcm);
+      return 1;
+    }
+
+  for(i=0;i<n;i++){
+    pcm[i]=jobs[i].pcm;
+    if(jobs[i].att<*att)*att=jobs[i].att;
+  }
+  return 0;
+}
+
+/* load, check and (unless disabled) normalize a set of inputs.  The
+   output depth is raised to fit the inputs and the attenuation applied
+   is returned in *att; returns nonzero if the inputs were normalized */
+static int load_samples(char **paths, pcm_t **pcm, int n, int downmix,
+                        int no_normalize, double from, double to,
+                        int *outbits, float *att){
+  int i;
+
+  *att=1.f;
+  if(load_all(paths,pcm,att,n,downmix,no_normalize,from,to))exit(2);
+
+  for(i=0;i<n;i++){
+    /* Are all samples the same rate?  If not, bail. */
+    if(pcm[0]->rate != pcm[i]->rate){
+      fprintf(stderr,"Input sample rates do not match!\n"
+              "\t%s: %dHz\n"
+              "\t%s: %dHz\n"
+              "Aborting\n",pcm[0]->name,pcm[0]->rate,pcm[i]->name,pcm[i]->rate);
+      exit(3);
+    }
+
+    /* Are all samples the same number of channels?  If not, bail. */
+    if(pcm[0]->ch != pcm[i]->ch){
+      fprintf(stderr,"Input channel counts do not match!\n"
+              "\t%s: %d channels\n"
+              "\t%s: %d channels\n"
+              "Aborting\n",pcm[0]->name,pcm[0]->ch,pcm[i]->name,pcm[i]->ch);
+      exit(3);
+    }
+
+    if(abs(pcm[i]->nativebits)>*outbits)*outbits=abs(pcm[i]->nativebits);
+  }
+
+  if(*att<1.f && !no_normalize){
+    fprintf(stderr,"Normalizing all inputs by %+0.1fdB...",todB(*att));
+    for(i=0;i<n;i++)
+      normalize(pcm[i],*att);
+    fprintf(stderr," done\n");
+
+    /* we normalized-- any 16 bit samples are now > 16 bits, ask for 24 */
+    if(*outbits<24)*outbits=24;
+    return 1;
+  }
+  *att=1.f;
+  return 0;
+
+}
+
+/* decide how a loaded set will be quantized for playback (that
+   happens fragment by fragment as it plays) and bring the channel maps
+   and lengths into agreement */
+static void convert_samples(pcm_t **pcm, int n, int outbits, int normalized,
+                            int force_dither, int force_truncate){
+  int i;
+
+  /* are we dithering? */
+  if(outbits==16){
+    if(!normalized){
+      /* no normalization, so dither if any integer samples are natively > 16 bit */
+      int flag=force_dither;
+      for(i=0;i<n;i++)
+        if(pcm[i]->nativebits>16)flag=1;
+      if(flag && force_truncate)flag=0;
+
+      for(i=0;i<n;i++)
+        pcm[i]->dithered=(pcm[i]->nativebits>0 && pcm[i]->nativebits<=16)?0:flag;
+
+    }else{
+      /* normalization! dither everything to 16 bit unless force_truncate is set */
+      for(i=0;i<n;i++)
+        pcm[i]->dithered=!force_truncate;
+    }
+  }
+
+  /* permute/reconcile the matrices before playback begins */
+  /* Invariant: all loaded files have a channel map */
+  for(i=1;i<n;i++)
+    if(strcmp(pcm[0]->matrix,pcm[i]->matrix))
+      reconcile_channel_maps(pcm[0],pcm[i]);
+
+  /* Are the samples the same length?  If not, warn and choose the shortest. */
+  {
+    off_t size=pcm[0]->size;
+    int flag=0;
+    for(i=1;i<n;i++){
+      if(pcm[i]->size!=size)flag=1;
+      if(pcm[i]->size<size)size=pcm[i]->size;
+    }
+
+    if(flag){
+      if(sb_verbose)
+        fprintf(stderr,"Input sample lengths do not match!\n");
+
+      for(i=0;i<n;i++){
+        if(sb_verbose)
+        fprintf(stderr,"\t%s: %s\n",pcm[i]->name,
+                make_time_string((double)pcm[i]->size/pcm[i]->ch/sizeof(float)/pcm[i]->rate,0));
+        pcm[i]->size=size;
+      }
+      if(sb_verbose)
+        fprintf(stderr,"Using the shortest sample for playback length...\n");
+    }
+  }
+}
+
+/* 'w' loads the whole files behind playback; the main loop swaps the
+   new set in between fragments once it's ready.  The level the
+   listener has been hearing is kept, so if the whole files need more
+   attenuation than the excerpt did, the widen is refused. */
+#define WIDEN_IDLE 0
+#define WIDEN_LOADING 1
+#define WIDEN_READY 2
+#define WIDEN_REFUSED 3
+
+typedef struct {
+  threadstate_t *state;
+  pthread_t thread;
+  char **paths;
+  pcm_t *pcm[MAXFILES];
+  int n;
+  int rate;
+  int ch;
+  int downmix;
+  int no_normalize;
+  float att;
+  int outbits;
+  int force_dither;
+  int force_truncate;
+  int status; /* under state->mutex */
+} widen_t;
+
+static void *widen_thread(void *arg){
+  widen_t *w = (widen_t *)arg;
+  float att=1.f;
+  int i,ok=0;
+
+  if(!load_all(w->paths,w->pcm,&att,w->n,w->downmix,w->no_normalize,0,-1)){
+    ok=1;
+    for(i=0;i<w->n;i++)
+      if(w->pcm[i]->rate!=w->rate || w->pcm[i]->ch!=w->ch)ok=0;
+    if(!w->no_normalize && att<w->att)ok=0;
+
+    if(ok){
+      if(w->att<1.f)
+        for(i=0;i<w->n;i++)
+          normalize(w->pcm[i],w->att);
+      convert_samples(w->pcm,w->n,w->outbits,w->att<1.f,w->force_dither,w->force_truncate);
+    }else{
+      for(i=0;i<w->n;i++)
+        free_pcm(w->pcm[i]);
+    }
+  }
+
+  pthread_mutex_lock(&w->state->mutex);
+  w->status=(ok?WIDEN_READY:WIDEN_REFUSED);
+  pthread_cond_signal(&w->state->main_cond);
+  pthread_mutex_unlock(&w->state->mutex);
+  return NULL;
+}
+
+/* With -p the level is set from what had loaded when playback began.
+   As with a widen, it isn't lowered part way through if more of a
+   file turns out to need it; nonzero if those overs were clamped. */
+static int clip_refused(pcm_t *pcm, float att){
+  float min,max,need;
+  size_t count;
+  if(!pcm_clip_state(pcm,&min,&max,&count) || !count)return 0;
+  need=-1./min;
+  if(get_clamp(pcm)/max < need)need=get_clamp(pcm)/max;
+  return need<att;
+}
+
+/* on-demand samples should be reading ahead of every place playback
+   may go next: the cursor of every sample (any may be flipped to),
+   the loop start, and a pending seek target */
+static void prefetch_all(pcm_t **pcm, int n, off_t pos, off_t start, int fragsize){
+  int i;
+  for(i=0;i<n;i++){
+    pcm_prefetch(pcm[i],pos,fragsize*4);
+    pcm_prefetch(pcm[i],start,fragsize*4);
+  }
+}
+
 int main(int argc, char **argv){
   float *fadewindow1;
   float *fadewindow2;
@@ -362,8 +722,10 @@ int main(int argc, char **argv){
   float *beep2;
   int fragsamples;
   int fragsize;
-  unsigned char *fragmentA;
-  unsigned char *fragmentB;
+  float *fragmentA;
+  float *fragmentB;
+  unsigned char *fragmentOut;
+  quant_t quant;
   pthread_t playback_handle;
   pthread_t fd_handle;
   threadstate_t state;
@@ -376,17 +738,22 @@ int main(int argc, char **argv){
   int force_dither=0;
   int force_truncate=0;
   int no_normalize=0;
-  float att=1.;
+  int normalized;
+  float att;
+  widen_t widen;
   int downmix=0;
   int restart_mode=0;
   int beep_mode=3;
   int tests=20;
   double start=0;
   double end=-1;
+  double window_from=0; /* part of each file loaded (-s/-e); see below */
+  double window_to=-1;
   int outbits=0;
   ao_device *adev=NULL;
   int randomize[MAXFILES];
-  int i,j;
+  int i;
+  int from_stdin=0;
 
   int  cchoice=-1;
   char choice_list[MAXTRIALS];
@@ -439,6 +806,24 @@ int main(int argc, char **argv){
       force_dither=0;
       force_truncate=1;
       break;
+    case 'H':
+      sb_dither_shape=dither_shape_lookup(optarg);
+      if(sb_dither_shape<0){
+        fprintf(stderr,"Error parsing argument to -H (flat, hp1, hp2, lipshitz,\n"
+                "wannamaker3 or wannamaker9)\n");
+        exit(1);
+      }
+      break;
+    case 'T':
+      {
+        char *e;
+        sb_dither_seed=strtoul(optarg,&e,0);
+        if(e==optarg || *e){
+          fprintf(stderr,"Error parsing argument to -T\n");
+          exit(1);
+        }
+      }
+      break;
     case 'n':
       tests=atoi(optarg);
       if(tests<1){
@@ -473,6 +858,35 @@ int main(int argc, char **argv){
     case 'v':
       sb_verbose=1;
       break;
+    case 'k':
+      sb_native=1;
+      break;
+    case 'm':
+      sb_mmap=1;
+      break;
+    case 'p':
+      sb_progressive=1;
+      break;
+    case 'C':
+      {
+        double mb=atof(optarg);
+        if(mb<=0){
+          fprintf(stderr,"Error parsing argument to -C\n");
+          exit(1);
+        }
+        sb_cache_limit=mb*1024*1024;
+      }
+      break;
+    case 'z':
+      {
+        double mb=atof(optarg);
+        if(mb<=0){
+          fprintf(stderr,"Error parsing argument to -z\n");
+          exit(1);
+        }
+        sb_stream_cache=mb*1024*1024;
+      }
+      break;
     case 'V':
       fprintf(stdout,"Xiph.Org Squishyball %s\n",VERSION);
       exit(0);
@@ -488,6 +902,18 @@ int main(int argc, char **argv){
     case '2':
       downmix=2;
       break;
+    case '5':
+      if(!strcmp(optarg,"load"))
+        sb_verify=MD5_LOAD;
+      else if(!strcmp(optarg,"defer"))
+        sb_verify=MD5_DEFER;
+      else if(!strcmp(optarg,"off"))
+        sb_verify=MD5_OFF;
+      else{
+        fprintf(stderr,"Error parsing argument to --md5 (load, defer or off)\n");
+        exit(1);
+      }
+      break;
     default:
       usage(stderr);
       exit(1);
@@ -515,61 +941,33 @@ int main(int argc, char **argv){
     }
   }
 
+  for(i=0;i<test_files;i++)
+    if(!strcmp(argv[optind+i],"-"))from_stdin++;
+  if(from_stdin>1){
+    fprintf(stderr,"Only one sample can be read from standard input.\n");
+    exit(1);
+  }
+
   if(pipe(exit_fds)){
     fprintf(stderr,"Failed to create interthread pipe.\n");
     exit(11);
   }
 
-  outbits=16;
-  for(i=0;i<test_files;i++){
-    float latt;
-    pcm[i]=load_audio_file(argv[optind+i]);
-    if(!pcm[i])exit(2);
-
-    latt=check_warn_clipping(pcm[i],no_normalize);
-    if(downmix==1 && pcm[i]->ch>1) latt=convert_to_mono(pcm[i]);
-    if(downmix==2 && pcm[i]->ch>2) latt=convert_to_stereo(pcm[i]);
-    if(latt<att)att=latt;
-
-    /* Are all samples the same rate?  If not, bail. */
-    if(pcm[0]->rate != pcm[i]->rate){
-      fprintf(stderr,"Input sample rates do not match!\n"
-              "\t%s: %dHz\n"
-              "\t%s: %dHz\n"
-              "Aborting\n",pcm[0]->name,pcm[0]->rate,pcm[i]->name,pcm[i]->rate);
-      exit(3);
-    }
-
-    /* Are all samples the same number of channels?  If not, bail. */
-    if(pcm[0]->ch != pcm[i]->ch){
-      fprintf(stderr,"Input channel counts do not match!\n"
-              "\t%s: %d channels\n"
-              "\t%s: %d channels\n"
-              "Aborting\n",pcm[0]->name,pcm[0]->ch,pcm[i]->name,pcm[i]->ch);
-      exit(3);
-    }
-
-    if(abs(pcm[i]->nativebits)>outbits)outbits=abs(pcm[i]->nativebits);
+  /* with -s/-e, only the excerpt (plus a margin for the transition
+     windows) is loaded until the user asks for more; stdin can only
+     be read once, so then it's all loaded */
+  if((start>0 || end>0) && !from_stdin){
+    window_from=(start>WINDOW_MARGIN ? start-WINDOW_MARGIN : 0);
+    window_to=(end>0 ? end+WINDOW_MARGIN : -1);
   }
 
-  if(att<1.f && !no_normalize){
-    fprintf(stderr,"Normalizing all inputs by %+0.1fdB...",todB(att));
-    for(i=0;i<test_files;i++){
-      int s = pcm[i]->size/sizeof(float);
-      float *d = (float *)pcm[i]->data;
-      for(j=0;j<s;j++)
-        d[j]*=att;
-    }
-    fprintf(stderr," done\n");
-
-    /* we normalized-- any 16 bit samples are now > 16 bits, ask for 24 */
-    if(outbits<24)outbits=24;
-  }else
-    no_normalize=1;
+  outbits=16;
+  normalized=load_samples(argv+optind,pcm,test_files,downmix,no_normalize,
+                          window_from,window_to,&outbits,&att);
 
   /* before proceeding, make sure we can open up playback for the
      desired number of channels and max bit depth */
-  if(outbits==32)outbits=24;
+  if(outbits>24)outbits=24;
   ao_initialize();
   if((adev=setup_playback(pcm[0]->rate,pcm[0]->ch,outbits,pcm[0]->matrix,device))==NULL){
     /* If opening playback failed for 24-bit, try for 16 */
@@ -588,56 +986,16 @@ int main(int argc, char **argv){
     }
   }
 
-  /* convert-- are we dithering? */
-  if(outbits==16){
-    if(no_normalize){
-      /* no normalization, so dither if any integer samples are natively > 16 bit */
-      int flag=force_dither;
-      for(i=0;i<test_files;i++)
-        if(pcm[i]->nativebits>16)flag=1;
-      if(flag && force_truncate)flag=0;
-
-      for(i=0;i<test_files;i++)
-        convert_to_16(pcm[i],(pcm[i]->nativebits>0 || pcm[i]->nativebits<=16)?0:flag);
-
-    }else{
-      /* normalization! dither everything to 16 bit unless force_truncate is set */
-      for(i=0;i<test_files;i++)
-        convert_to_16(pcm[i],!force_truncate);
-    }
-  }else{
-    for(i=0;i<test_files;i++)
-      convert_to_24(pcm[i]);
-  }
-
-  /* permute/reconcile the matrices before playback begins */
-  /* Invariant: all loaded files have a channel map */
-  for(i=1;i<test_files;i++)
-    if(strcmp(pcm[0]->matrix,pcm[i]->matrix))
-      reconcile_channel_maps(pcm[0],pcm[i]);
+  convert_samples(pcm,test_files,outbits,normalized,force_dither,force_truncate);
 
-  /* Are the samples the same length?  If not, warn and choose the shortest. */
-  {
-    off_t n=pcm[0]->size;
-    int flag=0;
-    for(i=1;i<test_files;i++){
-      if(pcm[i]->size!=n)flag=1;
-      if(pcm[i]->size<n)n=pcm[i]->size;
-    }
-
-    if(flag){
-      if(sb_verbose)
-        fprintf(stderr,"Input sample lengths do not match!\n");
-
-      for(i=0;i<test_files;i++){
-        if(sb_verbose)
-        fprintf(stderr,"\t%s: %s\n",pcm[i]->name,
-                make_time_string((double)pcm[i]->size/pcm[i]->ch/((pcm[i]->currentbits+7)/8)/pcm[i]->rate,0));
-        pcm[i]->size=n;
-      }
-      if(sb_verbose)
-        fprintf(stderr,"Using the shortest sample for playback length...\n");
+  /* a sample came in on stdin; take keys from the terminal */
+  if(from_stdin){
+    int fd=open("/dev/tty",O_RDWR);
+    if(fd<0 || dup2(fd,STDIN_FILENO)<0){
+      fprintf(stderr,"Unable to open the terminal for keyboard input: %s\n",strerror(errno));
+      exit(1);
     }
+    close(fd);
   }
 
   /* set up various transition windows/beeps */
@@ -663,17 +1021,22 @@ int main(int argc, char **argv){
     int do_seek=0;
     int loop=0;
     off_t seek_to=0;
-    int bps=(pcm[0]->currentbits+7)/8;
+    int bps=sizeof(float); /* playback renders from float */
     int ch=pcm[0]->ch;
     int bpf=ch*bps;
     int rate=pcm[0]->rate;
-    int size=pcm[0]->size;
-    off_t start_pos=rint(start*rate*bpf);
-    off_t end_pos=(end>0?rint(end*rate*bpf):size);
+    off_t size=pcm[0]->size;
+    /* positions are relative to the loaded window, times are absolute */
+    off_t origin=pcm[0]->origin;
+    off_t start_pos=((off_t)rint(start*rate)-origin)*bpf;
+    off_t end_pos=(end>0?((off_t)rint(end*rate)-origin)*bpf:size);
     off_t current_pos;
     int paused=0;
+    int windowed=(origin>0 || window_to>=0);
+    int do_widen=0;
     double base = 1.f/(rate*bpf);
-    double len = pcm[0]->size*base;
+    double offset = (double)origin/rate;
+    double len = offset+size*base;
     fragsize=fragsamples*bpf;
 
     /* guard start/end params */
@@ -698,7 +1061,7 @@ int main(int argc, char **argv){
       setenv("TERM", "xterm-256color", 1);
     }
     atexit(min_panel_remove);
-    panel_init(pcm, test_files, test_mode, start, end>0 ? end : len, len,
+    panel_init(pcm, test_files, test_mode, outbits, start, end>0 ? end : len, len,
                beep_mode, restart_mode, tests, running_score);
 
     /* set up shared state */
@@ -710,12 +1073,27 @@ int main(int argc, char **argv){
     state.adev=adev;
     state.exit_fd=exit_fds[0];
 
+    memset(&widen,0,sizeof(widen));
+    widen.state=&state;
+    widen.paths=argv+optind;
+    widen.n=test_files;
+    widen.rate=rate;
+    widen.ch=ch;
+    widen.downmix=downmix;
+    widen.no_normalize=no_normalize;
+    widen.att=att;
+    widen.outbits=outbits;
+    widen.force_dither=force_dither;
+    widen.force_truncate=force_truncate;
+
     fragmentA=calloc(fragsize,1);
     fragmentB=calloc(fragsize,1);
-    if(!fragmentA || !fragmentB){
+    fragmentOut=calloc(fragsamples*ch,outbits/8);
+    if(!fragmentA || !fragmentB || !fragmentOut){
       fprintf(stderr,"Failed to allocate internal fragment memory\n");
       exit(5);
     }
+    quant_init(&quant,outbits,ch);
     if(start_pos<0)start_pos=0;
     if(start_pos>size-fragsize*3)start_pos=size-fragsize*3;
     if(end_pos<fragsize)end_pos=fragsize;
@@ -731,6 +1109,8 @@ int main(int argc, char **argv){
       fprintf(stderr,"Failed to create playback thread.\n");
       exit(7);
     }
+    if(sb_verify==MD5_DEFER)
+      verify_release();
 
     /* prepare playback loop */
     pthread_mutex_lock(&state.mutex);
@@ -872,6 +1252,10 @@ int main(int argc, char **argv){
         case 'E':
           end_pos=pcm[0]->size;
           break;
+        case 'w':
+          /* only the -s/-e excerpt was loaded; load the whole files */
+          if(windowed)do_widen=1;
+          break;
         case '?':
           panel_toggle_keymap();
           break;
@@ -918,21 +1302,75 @@ int main(int argc, char **argv){
           break;
         }
 
+        if(do_widen){
+          pthread_mutex_lock(&state.mutex);
+          if(widen.status==WIDEN_IDLE){
+            widen.status=WIDEN_LOADING;
+            if(pthread_create(&widen.thread,NULL,widen_thread,&widen)){
+              fprintf(stderr,"Failed to create loader thread.\n");
+              exit(7);
+            }
+          }
+          pthread_mutex_unlock(&state.mutex);
+          do_widen=0;
+        }
+
         while(current_pos + seek_to>end_pos)seek_to-=(end_pos-start_pos);
         while(current_pos + seek_to<start_pos)seek_to+=(end_pos-start_pos);
+        if(do_seek)
+          prefetch_all(pcm,test_files,current_pos+seek_to,start_pos,fragsize);
 
         pthread_mutex_lock(&state.mutex);
         state.key_waiting=0;
         pthread_cond_signal(&state.key_cond);
       }
 
+      /* the whole files have loaded behind playback; swap them in
+         between fragments */
+      if(widen.status==WIDEN_READY || widen.status==WIDEN_REFUSED){
+        int ready=(widen.status==WIDEN_READY);
+        pthread_mutex_unlock(&state.mutex);
+        pthread_join(widen.thread,NULL);
+        if(ready){
+          off_t cur=current_pos/bpf+origin;
+          off_t st=start_pos/bpf+origin;
+          off_t en=end_pos/bpf+origin;
+
+          for(i=0;i<test_files;i++){
+            free_pcm(pcm[i]);
+            pcm[i]=widen.pcm[i];
+          }
+
+          origin=pcm[0]->origin;
+          size=pcm[0]->size;
+          offset=(double)origin/rate;
+          len=offset+size*base;
+          current_pos=(cur-origin)*bpf;
+          start_pos=(st-origin)*bpf;
+          end_pos=(en-origin)*bpf;
+          if(end_pos>size)end_pos=size;
+          if(current_pos>end_pos)current_pos=start_pos;
+          panel_update_length(len);
+          prefetch_all(pcm,test_files,current_pos+seek_to,start_pos,fragsize);
+        }
+        /* a refused widen won't go any better a second time */
+        windowed=0;
+        pthread_mutex_lock(&state.mutex);
+        widen.status=WIDEN_IDLE;
+      }
+
       /* update terminal */
       {
-        double current = current_pos*base;
-        double start = start_pos*base;
-        double end = end_pos>0?end_pos*base:len;
+        double current = offset+current_pos*base;
+        double start = offset+start_pos*base;
+        double end = end_pos>0?offset+end_pos*base:len;
 
         pthread_mutex_unlock(&state.mutex);
+        for(i=0;i<test_files;i++){
+          panel_update_loaded(i,pcm_loaded(pcm[i]));
+          panel_update_verified(i,pcm_verified(pcm[i]));
+          panel_update_failed(i,pcm_failed(pcm[i]));
+        }
         panel_update_start(start);
         panel_update_current(current);
         panel_update_end(end);
@@ -949,6 +1387,7 @@ int main(int argc, char **argv){
         /* fill audio output */
         off_t save_pos=current_pos;
         int save_loop=loop;
+        int dither=pcm[current_sample]->dithered;
         pthread_mutex_unlock(&state.mutex);
 
         if(do_flip){
@@ -985,6 +1424,7 @@ int main(int argc, char **argv){
         if(paused && !do_pause){
           current_sample=randomize[current_choice];
           memset(fragmentA,0,fragsize);
+          dither=0;
           if(do_seek){
             current_pos+=seek_to;
             seek_to=0;
@@ -997,6 +1437,7 @@ int main(int argc, char **argv){
                          fragsamples, fadewindow1);
           if(do_flip || do_seek || do_select){
             current_sample=randomize[current_choice];
+            dither|=pcm[current_sample]->dithered;
             if(do_seek){
               current_pos=save_pos+seek_to;
               fill_fragment2(fragmentB, pcm[current_sample], start_pos, &current_pos, end_pos, &loop,
@@ -1012,8 +1453,8 @@ int main(int argc, char **argv){
 
         if(do_flip || do_select || do_seek){
           int j;
-          unsigned char *A=fragmentA;
-          unsigned char *B=fragmentB;
+          float *A=fragmentA;
+          float *B=fragmentB;
           float *wA=fadewindow1, *wB, *beep=0;
           if(do_select){
             wA=fadewindow3;
@@ -1040,34 +1481,31 @@ int main(int argc, char **argv){
           }
           wB=wA+fragsamples-1;
           for(i=0;i<fragsamples;i++){
-            for(j=0;j<ch;j++){
-              put_val(A,bps,get_val(A,bps)**(wA+i) + get_val(B,bps)**(wB-i) + (beep?beep[i]:0.f));
-              A+=bps;
-              B+=bps;
-            }
+            for(j=0;j<ch;j++)
+              A[j] = A[j]*wA[i] + B[j]*wB[-i] + (beep?beep[i]:0.f);
+            A+=ch;
+            B+=ch;
           }
           do_flip=0;
           do_select=0;
           do_seek=0;
         }else if(do_pause){
-          unsigned char *A=fragmentA;
+          float *A=fragmentA;
           int j;
           if(paused){
             float *wA=fadewindow1+fragsamples-1;
             for(i=0;i<fragsamples;i++){
-              for(j=0;j<ch;j++){
-                put_val(A,bps,get_val(A,bps)**(wA-i));
-                A+=bps;
-              }
+              for(j=0;j<ch;j++)
+                A[j]*=wA[-i];
+              A+=ch;
             }
 
           }else{
             float *wA=fadewindow1;
             for(i=0;i<fragsamples;i++){
-              for(j=0;j<ch;j++){
-                put_val(A,bps,get_val(A,bps)**(wA+i));
-                A+=bps;
-              }
+              for(j=0;j<ch;j++)
+                A[j]*=wA[i];
+              A+=ch;
             }
           }
           paused = !paused;
@@ -1075,10 +1513,17 @@ int main(int argc, char **argv){
           memset(fragmentB,0,fragsize);
         }
 
+        /* the one and only quantization */
+        quant_fragment(&quant,fragmentOut,fragmentA,fragsamples,dither);
+
         pthread_mutex_lock(&state.mutex);
-        state.fragment=fragmentA;
-        state.fragment_size=fragsize;
+        state.fragment=fragmentOut;
+        state.fragment_size=fragsamples*ch*(outbits/8);
         pthread_cond_signal(&state.play_cond);
+        pthread_mutex_unlock(&state.mutex);
+
+        prefetch_all(pcm,test_files,current_pos,start_pos,fragsize);
+        pthread_mutex_lock(&state.mutex);
       }
     }
   }
@@ -1086,12 +1531,36 @@ int main(int argc, char **argv){
   /* tear down terminal */
   min_panel_remove();
 
+  for(i=0;i<test_files;i++)
+    if(pcm_verified(pcm[i])==VERIFY_FAILED)
+      fprintf(stderr,"WARNING: %s failed FLAC MD5 verification; "
+              "it does not decode to what was encoded.\n",pcm[i]->name);
+  for(i=0;i<test_files;i++)
+    if(pcm_failed(pcm[i]))
+      fprintf(stderr,"WARNING: %s failed to load part way through; "
+              "it played as silence from then on.\n",pcm[i]->name);
+  for(i=0;i<test_files;i++)
+    if(!no_normalize && clip_refused(pcm[i],att))
+      fprintf(stderr,"WARNING: %s has overs past what had loaded when playback began;\n"
+              "         the level wasn't lowered for them, so they were clamped.\n",pcm[i]->name);
+
   /* join */
   write(exit_fds[1]," ",1);
   pthread_cond_signal(&state.play_cond);
   pthread_cond_signal(&state.key_cond);
   pthread_mutex_unlock(&state.mutex);
 
+  /* a widen still loading is abandoned; one that finished is cleaned up */
+  pthread_mutex_lock(&state.mutex);
+  c=widen.status;
+  pthread_mutex_unlock(&state.mutex);
+  if(c==WIDEN_READY || c==WIDEN_REFUSED){
+    pthread_join(widen.thread,NULL);
+    if(c==WIDEN_READY)
+      for(i=0;i<test_files;i++)
+        free_pcm(widen.pcm[i]);
+  }
+
   if(test_mode!=3 && tests_cursor>0){
     int total1=0;
 
@@ -1154,6 +1623,35 @@ int main(int argc, char **argv){
       else
         fprintf(stdout,"\tUndo was not used.\n");
     }
+    for(i=0;i<test_files;i++)
+      switch(pcm_verified(pcm[i])){
+      case VERIFY_OK:
+        fprintf(stdout,"\tSample %d (%s) passed FLAC MD5 verification.\n",i+1,pcm[i]->name);
+        break;
+      case VERIFY_FAILED:
+        fprintf(stdout,"\tSample %d (%s) FAILED FLAC MD5 verification.\n",i+1,pcm[i]->name);
+        break;
+      case VERIFY_PENDING:
+        fprintf(stdout,"\tSample %d (%s): FLAC MD5 verification did not finish.\n",i+1,pcm[i]->name);
+        break;
+      }
+    for(i=0;i<test_files;i++)
+      if(pcm_failed(pcm[i]))
+        fprintf(stdout,"\tSample %d (%s) failed to load part way through and played as silence.\n",
+                i+1,pcm[i]->name);
+    for(i=0;i<test_files;i++)
+      if(!no_normalize && clip_refused(pcm[i],att))
+        fprintf(stdout,"\tSample %d (%s) had overs after playback began; they were clamped.\n",
+                i+1,pcm[i]->name);
+    for(i=0;i<test_files;i++)
+      if(outbits==16){
+        if(pcm[i]->dithered)
+          fprintf(stdout,"\tSample %d (%s) played at 16 bits with %s dither (seed %u).\n",
+                  i+1,pcm[i]->name,dither_shape_name(sb_dither_shape),sb_dither_seed);
+        else
+          fprintf(stdout,"\tSample %d (%s) played at 16 bits without dither.\n",
+                  i+1,pcm[i]->name);
+      }
     fprintf(stdout,"\n");
   }
 
@@ -1172,6 +1670,8 @@ int main(int argc, char **argv){
   free(beep2);
   free(fragmentA);
   free(fragmentB);
+  free(fragmentOut);
+  quant_clear(&quant);
   for(i=0;i<test_files;i++)
     free_pcm(pcm[i]);
   if(sb_verbose)
@@ -27,6 +27,36 @@
 
 #define MAXTRIALS 150
 typedef struct pcm_struct pcm_t;
+typedef struct lazy_struct lazy_t;
+typedef struct verify_struct verify_t;
+typedef struct quant_struct quant_t;
+
+/* Samples that are produced on demand rather than held resident in
+   pcm->data.  The source delivers float frames at its own channel
+   count; audio.c applies downmix, gain and channel reordering on the
+   way out, so a lazy pcm_t looks exactly like a loaded one to the
+   render path. */
+struct lazy_struct {
+  void *source;
+  long (*read)(void *source, off_t frame, int frames, float *out);
+  void (*prefetch)(void *source, off_t frame, off_t frames);
+  void (*close)(void *source);
+  double (*loaded)(void *source); /* fraction available, or NULL if all */
+  /* a whole pass is about to start (on), or is over, when it returns
+     the number of non-finite values read; NULL if the source can't be
+     read through cheaply before playback */
+  off_t (*scan)(void *source, int on);
+  int ch;          /* channels delivered by the source */
+  off_t origin;    /* source frame at the start of the pcm */
+
+  float *mix;      /* ch -> pcm->ch downmix matrix, or NULL */
+  int *perm;       /* output channel reordering, or NULL */
+  float gain;
+
+  float *fbuf;
+  unsigned char *span[2];
+  int span_size[2];
+};
 
 struct pcm_struct {
   char *name;
@@ -38,39 +68,90 @@ struct pcm_struct {
   char *mix;
   unsigned char *data;
   off_t size;
+  lazy_t *lazy;    /* non-NULL if data is produced on demand */
+  size_t mapped;   /* nonzero if data is a private file mapping */
+  off_t origin;    /* frame of the file at the start of data (-s/-e) */
+  verify_t *verify; /* background MD5 check, or NULL */
+  int dithered;    /* dithered when played at 16 bit */
 };
 
+/* output quantizer; playback renders float fragments and quantizes
+   each once on the way to the device */
+struct quant_struct {
+  int bits;
+  int ch;
+  float *hist;     /* noise shaping error history, or NULL */
+  int hist_pos;
+  off_t count;     /* samples quantized so far; indexes the dither */
+};
+
+/* pcm_verified() results; --md5 selects when checks run */
+#define VERIFY_NONE    0 /* no signature, checking off, or not FLAC */
+#define VERIFY_PENDING 1
+#define VERIFY_OK      2
+#define VERIFY_FAILED  3
+#define MD5_OFF        0
+#define MD5_LOAD       1 /* check as each file loads */
+#define MD5_DEFER      2 /* check once playback is under way */
+
 extern int sb_verbose;
+extern int sb_mmap;
+extern int sb_native;
+extern long sb_stream_cache;
+extern off_t sb_cache_limit;
+extern int sb_decode_threads;
+extern int sb_progressive;
+extern int sb_verify;
+extern unsigned int sb_dither_seed;
+extern int sb_dither_shape;
 #define todB(x)   ((x)==0?-400.f:log((x)*(x))*4.34294480f)
 
-extern pcm_t *load_audio_file(char *path);
+extern pcm_t *load_audio_file(char *path, double from, double to);
+extern pcm_t *load_audio_memory(char *name, unsigned char *data, off_t bytes);
+extern pcm_t *load_audio_progressive(char *path, double from, double to);
 extern void free_pcm(pcm_t *pcm);
 extern float check_warn_clipping(pcm_t *pcm, int no_normalize);
+extern int pcm_verified(pcm_t *pcm);
+extern int pcm_failed(pcm_t *pcm);
+extern int pcm_clip_state(pcm_t *pcm, float *min, float *max, size_t *count);
+extern void verify_release(void);
 
-extern void convert_to_16(pcm_t *pcm, int dither);
-extern void convert_to_24(pcm_t *pcm);
-extern void convert_to_32(pcm_t *pcm);
+extern int dither_shape_lookup(const char *name);
+extern const char *dither_shape_name(int shape);
+extern void quant_init(quant_t *q, int bits, int ch);
+extern void quant_clear(quant_t *q);
+extern void quant_fragment(quant_t *q, unsigned char *out, const float *in, int frames, int dither);
+extern float get_clamp(pcm_t *pcm);
+extern void clip_scan(const float *d, off_t s, int ch, float clamp,
+                      float *min, float *max, int *flag, size_t *count);
 extern float convert_to_mono(pcm_t *pcm);
 extern float convert_to_stereo(pcm_t *pcm);
 extern void normalize(pcm_t *pcm, float att);
 extern void reconcile_channel_maps(pcm_t *A, pcm_t *B);
-extern void put_val(unsigned char *d,int bps,float v);
-extern float get_val(unsigned char *d, int bps);
+extern unsigned char *pcm_span(pcm_t *pcm, off_t pos, int bytes, int n);
+extern void pcm_prefetch(pcm_t *pcm, off_t pos, off_t bytes);
+extern double pcm_loaded(pcm_t *pcm);
+extern void free_lazy(lazy_t *lazy);
 extern int setup_windows(pcm_t **pcm, int test_files,
                          float **fw1, float **fw2, float **fw3,
                          float **b1, float **b2);
-extern void fill_fragment1(unsigned char *out, pcm_t *pcm,
+extern void fill_fragment1(float *out, pcm_t *pcm,
                            off_t start, off_t *pos, off_t end, int *loop,
                            int fragsamples, float *fw);
-extern void fill_fragment2(unsigned char *out, pcm_t *pcm,
+extern void fill_fragment2(float *out, pcm_t *pcm,
                            off_t start, off_t *pos, off_t end, int *loop,
                            int fragsamples, float *fw);
 extern ao_device *setup_playback(int rate, int ch, int bits, char *matrix, char *device);
 
 extern char *make_time_string(double s,int pad);
-extern void panel_init(pcm_t **pcm, int test_files, int test_mode, double start, double end, double size,
+extern void panel_init(pcm_t **pcm, int test_files, int test_mode, int bits,
+                       double start, double end, double size,
                        int flip_mode,int repeat_mode,int trials,int gabba);
 extern void panel_update_playing(int n);
+extern void panel_update_length(double size);
+extern void panel_update_loaded(int n, double loaded);
+extern void panel_update_verified(int n, int state);
+extern void panel_update_failed(int n, int failed);
 extern void panel_update_start(double time);
 extern void panel_update_current(double time);
 extern void panel_update_end(double time);
@@ -40,6 +40,9 @@ static int p_tm,p_ch,p_b,p_r,p_fm,p_rm,pcm_n,p_tr,p_tmax,p_pau,p_pl,p_tn,p_g;
 static double p_st,p_cur,p_end,p_len;
 static char p_tl[MAXTRIALS],p_tc[MAXTRIALS];
 static pcm_t **pcm_p;
+static int *p_ld; /* per-sample load progress, percent */
+static int *p_vf; /* per-sample MD5 check status, VERIFY_* */
+static int *p_fl; /* per-sample load failed during playback */
 
 static char timebuffer[80];
 char *make_time_string(double is,int pad){
@@ -140,6 +143,82 @@ static int draw_topbar(int row){
   return 2;
 }
 
+/* samples still loading (-p) are listed at the left of the time bar */
+static int draw_loading(int row){
+  int i,x=2;
+  char buf[20];
+  for(i=0;i<pcm_n;i++)
+    if(p_ld[i]<100)break;
+  if(i==pcm_n)return x;
+
+  min_mvcur(x,row);
+  min_putstr(" loading");
+  x+=8;
+  for(i=0;i<pcm_n;i++){
+    if(p_ld[i]>=100)continue;
+    snprintf(buf,20," %d:%d%%",i+1,p_ld[i]<0?0:p_ld[i]);
+    if(x+(int)strlen(buf)+1>columns-14)break;
+    min_putstr(buf);
+    x+=strlen(buf);
+  }
+  min_putchar(' ');
+  return x+1;
+}
+
+/* then any that failed to load part way through */
+static int draw_failed(int row, int x){
+  int i,failed=0;
+  char buf[20];
+  for(i=0;i<pcm_n;i++)
+    if(p_fl[i])failed++;
+  if(!failed)return x;
+
+  min_mvcur(x,row);
+  min_bold(1);
+  min_fg(COLOR_RED);
+  min_putstr(" LOAD FAILED");
+  x+=12;
+  for(i=0;i<pcm_n;i++){
+    if(!p_fl[i])continue;
+    snprintf(buf,20," %d",i+1);
+    if(x+(int)strlen(buf)+1>columns/2-21)break;
+    min_putstr(buf);
+    x+=strlen(buf);
+  }
+  min_unset();
+  min_putchar(' ');
+  return x+1;
+}
+
+/* followed by MD5 checks still running, or any that failed */
+static void draw_verify(int row, int x){
+  int i,failed=0,pending=0;
+  char buf[20];
+  for(i=0;i<pcm_n;i++){
+    if(p_vf[i]==VERIFY_FAILED)failed++;
+    if(p_vf[i]==VERIFY_PENDING)pending++;
+  }
+  if(!failed && !pending)return;
+
+  min_mvcur(x,row);
+  if(failed){
+    min_bold(1);
+    min_fg(COLOR_RED);
+    min_putstr(" MD5 FAILED");
+    x+=11;
+    for(i=0;i<pcm_n;i++){
+      if(p_vf[i]!=VERIFY_FAILED)continue;
+      snprintf(buf,20," %d",i+1);
+      if(x+(int)strlen(buf)+1>columns/2-21)break;
+      min_putstr(buf);
+      x+=strlen(buf);
+    }
+    min_unset();
+  }else
+    min_putstr(" verifying");
+  min_putchar(' ');
+}
+
 static int draw_timebar(int row){
   char buf[columns+1];
   timerow=row;
@@ -157,6 +236,7 @@ static int draw_timebar(int row){
     char *time=make_time_string(p_len,1);
     min_putstr(time);
   }
+  draw_verify(row,draw_failed(row,draw_loading(row)));
   return 1;
 }
 
@@ -294,8 +374,10 @@ void panel_redraw_full(void){
   min_flush();
 }
 
-void panel_init(pcm_t **pcm, int test_files, int test_mode, double start, double end, double size,
+void panel_init(pcm_t **pcm, int test_files, int test_mode, int bits,
+                double start, double end, double size,
                 int flip_mode,int repeat_mode,int trials,int gabba){
+  int i;
 
   if(min_panel_init((test_mode==3 ? test_files+6:7) + (gabba ? 1:0))){
     fprintf(stderr,"Unable to initialize terminal (possibly insufficient lines)\n");
@@ -309,7 +391,7 @@ void panel_init(pcm_t **pcm, int test_files, int test_mode, double start, double
 
   p_tm=test_mode;
   p_ch=pcm[0]->ch;
-  p_b=pcm[0]->currentbits;
+  p_b=bits;
   p_r=pcm[0]->rate;
   p_pl=0;
   p_st=start;
@@ -325,11 +407,61 @@ void panel_init(pcm_t **pcm, int test_files, int test_mode, double start, double
   pcm_p=pcm;
   p_pau=0;
   p_g=gabba;
+  p_ld=calloc(test_files,sizeof(*p_ld));
+  p_vf=calloc(test_files,sizeof(*p_vf));
+  p_fl=calloc(test_files,sizeof(*p_fl));
+  if(!p_ld || !p_vf || !p_fl){
+    fprintf(stderr,"Unable to allocate panel memory\n");
+    exit(101);
+  }
+  for(i=0;i<test_files;i++)
+    p_ld[i]=100;
 
   min_hidecur();
   panel_redraw_full();
 }
 
+void panel_update_length(double size){
+  p_len=size;
+  panel_redraw_full();
+}
+
+void panel_update_loaded(int n, double loaded){
+  int pct=floor(loaded*100);
+  if(pct>100)pct=100;
+  if(force || p_ld[n]!=pct){
+    p_ld[n]=pct;
+    draw_timebar(timerow);
+  }
+}
+
+void panel_update_verified(int n, int state){
+  if(force || p_vf[n]!=state){
+    p_vf[n]=state;
+    draw_timebar(timerow);
+    if(!force){
+      /* the bar was drawn over the times */
+      force=1;
+      panel_update_start(p_st);
+      panel_update_end(p_end);
+      force=0;
+    }
+  }
+}
+
+void panel_update_failed(int n, int failed){
+  if(force || p_fl[n]!=failed){
+    p_fl[n]=failed;
+    draw_timebar(timerow);
+    if(!force){
+      force=1;
+      panel_update_start(p_st);
+      panel_update_end(p_end);
+      force=0;
+    }
+  }
+}
+
 void panel_update_start(double time){
   if(force || p_st!=time){
     p_st=time;
@@ -731,8 +863,8 @@ void panel_toggle_keymap(){
     min_putstrb("      <backspc> ");
     min_putstr (": Seek to start  ");
     min_mvcur(x,o++);
-    min_putstrb("        s S e E ");
-    min_putstr (": set start/end  ");
+    min_putstrb("      s S e E w ");
+    min_putstr (": Start/end/whole");
     min_putstrb("            f r ");
     min_putstr (": Toggle modes   ");
     min_mvcur(x,o++);